@@ -28,6 +28,7 @@ void Engine::start(void) {
 
 	// Main loop.
 	const unsigned mapTickRate=8;
+	const int prefetchDistance=MapRegion::tilesSize*Physics::CoordsPerTile; // how far ahead of the player (in coords) to prefetch regions
 
 	unsigned tick=0;
 	for(tick=0; !stopFlag; ++tick) {
@@ -114,6 +115,10 @@ void Engine::start(void) {
 		if (playerObject!=NULL) {
 			const int moveSpeed=(playerRunning ? 2*Physics::CoordsPerTile : 1);
 			map->moveObject(playerObject, playerObject->getCoordTopLeft()+playerDelta*moveSpeed);
+
+			// Hint to the map which region we are heading towards so that it can be loaded before the camera reaches it.
+			if (playerDelta.x!=0 || playerDelta.y!=0)
+				map->prefetchRegionAtCoordVec(playerObject->getCoordTopLeft()+playerDelta*prefetchDistance);
 		}
 
 		// Tick map every so often.
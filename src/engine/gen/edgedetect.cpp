@@ -90,7 +90,7 @@ namespace Engine {
 			unsigned mapHeight=map->getHeight();
 
 			Util::TimeMs startTimeMs=Util::getTimeMs();
-			unsigned long long progressMax=mapWidth*mapHeight;
+			unsigned long long progressMax=((unsigned long long)mapWidth)*mapHeight;
 			unsigned long long progress=0.0;
 
 			// Give a progress update
@@ -104,13 +104,17 @@ namespace Engine {
 			modifyTileFunctorData.progressRatio=preModifyTilesProgressRatio;
 
 			uint64_t scratchBitMask=(((uint64_t)1)<<scratchBits[0])|(((uint64_t)1)<<scratchBits[1])|(((uint64_t)1)<<scratchBits[2])|(((uint64_t)1)<<scratchBits[3]);
-			Gen::modifyTiles(map, 0, 0, mapWidth, mapHeight, 1, &Gen::modifyTilesFunctorBitsetIntersection, (void *)(uintptr_t)~scratchBitMask, (progressFunctor!=NULL ? &edgeDetectTraceClearScratchBitsModifyTilesProgressFunctor : NULL), &modifyTileFunctorData);
+			Gen::modifyRegions(map, 0, 0, mapWidth, mapHeight, 1, &Gen::modifyRegionsFunctorBitsetIntersection, (void *)(uintptr_t)~scratchBitMask, (progressFunctor!=NULL ? &edgeDetectTraceClearScratchBitsModifyTilesProgressFunctor : NULL), &modifyTileFunctorData);
 
 			// Loop over regions
+			// Note: the working set keeps the regions around the current one loaded, as traces regularly cross into them and we would otherwise keep evicting and reloading them.
+			Engine::Map::Map::WorkingSet workingSet(map);
 			unsigned rYEnd=mapHeight/MapRegion::tilesSize;
 			for(unsigned rY=0; rY<rYEnd; ++rY) {
 				unsigned rXEnd=mapWidth/MapRegion::tilesSize;
 				for(unsigned rX=0; rX<rXEnd; ++rX) {
+					workingSet.setNeighbourhood(rX, rY, 1);
+
 					// Calculate region tile boundaries
 					unsigned tileX0=rX*MapRegion::tilesSize;
 					unsigned tileY0=rY*MapRegion::tilesSize;
@@ -130,6 +134,9 @@ namespace Engine {
 							if (!sampleFunctor(map, startX, startY, sampleUserData))
 								continue;
 
+							// Bracket this trace's modifications (see Map::WriteScope).
+							Engine::Map::Map::WriteScope writes;
+
 							// Setup variables
 							int currX=startX;
 							int currY=startY;
@@ -49,7 +49,7 @@ namespace Engine {
 			unsigned mapHeight=map->getHeight();
 
 			Util::TimeMs startTimeMs=Util::getTimeMs();
-			unsigned long long progressMax=mapWidth*mapHeight;
+			unsigned long long progressMax=((unsigned long long)mapWidth)*mapHeight;
 			unsigned long long progress=0.0;
 
 			unsigned groupId=0;
@@ -65,13 +65,20 @@ namespace Engine {
 			modifyTileFunctorData.progressRatio=preModifyTilesProgressRatio;
 
 			uint64_t scratchBitMask=(((uint64_t)1)<<scratchBit);
-			Gen::modifyTiles(map, 0, 0, mapWidth, mapHeight, 1, &modifyTilesFunctorBitsetIntersection, (void *)(uintptr_t)~scratchBitMask, (progressFunctor!=NULL ? &floodFillFillClearScratchBitModifyTilesProgressFunctor : NULL), &modifyTileFunctorData);
+			Gen::modifyRegions(map, 0, 0, mapWidth, mapHeight, 1, &modifyRegionsFunctorBitsetIntersection, (void *)(uintptr_t)~scratchBitMask, (progressFunctor!=NULL ? &floodFillFillClearScratchBitModifyTilesProgressFunctor : NULL), &modifyTileFunctorData);
 
 			// Loop over regions
+			// Note: the working set keeps the regions around the current one loaded, as traces regularly cross into them and we would otherwise keep evicting and reloading them.
+			Map::Map::WorkingSet workingSet(map);
 			unsigned rYEnd=mapHeight/MapRegion::tilesSize;
 			for(unsigned rY=0; rY<rYEnd; ++rY) {
 				unsigned rXEnd=mapWidth/MapRegion::tilesSize;
 				for(unsigned rX=0; rX<rXEnd; ++rX) {
+					workingSet.setNeighbourhood(rX, rY, 1);
+
+					// Bracket our modifications to this region's tiles (see Map::WriteScope).
+					Map::Map::WriteScope writes;
+
 					// Calculate region tile boundaries
 					unsigned tileX0=rX*MapRegion::tilesSize;
 					unsigned tileY0=rY*MapRegion::tilesSize;
@@ -111,6 +118,9 @@ namespace Engine {
 								Segment segment=segments.back();
 								segments.pop_back();
 
+								// Regions this segment modifies are only held until it is done (fills can span the whole map).
+								Map::Map::WriteScope segmentWrites;
+
 								// Extend segment left until we hit a boundary
 								unsigned extendLoopInitialX=segment.x0;
 								while(1) {
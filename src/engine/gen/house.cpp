@@ -33,6 +33,9 @@ namespace Engine {
 			// Calculate constants.
 			unsigned wallHeight=totalH-params->roofHeight;
 
+			// Bracket our modifications (see Map::WriteScope).
+			Map::Map::WriteScope writes;
+
 			// Add walls.
 			for(ty=0;ty<wallHeight;++ty)
 				for(tx=0;tx<totalW;++tx) {
@@ -15,6 +15,9 @@ namespace Engine {
 			unsigned functorArrayCount;
 			ModifyTilesManyEntry *functorArray;
 
+			ModifyRegionsFunctor *regionFunctor; // if non-NULL then this is called once per region instead of calling functorArray for each tile
+			void *regionFunctorUserData;
+
 			unsigned x, y, width, height; // args passed into modifyTiles
 
 			unsigned threadCount;
@@ -33,6 +36,7 @@ namespace Engine {
 			unsigned threadId;
 		};
 
+		void modifyTilesManyCommon(class Map *map, unsigned x, unsigned y, unsigned width, unsigned height, unsigned threadCount, size_t functorArrayCount, ModifyTilesManyEntry functorArray[], ModifyRegionsFunctor *regionFunctor, void *regionFunctorUserData, Util::ProgressFunctor *progressFunctor, void *progressUserData);
 		void modifyTilesManyThreadFunctor(ModifyTilesManyThreadData *threadData);
 
 		void modifyTilesFunctorBitsetUnion(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData) {
@@ -55,6 +59,54 @@ namespace Engine {
 				tile->setBitset(tile->getBitset()&bitset);
 		}
 
+		// Applies bitset=(bitset|orMask)&andMask to every tile in the given region.
+		static void modifyRegionsBitsetCommon(class Map *map, unsigned regionX, unsigned regionY, uint64_t orMask, uint64_t andMask) {
+			// Skip regions which cannot change, according to their summary statistics (which saves loading them at all).
+			// Note: this is only possible when clearing bits, as the union of the bitsets does not tell us whether every tile already has the bits being set.
+			if (orMask==0) {
+				MapStats::Entry stats;
+				if (!map->getRegionStats(regionX, regionY, &stats) || (stats.bitsetOr & ~andMask)==0)
+					return;
+			}
+
+			Engine::Map::Map::RegionView view(map, regionX, regionY, Engine::Map::Map::GetTileFlag::None);
+			if (!view.getIsValid())
+				return;
+
+			// Avoid expanding uniform regions (e.g. open ocean) which would be unchanged.
+			MapRegion *region=view.getRegion();
+			if (region->getIsUniform()) {
+				uint64_t bitset=region->getUniformTile()->getBitset();
+				if (((bitset|orMask)&andMask)==bitset)
+					return;
+			}
+
+			// Work a band at a time so that only bands which change need saving.
+			uint64_t *bitsets=view.getBitsets();
+			for(unsigned band=0; band<MapRegion::bandsCount; ++band) {
+				bool changed=false;
+				for(unsigned i=band*MapRegion::bandTileCount; i<(band+1)*MapRegion::bandTileCount; ++i) {
+					uint64_t bitset=(bitsets[i]|orMask)&andMask;
+					changed|=(bitset!=bitsets[i]);
+					bitsets[i]=bitset;
+				}
+				if (changed)
+					view.setDirtyAtOffset(0, band*MapRegion::bandRows);
+			}
+		}
+
+		void modifyRegionsFunctorBitsetUnion(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData) {
+			assert(map!=NULL);
+
+			modifyRegionsBitsetCommon(map, regionX, regionY, (uint64_t)(uintptr_t)userData, ~(uint64_t)0);
+		}
+
+		void modifyRegionsFunctorBitsetIntersection(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData) {
+			assert(map!=NULL);
+
+			modifyRegionsBitsetCommon(map, regionX, regionY, 0, (uint64_t)(uintptr_t)userData);
+		}
+
 		void modifyTiles(class Map *map, unsigned x, unsigned y, unsigned width, unsigned height, unsigned threadCount, ModifyTilesFunctor *functor, void *functorUserData, Util::ProgressFunctor *progressFunctor, void *progressUserData) {
 			assert(map!=NULL);
 			assert(functor!=NULL);
@@ -71,6 +123,20 @@ namespace Engine {
 			assert(functorArrayCount>0);
 			assert(functorArray!=NULL);
 
+			modifyTilesManyCommon(map, x, y, width, height, threadCount, functorArrayCount, functorArray, NULL, NULL, progressFunctor, progressUserData);
+		}
+
+		void modifyRegions(class Map *map, unsigned x, unsigned y, unsigned width, unsigned height, unsigned threadCount, ModifyRegionsFunctor *functor, void *functorUserData, Util::ProgressFunctor *progressFunctor, void *progressUserData) {
+			assert(map!=NULL);
+			assert(functor!=NULL);
+
+			modifyTilesManyCommon(map, x, y, width, height, threadCount, 0, NULL, functor, functorUserData, progressFunctor, progressUserData);
+		}
+
+		void modifyTilesManyCommon(class Map *map, unsigned x, unsigned y, unsigned width, unsigned height, unsigned threadCount, size_t functorArrayCount, ModifyTilesManyEntry functorArray[], ModifyRegionsFunctor *regionFunctor, void *regionFunctorUserData, Util::ProgressFunctor *progressFunctor, void *progressUserData) {
+			assert(map!=NULL);
+			assert(regionFunctor!=NULL || (functorArrayCount>0 && functorArray!=NULL));
+
 			// FIXME: buggy if x/y/width/height do not align to exact regions
 
 			// Record start time.
@@ -94,6 +160,8 @@ namespace Engine {
 			threadCommonData.map=map;
 			threadCommonData.functorArrayCount=functorArrayCount;
 			threadCommonData.functorArray=functorArray;
+			threadCommonData.regionFunctor=regionFunctor;
+			threadCommonData.regionFunctorUserData=regionFunctorUserData;
 			threadCommonData.x=x;
 			threadCommonData.y=y;
 			threadCommonData.width=width;
@@ -146,11 +214,25 @@ namespace Engine {
 			unsigned regionsPerThread=regionCount/threadData->common->threadCount;
 			const unsigned regionStartIndex=threadData->threadId*regionsPerThread;
 
+			// Hint a few regions ahead (so that the map can read their files together), but not so many that the region cache cannot hold every thread's current and upcoming regions at once.
+			const size_t cacheRegionCount=threadData->common->map->getRegionCacheBytes()/MapRegion::getMemoryUsageEstimate();
+			unsigned prefetchDistance=cacheRegionCount/(2*threadData->common->threadCount);
+			if (prefetchDistance>4)
+				prefetchDistance=4;
+			if (prefetchDistance<1)
+				prefetchDistance=1;
+
 			if (threadData->threadId==threadData->common->threadCount-1) {
 				// Final thread may have slightly more to do
 				regionsPerThread=regionCount-((threadData->common->threadCount-1)*regionsPerThread);
 			}
 
+			// Regions are only visited once each, so mark our accesses as streaming so that the pass does not push the regions the rest of the program is using out of the cache.
+			Engine::Map::Map::StreamingAccess streaming;
+
+			// Functors' Dirty accesses are bracketed by this, including to regions they create (which the view below cannot be given).
+			Engine::Map::Map::WriteScope writes;
+
 			// Loop over regions assigned to us
 			bool giveProgressUpdates=(threadData->threadId==threadData->common->threadCount-1 && threadData->common->progressFunctor!=NULL);
 			for(unsigned regionOffsetIndex=0; regionOffsetIndex<regionsPerThread && !threadData->common->stopFlag; ++regionOffsetIndex) {
@@ -162,13 +244,36 @@ namespace Engine {
 				unsigned baseTileX=regionX*MapRegion::tilesSize;
 				unsigned baseTileY=regionY*MapRegion::tilesSize;
 
-				// Loop over all tiles within this region
-				for(unsigned tileY=0; tileY<MapRegion::tilesSize && !threadData->common->stopFlag; ++tileY)
-					for(unsigned tileX=0; tileX<MapRegion::tilesSize; ++tileX) {
-						// Loop over functors
-						for(size_t functorId=0; functorId<threadData->common->functorArrayCount; ++functorId)
-							threadData->common->functorArray[functorId].functor(threadData->threadId, threadData->common->map, baseTileX+tileX, baseTileY+tileY, threadData->common->functorArray[functorId].userData);
-					}
+				// Hint to the map which regions we will need next so that they can be loaded (with their files read together) while we work on this one.
+				for(unsigned ahead=1; ahead<=prefetchDistance && regionOffsetIndex+ahead<regionsPerThread; ++ahead) {
+					unsigned nextRegionIndex=regionIndex+ahead;
+					threadData->common->map->prefetchRegion(regionX0+(nextRegionIndex%(regionX1-regionX0)), regionY0+(nextRegionIndex/(regionX1-regionX0)));
+				}
+
+				// Pin the region while we work on it (so that it is not evicted part way through by regions other threads load), and let region snapshots know that we may be modifying it (so that readers are never given a partially modified copy).
+				Engine::Map::Map::RegionView view(threadData->common->map, regionX, regionY, Engine::Map::Map::GetTileFlag::None);
+				MapRegion *region=view.getRegion();
+				if (region!=NULL)
+					region->beginWrite();
+
+				// Either call region functor or loop over all tiles within this region
+				if (threadData->common->regionFunctor!=NULL)
+					threadData->common->regionFunctor(threadData->threadId, threadData->common->map, regionX, regionY, threadData->common->regionFunctorUserData);
+				else {
+					for(unsigned tileY=0; tileY<MapRegion::tilesSize && !threadData->common->stopFlag; ++tileY)
+						for(unsigned tileX=0; tileX<MapRegion::tilesSize; ++tileX) {
+							// Loop over functors
+							for(size_t functorId=0; functorId<threadData->common->functorArrayCount; ++functorId)
+								threadData->common->functorArray[functorId].functor(threadData->threadId, threadData->common->map, baseTileX+tileX, baseTileY+tileY, threadData->common->functorArray[functorId].userData);
+						}
+				}
+
+				if (region!=NULL)
+					region->endWrite();
+
+				// Let go of this region and any neighbours the functors used.
+				writes.release();
+				streaming.release();
 
 				// Update progress (if we are the main thread).
 				if (giveProgressUpdates) {
@@ -8,8 +8,12 @@ namespace Engine {
 	namespace Gen {
 		void modifyTilesFunctorBitsetUnion(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData); // Interprets userData as a bitset (via uintptr_t) to OR with each tile's existing bitset.
 		void modifyTilesFunctorBitsetIntersection(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData); // Interprets userData as a bitset (via uintptr_t) to AND with each tile's existing bitset.
+		// As above but for use with modifyRegions, working on each region's bitsets directly (and only marking bands which actually change as dirty).
+		void modifyRegionsFunctorBitsetUnion(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData);
+		void modifyRegionsFunctorBitsetIntersection(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData);
 
 		typedef void (ModifyTilesFunctor)(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData);
+		typedef void (ModifyRegionsFunctor)(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData);
 
 		struct ModifyTilesManyEntry {
 			ModifyTilesFunctor *functor;
@@ -18,6 +22,7 @@ namespace Engine {
 
 		void modifyTiles(class Map *map, unsigned x, unsigned y, unsigned width, unsigned height, unsigned threadCount, ModifyTilesFunctor *functor, void *functorUserData, Util::ProgressFunctor *progressFunctor, void *progressUserData);
 		void modifyTilesMany(class Map *map, unsigned x, unsigned y, unsigned width, unsigned height, unsigned threadCount, size_t functorArrayCount, ModifyTilesManyEntry functorArray[], Util::ProgressFunctor *progressFunctor, void *progressUserData);
+		void modifyRegions(class Map *map, unsigned x, unsigned y, unsigned width, unsigned height, unsigned threadCount, ModifyRegionsFunctor *functor, void *functorUserData, Util::ProgressFunctor *progressFunctor, void *progressUserData); // Like modifyTiles but the functor is called once per region (e.g. for functors working on whole fields via MapRegion::getTileFileData).
 	};
 };
 
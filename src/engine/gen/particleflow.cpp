@@ -51,8 +51,12 @@ namespace Engine {
 			double trialsPerRegion=coverage*MapRegion::tilesSize*MapRegion::tilesSize;
 
 			// Loop over regions (this saves unnecessary loading and saving of regions compared to picking random locations across the whole area given).
+			// Note: particles dropped near the edge of a region regularly flow into its neighbours, so we keep those loaded too (see Map::WorkingSet).
+			Map::Map::WorkingSet workingSet(map);
 			unsigned rI=0;
 			for(auto const& regionPos: regionList) {
+				workingSet.setNeighbourhood(regionPos.x, regionPos.y, 1);
+
 				// Compute number of trials to perform for this region (may be 0).
 				unsigned trials=floor(trialsPerRegion)+(trialsPerRegion>Util::randFloatInInterval(0.0, 1.0) ? 1 : 0);
 
@@ -95,6 +99,9 @@ namespace Engine {
 
 				++rI;
 			}
+
+			// Unpin last region used.
+			view.clear();
 		}
 
 		void ParticleFlow::dropParticle(double xp, double yp) {
@@ -141,9 +148,11 @@ namespace Engine {
 					assert(tempY>=0 && tempY<map->getHeight());
 
 					// Lookup tile
-					MapTile *tempTile=map->getTileAtOffset(tempX, tempY, Map::Map::GetTileFlag::None);
-					if (tempTile!=NULL)
-						tempTile->setMoisture(tempTile->getMoisture()+w);
+					unsigned tempIndex;
+					if (viewTile(tempX, tempY, &tempIndex)) {
+						view.getMoistures()[tempIndex]+=w;
+						view.setDirtyAtOffset(tempX%MapRegion::tilesSize, tempY%MapRegion::tilesSize);
+					}
 				}
 
 				// calc gradient
@@ -291,12 +300,12 @@ namespace Engine {
 			assert(y>=0 && y<map->getHeight());
 
 			// Grab tile.
-			const MapTile *tile=map->getTileAtOffset(x, y, Map::Map::GetTileFlag::None);
-			if (tile==NULL)
+			unsigned index;
+			if (!viewTile(x, y, &index))
 				return unknownValue;
 
 			// Return height.
-			return tile->getHeight();
+			return view.getHeights()[index];
 		}
 
 		void ParticleFlow::depositAt(int x, int y, double w, double ds) {
@@ -308,13 +317,30 @@ namespace Engine {
 			assert(y>=0 && y<map->getHeight());
 
 			// Grab tile.
-			MapTile *tile=map->getTileAtOffset(x, y, Map::Map::GetTileFlag::Dirty);
-			if (tile==NULL)
+			unsigned index;
+			if (!viewTile(x, y, &index))
 				return;
 
 			// Adjust height.
 			double delta=ds*w;
-			tile->setHeight(tile->getHeight()+delta);
+			view.getHeights()[index]+=delta;
+			view.setDirtyAtOffset(x%MapRegion::tilesSize, y%MapRegion::tilesSize);
+		}
+
+		bool ParticleFlow::viewTile(int x, int y, unsigned *index) {
+			assert(x>=0 && x<map->getWidth());
+			assert(y>=0 && y<map->getHeight());
+
+			// Move view to a different region if needed.
+			unsigned regionX=x/MapRegion::tilesSize;
+			unsigned regionY=y/MapRegion::tilesSize;
+			if (!view.getIsValid() || view.getRegionX()!=regionX || view.getRegionY()!=regionY) {
+				if (!view.setRegion(regionX, regionY, Map::Map::GetTileFlag::None))
+					return false;
+			}
+
+			*index=(y%MapRegion::tilesSize)*Map::Map::RegionView::stride+(x%MapRegion::tilesSize);
+			return true;
 		}
 
 	};
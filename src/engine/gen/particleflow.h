@@ -9,7 +9,7 @@ namespace Engine {
 
 		class ParticleFlow {
 		public:
-			ParticleFlow(class Map *map, int erodeRadius, bool incMoisture): map(map), erodeRadius(erodeRadius), incMoisture(incMoisture) {
+			ParticleFlow(class Map *map, int erodeRadius, bool incMoisture): map(map), erodeRadius(erodeRadius), incMoisture(incMoisture), view(map) {
 				double skew=0.8;
 				seaLevelExcess=map->minHeight+(map->seaLevel-map->minHeight)*skew;
 			}; // Requires the map have seaLevel set.
@@ -23,7 +23,9 @@ namespace Engine {
 			int erodeRadius;
 			bool incMoisture;
 			double seaLevelExcess;
+			Engine::Map::Map::RegionView view; // region of the most recently accessed tile (particles rarely leave a region, so this avoids a lookup per tile)
 
+			bool viewTile(int x, int y, unsigned *index); // Points view at the region containing tile (x,y) and returns the tile's index within its arrays. Returns false if the region could not be loaded.
 			double hMap(int x, int y, double unknownValue); // Returns height of tile at (x,y), returning unknownValue if tile is out of bounds or could not be loaded.
 			void depositAt(int x, int y, double w, double ds); // Adjusts the height of a tile at the given (x,y). Does nothing if the tile is out of bounds or could not be loaded.
 		};
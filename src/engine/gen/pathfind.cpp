@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cmath>
 #include <limits>
 #include <queue>
@@ -14,7 +15,7 @@ namespace Engine {
 		bool operator<(PathFind::SearchFullQueueEntry const &lhs, PathFind::SearchFullQueueEntry const &rhs);
 		bool operator<(PathFind::SearchGoalQueueEntry const &lhs, PathFind::SearchGoalQueueEntry const &rhs);
 
-		void pathFindClearModifyTilesFunctor(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData);
+		void pathFindClearModifyRegionsFunctor(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData);
 
 		float pathFindDistanceFunctorDistance(class Map *map, unsigned x1, unsigned y1, unsigned x2, unsigned y2, void *userData) {
 			assert(map!=NULL);
@@ -72,7 +73,7 @@ namespace Engine {
 		}
 
 		void PathFind::clear(unsigned threadCount, Util::ProgressFunctor *progressFunctor, void *progressUserData) {
-			modifyTiles(map, 0, 0, map->getWidth(), map->getHeight(), threadCount, &pathFindClearModifyTilesFunctor, NULL, progressFunctor, progressUserData);
+			modifyRegions(map, 0, 0, map->getWidth(), map->getHeight(), threadCount, &pathFindClearModifyRegionsFunctor, NULL, progressFunctor, progressUserData);
 		}
 
 		void PathFind::searchFull(unsigned endX, unsigned endY, DistanceFunctor *distanceFunctor, void *distanceUserData, Util::ProgressFunctor *progressFunctor, void *progressUserData) {
@@ -93,14 +94,14 @@ namespace Engine {
 			setTileScratchValue(endX, endY, 0.0);
 
 			PathFind::SearchFullQueueEntry endEntry={
-				.x=(uint16_t)endX,
-				.y=(uint16_t)endY,
+				.x=(uint32_t)endX,
+				.y=(uint32_t)endY,
 				.distance=(float)0.0,
 			};
 			queue.push(endEntry);
 
 			// Process nodes/tiles until we reach destination or run out of tiles
-			unsigned long long totalTiles=map->getWidth()*map->getHeight();
+			unsigned long long totalTiles=((unsigned long long)map->getWidth())*map->getHeight();
 			unsigned long long handledTiles=0;
 
 			while(!queue.empty()) {
@@ -130,8 +131,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchFullQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 					};
 					queue.push(newEntry);
@@ -146,8 +147,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchFullQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 					};
 					queue.push(newEntry);
@@ -162,8 +163,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchFullQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 					};
 					queue.push(newEntry);
@@ -178,8 +179,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchFullQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 					};
 					queue.push(newEntry);
@@ -220,8 +221,8 @@ namespace Engine {
 			setTileScratchValue(endX, endY, 0.0);
 
 			PathFind::SearchGoalQueueEntry endEntry={
-				.x=(uint16_t)endX,
-				.y=(uint16_t)endY,
+				.x=(uint32_t)endX,
+				.y=(uint32_t)endY,
 				.distance=(float)0.0,
 				.estimate=0.0, // not correct but doesn't matter as will always be processed first regardless
 			};
@@ -231,11 +232,20 @@ namespace Engine {
 			unsigned progressCounter=0; // number of nodes/tiles we have processed
 			unsigned progressMax=Util::wrappingDist(startX, startY, endX, endY, map->getWidth(), map->getHeight()); // distance between start and end tiles - used as a loose upper bound to estimate progress
 			unsigned progressMin=progressMax; // distance for closest node/tile found so far
+			Map::Map::WorkingSet workingSet(map); // regions around the most recently popped tile (the heuristic keeps the search moving in one direction, so these are likely to be needed again soon)
+			unsigned workingSetRegionX=UINT_MAX, workingSetRegionY=UINT_MAX;
 			while(!queue.empty()) {
 				// Pop lowest distance entry
 				PathFind::SearchGoalQueueEntry entry=queue.top();
 				queue.pop();
 
+				// Keep neighbouring regions loaded
+				if (entry.x/MapRegion::tilesSize!=workingSetRegionX || entry.y/MapRegion::tilesSize!=workingSetRegionY) {
+					workingSetRegionX=entry.x/MapRegion::tilesSize;
+					workingSetRegionY=entry.y/MapRegion::tilesSize;
+					workingSet.setNeighbourhood(workingSetRegionX, workingSetRegionY, 1);
+				}
+
 				// If distance recorded in the tile is lower than the distance stored in the struct then this tile was added to the queue again but with a lower distance.
 				// Therefore the entry with this lower distance will have already been processed by now and so we can skip processing this tile again.
 				float tileDistance=getTileScratchValue(entry.x, entry.y);
@@ -267,8 +277,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchGoalQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 						.estimate=newd+heuristicFunctor(map, nx, ny, startX, startY, heuristicUserData),
 					};
@@ -284,8 +294,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchGoalQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 						.estimate=newd+heuristicFunctor(map, nx, ny, startX, startY, heuristicUserData),
 					};
@@ -301,8 +311,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchGoalQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 						.estimate=newd+heuristicFunctor(map, nx, ny, startX, startY, heuristicUserData),
 					};
@@ -318,8 +328,8 @@ namespace Engine {
 				if (delta>0.0 && newd<nd) {
 					setTileScratchValue(nx, ny, newd);
 					PathFind::SearchGoalQueueEntry newEntry={
-						.x=(uint16_t)nx,
-						.y=(uint16_t)ny,
+						.x=(uint32_t)nx,
+						.y=(uint32_t)ny,
 						.distance=newd,
 						.estimate=newd+heuristicFunctor(map, nx, ny, startX, startY, heuristicUserData),
 					};
@@ -367,7 +377,16 @@ namespace Engine {
 
 			// Loop until we reach goal or dead end
 			unsigned progressCounter=0;
+			Map::Map::WorkingSet workingSet(map); // regions around the current tile, as paths often run along region borders
+			unsigned workingSetRegionX=UINT_MAX, workingSetRegionY=UINT_MAX;
 			while(1) {
+				// Keep neighbouring regions loaded
+				if (x/MapRegion::tilesSize!=workingSetRegionX || y/MapRegion::tilesSize!=workingSetRegionY) {
+					workingSetRegionX=x/MapRegion::tilesSize;
+					workingSetRegionY=y/MapRegion::tilesSize;
+					workingSet.setNeighbourhood(workingSetRegionX, workingSetRegionY, 1);
+				}
+
 				// This is a path tile - call user's functor
 				functor(0, map, x, y, functorUserData);
 
@@ -459,6 +478,7 @@ namespace Engine {
 
 		void PathFind::setTileScratchValue(int x, int y, float value) {
 			// Grab tile.
+			Engine::Map::Map::WriteScope writes;
 			MapTile *tile=map->getTileAtOffset(x, y, Engine::Map::Map::GetTileFlag::CreateDirty);
 			if (tile==NULL)
 				return;
@@ -477,17 +497,19 @@ namespace Engine {
 			return lhs.estimate>rhs.estimate;
 		}
 
-		void pathFindClearModifyTilesFunctor(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData) {
+		void pathFindClearModifyRegionsFunctor(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData) {
 			assert(map!=NULL);
 			assert(userData==NULL);
 
-			// Grab tile.
-			MapTile *tile=map->getTileAtOffset(x, y, Engine::Map::Map::GetTileFlag::Dirty);
-			if (tile==NULL)
+			// Grab region.
+			Engine::Map::Map::RegionView view(map, regionX, regionY, Engine::Map::Map::GetTileFlag::Dirty);
+			if (!view.getIsValid())
 				return;
 
-			// Update tile.
-			tile->setScratchFloat(std::numeric_limits<float>::max());
+			// Update tiles.
+			MapTile::FileData *fileData=view.getTileFileData();
+			for(unsigned i=0; i<MapTile::FileData::tileCount; ++i)
+				fileData->scratch[i].scratchFloat=std::numeric_limits<float>::max();
 		}
 
 	};
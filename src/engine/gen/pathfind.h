@@ -18,12 +18,12 @@ namespace Engine {
 			// Note that it uses the tile's scratch field to store distance to the end tile.
 
 			struct SearchFullQueueEntry {
-				uint16_t x, y;
+				uint32_t x, y;
 				float distance;
 			};
 
 			struct SearchGoalQueueEntry {
-				uint16_t x, y;
+				uint32_t x, y;
 				float distance;
 				float estimate; // distance + remaining distance estimate, as per A*
 			};
@@ -108,7 +108,7 @@ namespace Engine {
 					.progressUserData=progressUserData,
 				};
 
-				Gen::modifyTiles(map, x, y, width, height, threadCount, &searchManyModifyTilesFunctor, &data, (progressFunctor!=NULL ? &searchManyModifyTilesProgressFunctor : NULL), &progressData);
+				Gen::modifyRegions(map, x, y, width, height, threadCount, &searchManyModifyRegionsFunctor, &data, (progressFunctor!=NULL ? &searchManyModifyTilesProgressFunctor : NULL), &progressData);
 
 				// Update min/max based on collected data.
 				// TODO: this can be improved by looping to find window which contains the fraction we want, then updating min/max together and breaking
@@ -183,19 +183,77 @@ namespace Engine {
 				if (entry->sampleRange/2.0<=entry->epsilon)
 					continue;
 
-				// Grab value.
+				// Grab value and add to tally.
 				double value=entry->getFunctor(map, x, y, entry->getUserData);
+				searchAddSamples(entry, value, 1);
+			}
+		}
+
+		void searchManyModifyRegionsFunctor(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData) {
+			assert(map!=NULL);
+			assert(userData!=NULL);
+
+			SearchData *data=(SearchData *)userData;
 
-				// Compute sample index.
-				int sample=searchValueToSample(entry, value);
+			const MapRegion *region=map->getRegionAtOffset(regionX, regionY, false);
+			bool regionIsUniform=(region!=NULL && region->getIsUniform());
 
-				// Update tally array and total.
-				// TODO: Fix this to make the increments thread safe (make the struct members atomic presumably, or otherwise split the counters for each thread and combine at the end)
-				++entry->sampleTally[sample];
-				++entry->sampleTotal;
+			// Loop over all operations we need to perform
+			for(size_t i=0; i<data->count; ++i) {
+				SearchDataEntry *entry=&data->entries[i];
+
+				// Have we hit desired accuracy for this operation?
+				if (entry->sampleRange/2.0<=entry->epsilon)
+					continue;
+
+				// If every tile gives the same value then tally them all at once.
+				double value;
+				if (regionIsUniform && searchGetUniformValue(entry, region, &value)) {
+					searchAddSamples(entry, value, MapRegion::tilesSize*MapRegion::tilesSize);
+					continue;
+				}
+
+				// Otherwise loop over every tile.
+				unsigned baseTileX=regionX*MapRegion::tilesSize;
+				unsigned baseTileY=regionY*MapRegion::tilesSize;
+				for(unsigned tileY=0; tileY<MapRegion::tilesSize; ++tileY)
+					for(unsigned tileX=0; tileX<MapRegion::tilesSize; ++tileX) {
+						value=entry->getFunctor(map, baseTileX+tileX, baseTileY+tileY, entry->getUserData);
+						searchAddSamples(entry, value, 1);
+					}
 			}
 		}
 
+		void searchAddSamples(SearchDataEntry *entry, double value, unsigned long long int count) {
+			assert(entry!=NULL);
+
+			// Compute sample index.
+			int sample=searchValueToSample(entry, value);
+
+			// Update tally array and total.
+			// TODO: Fix this to make the increments thread safe (make the struct members atomic presumably, or otherwise split the counters for each thread and combine at the end)
+			entry->sampleTally[sample]+=count;
+			entry->sampleTotal+=count;
+		}
+
+		bool searchGetUniformValue(const SearchDataEntry *entry, const MapRegion *region, double *value) {
+			assert(entry!=NULL);
+			assert(region!=NULL && region->getIsUniform());
+			assert(value!=NULL);
+
+			const MapTile *tile=region->getUniformTile();
+			if (entry->getFunctor==&searchGetFunctorHeight)
+				*value=tile->getHeight();
+			else if (entry->getFunctor==&searchGetFunctorTemperature)
+				*value=tile->getTemperature();
+			else if (entry->getFunctor==&searchGetFunctorMoisture)
+				*value=tile->getMoisture();
+			else
+				return false;
+
+			return true;
+		}
+
 		double searchGetFunctorHeight(class Map *map, unsigned x, unsigned y, void *userData) {
 			assert(map!=NULL);
 			assert(userData==NULL);
@@ -6,6 +6,7 @@
 namespace Engine {
 	namespace Gen {
 		void searchManyModifyTilesFunctor(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData);
+		void searchManyModifyRegionsFunctor(unsigned threadId, class Map *map, unsigned regionX, unsigned regionY, void *userData); // As above but for a whole region at once, which is constant time for uniform regions.
 
 		double searchGetFunctorHeight(class Map *map, unsigned x, unsigned y, void *userData);
 		double searchGetFunctorTemperature(class Map *map, unsigned x, unsigned y, void *userData);
@@ -50,6 +51,8 @@ namespace Engine {
 
 		int searchValueToSample(const SearchDataEntry *entry, double value);
 		double searchSampleToValue(const SearchDataEntry *entry, int sample);
+		void searchAddSamples(SearchDataEntry *entry, double value, unsigned long long int count);
+		bool searchGetUniformValue(const SearchDataEntry *entry, const MapRegion *region, double *value); // If entry's functor only depends on tile data then sets value to its result for every tile in the given uniform region and returns true.
 	};
 };
 
@@ -8,6 +8,7 @@
 namespace Engine {
 	namespace Gen {
 		// Recalculate map min/max values for height, temperature and moisture.
+		// Note: this only needs to read the summary statistics kept for each region (see Map::getRegionStats), other than for regions with unsaved changes.
 		void recalculateStats(class Map *map, unsigned threadCount, Util::ProgressFunctor *progressFunctor, void *progressUserData);
 	};
 };
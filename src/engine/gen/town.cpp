@@ -104,6 +104,7 @@ namespace Engine {
 				// Add road.
 				roads.push_back(road);
 
+				Map::Map::WriteScope writes; // see Map::WriteScope
 				int a, b;
 				for(a=road.y0; a<road.trueY1; ++a)
 					for(b=road.x0; b<road.trueX1; ++b)
@@ -256,6 +257,7 @@ namespace Engine {
 					int signX=signOffset+houseParams->doorXOffset+houseData.x;
 
 					// Add sign.
+					Map::Map::WriteScope writes; // see Map::WriteScope
 					map->getTileAtCoordVec(CoordVec(signX*Physics::CoordsPerTile, (houseData.y+houseData.mapH-2)*Physics::CoordsPerTile), Map::Map::GetTileFlag::CreateDirty)->setLayer(houseParams->tileLayer, {.textureId=signTextureId, .hitmask=HitMask(HitMask::fullMask)});
 				}
 			}
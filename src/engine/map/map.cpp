@@ -1,16 +1,16 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <dirent.h>
 #include <cstdio>
 #include <cstdlib>
 #include <dirent.h>
 #include <fcntl.h>
-#include <filesystem>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "map.h"
-#include "maptiled.h"
 #include "../graphics/renderer.h"
 #include "../util.h"
 
@@ -18,37 +18,146 @@ using namespace Engine::Graphics;
 
 namespace Engine {
 	namespace Map {
-		Map::Map(const char *mapBaseDirPath, unsigned mapWidth, unsigned mapHeight): mapWidth(mapWidth), mapHeight(mapHeight) {
+		// Last region accessed by each thread (see prefetchNoteAccess).
+		struct PrefetchAccess {
+			const class Map *map;
+			unsigned regionX, regionY;
+			int dx, dy;
+		};
+		static thread_local PrefetchAccess prefetchLastAccess={NULL, 0, 0, 0, 0};
+
+		// Number of StreamingAccess scopes the current thread is within.
+		static thread_local unsigned streamingAccessDepth=0;
+
+		// Regions pinned by the current thread's StreamingAccess scopes (see Map::streamingPin).
+		struct StreamingPin {
+			class Map *map;
+			unsigned regionX, regionY;
+		};
+		static thread_local std::vector<StreamingPin> streamingPins;
+		static thread_local size_t streamingPinsLast=0; // index of the last entry found, checked first
+
+		static bool streamingPinsFind(const class Map *map, unsigned regionX, unsigned regionY) {
+			if (streamingPinsLast<streamingPins.size()) {
+				const StreamingPin *pin=&streamingPins[streamingPinsLast];
+				if (pin->map==map && pin->regionX==regionX && pin->regionY==regionY)
+					return true;
+			}
+			for(size_t i=0; i<streamingPins.size(); ++i)
+				if (streamingPins[i].map==map && streamingPins[i].regionX==regionX && streamingPins[i].regionY==regionY) {
+					streamingPinsLast=i;
+					return true;
+				}
+			return false;
+		}
+
+		// Number of WriteScopes the current thread is within.
+		static thread_local unsigned writeScopeDepth=0;
+
+		// Regions written within the current thread's WriteScopes (see Map::writeScopeRegion).
+		struct WriteScopeEntry {
+			class Map *map;
+			MapRegion *region;
+			unsigned regionX, regionY;
+		};
+		static thread_local std::vector<WriteScopeEntry> writeScopeEntries;
+		static thread_local size_t writeScopeEntriesLast=0; // index of the last entry found, checked first
+
+		// Regions each thread has looked up most recently, which are not freed while listed (see Map::regionProtect and Map::regionRetire).
+		// Note: records are never freed, only reused once their thread exits.
+		static const unsigned regionHazardsMax=8;
+		struct RegionHazards {
+			std::atomic<const MapRegion *> regions[regionHazardsMax];
+			unsigned next; // slot to overwrite next
+			std::atomic<bool> inUse;
+			RegionHazards *nextRecord;
+		};
+		static std::atomic<RegionHazards *> regionHazardsList(NULL);
+
+		// Releases the current thread's record when it exits.
+		struct RegionHazardsOwner {
+			RegionHazards *record=NULL;
+
+			~RegionHazardsOwner() {
+				if (record==NULL)
+					return;
+				for(unsigned i=0; i<regionHazardsMax; ++i)
+					record->regions[i].store(NULL, std::memory_order_release);
+				record->inUse.store(false, std::memory_order_release);
+			}
+		};
+		static thread_local RegionHazardsOwner regionHazardsOwner;
+
+		static RegionHazards *regionHazardsGet(void) {
+			RegionHazards *record=regionHazardsOwner.record;
+			if (record!=NULL)
+				return record;
+
+			// Reuse a record left by an exited thread, otherwise add a new one.
+			for(record=regionHazardsList.load(std::memory_order_acquire); record!=NULL; record=record->nextRecord) {
+				bool expected=false;
+				if (!record->inUse.load(std::memory_order_relaxed) && record->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+					break;
+			}
+			if (record==NULL) {
+				record=new RegionHazards();
+				record->inUse.store(true, std::memory_order_relaxed);
+				record->nextRecord=regionHazardsList.load(std::memory_order_relaxed);
+				while(!regionHazardsList.compare_exchange_weak(record->nextRecord, record, std::memory_order_release, std::memory_order_relaxed))
+					;
+			}
+			record->next=0;
+
+			regionHazardsOwner.record=record;
+			return record;
+		}
+
+		static void regionHazardsClear(void) {
+			RegionHazards *record=regionHazardsOwner.record;
+			if (record==NULL)
+				return;
+			for(unsigned i=0; i<regionHazardsMax; ++i)
+				record->regions[i].store(NULL, std::memory_order_release);
+		}
+
+		static bool regionHazardsFind(const MapRegion *region) {
+			for(RegionHazards *record=regionHazardsList.load(std::memory_order_acquire); record!=NULL; record=record->nextRecord)
+				for(unsigned i=0; i<regionHazardsMax; ++i)
+					if (record->regions[i].load(std::memory_order_seq_cst)==region)
+						return true;
+			return false;
+		}
+
+		const char Map::manifestMagic[4]={'6', '4', 'G', 'M'};
+
+		Map::Map(const char *mapBaseDirPath, unsigned gMapWidth, unsigned gMapHeight, const Options *options) {
 			assert(mapBaseDirPath!=NULL);
 
 			// Round width and height up to a a multiple of the region tile size (but do not exceed maximum size allowed)
-			if (mapWidth<1) mapWidth=1;
-			if (mapHeight<1) mapHeight=1;
-			if (mapWidth>Map::regionsSize*MapRegion::tilesSize) mapWidth=Map::regionsSize*MapRegion::tilesSize;
-			if (mapHeight>Map::regionsSize*MapRegion::tilesSize) mapHeight=Map::regionsSize*MapRegion::tilesSize;
+			if (gMapWidth<1) gMapWidth=1;
+			if (gMapHeight<1) gMapHeight=1;
+			if (gMapWidth>Map::regionsSize*MapRegion::tilesSize) gMapWidth=Map::regionsSize*MapRegion::tilesSize;
+			if (gMapHeight>Map::regionsSize*MapRegion::tilesSize) gMapHeight=Map::regionsSize*MapRegion::tilesSize;
 
-			mapWidth=((mapWidth+(MapRegion::tilesSize-1))/MapRegion::tilesSize)*MapRegion::tilesSize;
-			mapHeight=((mapHeight+(MapRegion::tilesSize-1))/MapRegion::tilesSize)*MapRegion::tilesSize;
+			mapWidth=((gMapWidth+(MapRegion::tilesSize-1))/MapRegion::tilesSize)*MapRegion::tilesSize;
+			mapHeight=((gMapHeight+(MapRegion::tilesSize-1))/MapRegion::tilesSize)*MapRegion::tilesSize;
 
 			// Set Map to clean state.
-			unsigned i, j;
+			unsigned i;
 
 			lockFd=-1;
+			readOnly=false; // new maps are always writable
 
 			baseDir=NULL;
 			texturesDir=NULL;
 			itemsDir=NULL;
 			regionsDir=NULL;
 			mapTiledDir=NULL;
+			pyramidDir=NULL;
 
-			regionsCount=0;
-			for(i=0; i<regionsLoadedMax; ++i)
-				regionsByIndex[i]=NULL;
-			for(i=0; i<regionsLoadedMax; ++i)
-				regionsByAge[i]=NULL;
-			for(i=0; i<regionsSize; ++i)
-				for(j=0; j<regionsSize; ++j)
-					regionsByOffset[i][j].ptr=NULL;
+			regionsInit(options);
+			prefetchInit(options);
+			saveInit(options);
 
 			for(i=0; i<MapTexture::IdMax; ++i)
 				textures[i]=NULL;
@@ -81,6 +190,11 @@ namespace Engine {
 			mapTiledDir=(char *)malloc(mapTiledDirPathLen+1); // TODO: check return
 			sprintf(mapTiledDir, "%s/%s", mapBaseDirPath, mapTiledDirName);
 
+			const char *pyramidDirName="pyramid";
+			size_t pyramidDirPathLen=mapBaseDirPathLen+1+strlen(pyramidDirName); // +1 is for '/'
+			pyramidDir=(char *)malloc(pyramidDirPathLen+1); // TODO: check return
+			sprintf(pyramidDir, "%s/%s", mapBaseDirPath, pyramidDirName);
+
 			// Create map
 			// Note: we do this here instead of with the other directories in createMetadata because otherwise we would not be able to create the lock file below.
 			if (Util::isDir(mapBaseDirPath))
@@ -98,32 +212,46 @@ namespace Engine {
 
 			// Create metadata and region directories etc.
 			saveMetadata();
-		}
+			saveManifest();
 
-		Map::Map(const char *mapBaseDirPath, bool ignoreLock) {
-			// Load map
-			DIR *dirFd;
-			struct dirent *dirEntry;
+			// Create region index.
+			if (!regionsIndexInit())
+				throw std::runtime_error("could not allocate region index");
+
+			// Create region pack file if needed (which is complete as there are no regions yet).
+			if (!regionsPackOpen(options) || (regionsPack!=NULL && !regionsPack->setIsComplete(true)))
+				throw std::runtime_error("could not create region pack file");
 
+			// Create region stats file.
+			if (!regionsStatsOpen())
+				throw std::runtime_error("could not create region stats file");
+
+			// Create region existence file.
+			if (!regionsExistenceOpen())
+				throw std::runtime_error("could not create region existence file");
+
+			// Create region log file if requested.
+			if (!regionsLogOpen(options))
+				throw std::runtime_error("could not create region log file");
+		}
+
+		Map::Map(const char *mapBaseDirPath, bool ignoreLock, const Options *options) {
 			// Set Map to clean state.
-			unsigned i, j;
+			unsigned i;
 
 			lockFd=-1;
+			readOnly=(options!=NULL && options->readOnly);
 
 			baseDir=NULL;
 			texturesDir=NULL;
 			itemsDir=NULL;
 			regionsDir=NULL;
 			mapTiledDir=NULL;
+			pyramidDir=NULL;
 
-			regionsCount=0;
-			for(i=0; i<regionsLoadedMax; ++i)
-				regionsByIndex[i]=NULL;
-			for(i=0; i<regionsLoadedMax; ++i)
-				regionsByAge[i]=NULL;
-			for(i=0; i<regionsSize; ++i)
-				for(j=0; j<regionsSize; ++j)
-					regionsByOffset[i][j].ptr=NULL;
+			regionsInit(options);
+			prefetchInit(options);
+			saveInit(options);
 
 			for(i=0; i<MapTexture::IdMax; ++i)
 				textures[i]=NULL;
@@ -156,20 +284,163 @@ namespace Engine {
 			mapTiledDir=(char *)malloc(mapTiledDirPathLen+1); // TODO: check return
 			sprintf(mapTiledDir, "%s/%s", mapBaseDirPath, mapTiledDirName);
 
+			const char *pyramidDirName="pyramid";
+			size_t pyramidDirPathLen=mapBaseDirPathLen+1+strlen(pyramidDirName); // +1 is for '/'
+			pyramidDir=(char *)malloc(pyramidDirPathLen+1); // TODO: check return
+			sprintf(pyramidDir, "%s/%s", mapBaseDirPath, pyramidDirName);
+
 			// Check map exists
 			if (!Util::isDir(mapBaseDirPath))
 				throw std::runtime_error("no such map");
 
-			// Attempt to obtain the lock file
-			char lockPath[1024]; // TODO: better
-			sprintf(lockPath, "%s/lock", mapBaseDirPath);
+			// Attempt to obtain the lock file (unless read only, in which case other processes may have the map open too).
+			if (!readOnly) {
+				char lockPath[1024]; // TODO: better
+				sprintf(lockPath, "%s/lock", mapBaseDirPath);
 
-			if (ignoreLock)
-				unlink(lockPath);
+				if (ignoreLock)
+					unlink(lockPath);
 
-			lockFd=open(lockPath, O_RDWR|O_CREAT|O_EXCL, S_IWUSR);
-			if (lockFd==-1)
-				throw std::runtime_error("locked");
+				lockFd=open(lockPath, O_RDWR|O_CREAT|O_EXCL, S_IWUSR);
+				if (lockFd==-1)
+					throw std::runtime_error("locked");
+			}
+
+			// Load metadata, textures and items (from the manifest if possible, otherwise scanning for their individual files).
+			bool hasManifest=manifestLoad();
+			if (!hasManifest)
+				scanLoad();
+
+			// Create region index.
+			if (!regionsIndexInit())
+				throw std::runtime_error("could not allocate region index");
+
+			// Open region pack file if the map has one (or one has been requested).
+			if (!regionsPackOpen(options))
+				throw std::runtime_error("could not open region pack file");
+
+			// Open region stats file.
+			if (!regionsStatsOpen())
+				throw std::runtime_error("could not open region stats file");
+
+			// Open region existence file.
+			if (!regionsExistenceOpen())
+				throw std::runtime_error("could not open region existence file");
+
+			// Open region log file if the map has one (or one has been requested).
+			if (!regionsLogOpen(options))
+				throw std::runtime_error("could not open region log file");
+
+			// Write a manifest so that this map opens quickly next time.
+			if (!hasManifest && !readOnly)
+				saveManifest(); // TODO: Check return.
+
+			// Note: Regions are loaded on demand.
+		}
+
+		bool Map::manifestLoad(void) {
+			char manifestPath[1024]; // TODO: Prevent overflows.
+			sprintf(manifestPath, "%s/manifest", baseDir);
+
+			int fd=open(manifestPath, O_RDONLY);
+			if (fd==-1)
+				return false;
+
+			// Read file (which usually fits within the initial read).
+			uint8_t *data=(uint8_t *)malloc(manifestReadSize);
+			if (data==NULL) {
+				close(fd);
+				return false;
+			}
+
+			ssize_t readSize=pread(fd, data, manifestReadSize, 0);
+			const ManifestHeader *header=(const ManifestHeader *)data;
+			if (readSize<(ssize_t)sizeof(ManifestHeader) || memcmp(header->magic, manifestMagic, sizeof(manifestMagic))!=0 || header->version!=manifestVersion) {
+				close(fd);
+				free(data);
+				return false;
+			}
+
+			if (header->size>manifestReadSize) {
+				size_t size=header->size;
+				uint8_t *newData=(uint8_t *)realloc(data, size);
+				if (newData==NULL) {
+					close(fd);
+					free(data);
+					return false;
+				}
+				data=newData;
+				header=(const ManifestHeader *)data;
+
+				ssize_t remainingSize=pread(fd, data+readSize, size-readSize, readSize);
+				readSize=(remainingSize>=0 ? readSize+remainingSize : -1);
+			}
+
+			close(fd);
+
+			// Check everything is within the file (which must be complete) before loading anything.
+			size_t stringsOffset=sizeof(ManifestHeader)+header->textureCount*sizeof(ManifestTexture)+header->itemCount*sizeof(ManifestItem);
+			bool valid=(readSize==(ssize_t)header->size && stringsOffset<=header->size);
+			valid&=(header->mapWidth>0 && header->mapWidth<=regionsSize*MapRegion::tilesSize);
+			valid&=(header->mapHeight>0 && header->mapHeight<=regionsSize*MapRegion::tilesSize);
+
+			const ManifestTexture *manifestTextures=(const ManifestTexture *)(data+sizeof(ManifestHeader));
+			const ManifestItem *manifestItems=(const ManifestItem *)(manifestTextures+header->textureCount);
+			const char *strings=(const char *)(data+stringsOffset);
+			size_t stringsSize=header->size-stringsOffset;
+			valid&=(stringsSize==0 || strings[stringsSize-1]=='\0'); // so that every string is terminated
+
+			for(unsigned i=0; i<header->textureCount && valid; ++i)
+				valid&=(manifestTextures[i].id<MapTexture::IdMax && manifestTextures[i].scale>0 && manifestTextures[i].fileNameOffset<stringsSize);
+			for(unsigned i=0; i<header->itemCount && valid; ++i)
+				valid&=(manifestItems[i].id<MapItem::IdMax && manifestItems[i].nameOffset<stringsSize);
+
+			if (!valid) {
+				fprintf(stderr,"warning: ignoring invalid map manifest at '%s'\n", manifestPath);
+				free(data);
+				return false;
+			}
+
+			// Load metadata.
+			mapWidth=header->mapWidth;
+			mapHeight=header->mapHeight;
+			minHeight=header->minHeight;
+			maxHeight=header->maxHeight;
+			minTemperature=header->minTemperature;
+			maxTemperature=header->maxTemperature;
+			minMoisture=header->minMoisture;
+			maxMoisture=header->maxMoisture;
+			seaLevel=header->seaLevel;
+			alpineLevel=header->alpineLevel;
+			forestLevel=header->forestLevel;
+
+			// Load textures.
+			for(unsigned i=0; i<header->textureCount; ++i) {
+				const ManifestTexture *entry=&manifestTextures[i];
+
+				char texturePath[1024]; // TODO: this better
+				sprintf(texturePath, "%s/%s", getTexturesDir(), strings+entry->fileNameOffset);
+
+				MapTexture *texture=new MapTexture(entry->id, texturePath, entry->scale, entry->mapColourR, entry->mapColourG, entry->mapColourB);
+				addTexture(texture); // TODO: Check return.
+			}
+
+			// Load items.
+			for(unsigned i=0; i<header->itemCount; ++i) {
+				const ManifestItem *entry=&manifestItems[i];
+
+				MapItem *item=new MapItem(entry->id, strings+entry->nameOffset);
+				addItem(item); // TODO: Check return.
+			}
+
+			free(data);
+
+			return true;
+		}
+
+		void Map::scanLoad(void) {
+			DIR *dirFd;
+			struct dirent *dirEntry;
 
 			// Load metadata file
 			char metadataFilePath[1024]; // TODO: Prevent overflows.
@@ -192,8 +463,9 @@ namespace Engine {
 			}
 
 			// Ensure all directories etc exist.
-			// Note: shouldn't really be needed but no harm either
-			saveMetadata();
+			// Note: shouldn't really be needed but no harm either (and maps with a manifest skip this)
+			if (!readOnly)
+				saveMetadata();
 
 			// Load textures
 			dirFd=opendir(getTexturesDir());
@@ -284,19 +556,73 @@ namespace Engine {
 
 				closedir(dirFd);
 			}
-
-			// Note: Regions are loaded on demand.
 		}
 
 		Map::~Map() {
 			unsigned i;
 
+			// Stop loading regions in the background.
+			prefetchStopThreads();
+			delete prefetchIO;
+			prefetchIO=NULL;
+
+			// Stop syncing and compacting the log in the background (saving below syncs it one last time).
+			logStopThread();
+
 			// Ensure any changes are saved (including stuff like metadata and regions)
-			save();
+			if (!readOnly)
+				save();
+
+			// Stop saving regions in the background (the queue is empty after the above).
+			saveStopThreads();
 
 			// Remove regions.
-			while(regionsCount>0)
-				regionUnload(regionsCount-1);
+			for(unsigned i=0; i<regionShardsCount; ++i) {
+				RegionShard *shard=&regionShards[i];
+				shard->lock.lock();
+				while(!shard->regions.empty())
+					delete regionUnload(shard, shard->regions.size()-1);
+				shard->lock.unlock();
+			}
+			for(MapRegion *region: retiredRegions)
+				delete region;
+			retiredRegions.clear();
+
+			// Remove any regions which could not be saved, and the region index itself.
+			for(unsigned i=0; i<regionBlocksWide*regionBlocksHigh; ++i) {
+				RegionBlock *block=regionBlocks[i].load(std::memory_order_relaxed);
+				if (block==NULL)
+					continue;
+
+				for(unsigned y=0; y<regionBlockSize; ++y)
+					for(unsigned x=0; x<regionBlockSize; ++x)
+						delete block->regions[y][x].saving;
+				delete block;
+			}
+			delete[] regionBlocks;
+			regionBlocks=NULL;
+
+			// Free memory kept for reuse (now that every region has returned theirs).
+			delete regionsPool;
+			regionsPool=NULL;
+
+			// Close region pack file.
+			delete regionsPack;
+			regionsPack=NULL;
+
+			// Close region stats file.
+			delete regionsStats;
+			regionsStats=NULL;
+
+			// Close region log file.
+			delete regionsLog;
+			regionsLog=NULL;
+
+			// Close region existence file, noting that it matches the regions as they now stand (so that it can be trusted next time).
+			if (regionsExistence!=NULL && !readOnly && !regionsExistence->setStamp(regionsExistenceGetStamp()))
+				fprintf(stderr,"error: could not update region existence file\n");
+			delete regionsExistence;
+			regionsExistence=NULL;
 
 			// Remove textures.
 			for(i=0; i<MapTexture::IdMax; ++i)
@@ -306,10 +632,10 @@ namespace Engine {
 			for(i=0; i<MapItem::IdMax; ++i)
 				removeItem(i);
 
-			// Close and remove lock file
+			// Close and remove lock file (unless read only, in which case the lock belongs to someone else, if anyone)
 			if (lockFd!=-1)
 				close(lockFd);
-			if (baseDir!=NULL) {
+			if (baseDir!=NULL && !readOnly) {
 				char lockPath[1024]; // TODO: better
 				sprintf(lockPath, "%s/lock", baseDir);
 				unlink(lockPath);
@@ -326,12 +652,18 @@ namespace Engine {
 			regionsDir=NULL;
 			free(mapTiledDir);
 			mapTiledDir=NULL;
+			free(pyramidDir);
+			pyramidDir=NULL;
 		}
 
 		bool Map::save(void) {
 			// TODO: In each case where we fail, tidy up and free anything as required.
 			// TODO: Better error reporting.
 
+			// Read only maps are never saved.
+			if (readOnly)
+				return false;
+
 			// Save 'metadata' (create directories).
 			if (!saveMetadata())
 				return false;
@@ -348,6 +680,10 @@ namespace Engine {
 			if (!saveItems())
 				return false;
 
+			// Save manifest (now that the textures and items it refers to exist).
+			if (!saveManifest())
+				return false;
+
 			return true;
 		}
 
@@ -361,6 +697,15 @@ namespace Engine {
 				}
 			}
 
+			// Do we need to create pyramid directory?
+			const char *pyramidDirPath=getPyramidDir();
+			if (!Util::isDir(pyramidDirPath)) {
+				if (!Util::makeDir(pyramidDirPath)) {
+					fprintf(stderr,"error: could not create map pyramid dir at '%s'\n", pyramidDirPath);
+					return false;
+				}
+			}
+
 			// Do we need to create textures directory?
 			const char *texturesDirPath=getTexturesDir();
 			if (!Util::isDir(texturesDirPath)) {
@@ -379,76 +724,6 @@ namespace Engine {
 				}
 			}
 
-			// Do we need to create map tiled directory?
-			const char *mapTiledDirPath=getMapTiledDir();
-			if (!Util::isDir(mapTiledDirPath)) {
-				if (!Util::makeDir(mapTiledDirPath)) {
-					fprintf(stderr,"error: could not create map mapTiled dir at '%s'\n", mapTiledDirPath);
-					return false;
-				}
-				if (!MapTiled::createMetadata(this)) {
-					fprintf(stderr,"error: could not create map mapTiled metadata (within '%s')\n", mapTiledDirPath);
-					return false;
-				}
-			}
-
-			// Copy slippymap files if needed
-			char slippymapPath[1024]; // TODO: better
-
-			sprintf(slippymapPath, "%s/leaflet.css", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/leaflet.css", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap leaflet.css file to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/leaflet.js", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/leaflet.js", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap leaflet.js file to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/slippymap.html", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/slippymap.html", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap slippymap.html file to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/images", baseDir);
-			if (!Util::isDir(slippymapPath) && !Util::makeDir(slippymapPath)) {
-				fprintf(stderr,"error: could not create slippymap images directory to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/images/layers.png", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/layers.png", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap layers.png image file to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/images/layers-2x.png", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/layers-2x.png", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap layers-2x.png image file to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/images/marker-icon.png", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/marker-icon.png", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap marker-icon.png image file to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/images/marker-icon-2x.png", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/marker-icon-2x.png", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap marker-icon-2x.png image file to '%s'\n", slippymapPath);
-				return false;
-			}
-
-			sprintf(slippymapPath, "%s/images/marker-shadow.png", baseDir);
-			if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/marker-shadow.png", slippymapPath)) {
-				fprintf(stderr,"error: could not copy slippymap marker-shadow.png image file to '%s'\n", slippymapPath);
-				return false;
-			}
-
 			// Write metadata file.
 			char metadataFilePath[1024]; // TODO: Prevent overflows.
 			sprintf(metadataFilePath, "%s/metadata", baseDir);
@@ -514,85 +789,271 @@ namespace Engine {
 			return success;
 		}
 
+		bool Map::saveManifest(void) const {
+			if (readOnly)
+				return false;
+
+			// Gather texture and item entries, along with the strings they refer to.
+			std::vector<ManifestTexture> manifestTextures;
+			std::vector<ManifestItem> manifestItems;
+			std::vector<char> strings;
+
+			for(unsigned textureId=0; textureId<MapTexture::IdMax; ++textureId) {
+				const MapTexture *texture=getTexture(textureId);
+				if (texture==NULL)
+					continue;
+
+				char fileName[1024];
+				texture->getFileName(fileName);
+
+				ManifestTexture entry;
+				entry.id=textureId;
+				entry.mapColourR=texture->getMapColourR();
+				entry.mapColourG=texture->getMapColourG();
+				entry.mapColourB=texture->getMapColourB();
+				entry.padding=0;
+				entry.scale=texture->getScale();
+				entry.fileNameOffset=strings.size();
+				manifestTextures.push_back(entry);
+
+				strings.insert(strings.end(), fileName, fileName+strlen(fileName)+1);
+			}
+
+			for(unsigned itemId=0; itemId<MapItem::IdMax; ++itemId) {
+				const MapItem *item=getItem(itemId);
+				if (item==NULL)
+					continue;
+
+				ManifestItem entry;
+				entry.id=itemId;
+				entry.padding=0;
+				entry.nameOffset=strings.size();
+				manifestItems.push_back(entry);
+
+				strings.insert(strings.end(), item->getName(), item->getName()+strlen(item->getName())+1);
+			}
+
+			// Fill in header.
+			ManifestHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, manifestMagic, sizeof(manifestMagic));
+			header.version=manifestVersion;
+			header.size=sizeof(header)+manifestTextures.size()*sizeof(ManifestTexture)+manifestItems.size()*sizeof(ManifestItem)+strings.size();
+			header.mapWidth=mapWidth;
+			header.mapHeight=mapHeight;
+			header.textureCount=manifestTextures.size();
+			header.itemCount=manifestItems.size();
+			header.minHeight=minHeight;
+			header.maxHeight=maxHeight;
+			header.minTemperature=minTemperature;
+			header.maxTemperature=maxTemperature;
+			header.minMoisture=minMoisture;
+			header.maxMoisture=maxMoisture;
+			header.seaLevel=seaLevel;
+			header.alpineLevel=alpineLevel;
+			header.forestLevel=forestLevel;
+
+			// Write to a temporary file which then replaces the original (so that a map is never left with a partial manifest).
+			char manifestPath[1024], tempPath[1024+4];
+			int manifestPathLen=snprintf(manifestPath, sizeof(manifestPath), "%s/manifest", baseDir);
+			if (manifestPathLen<0 || (size_t)manifestPathLen>=sizeof(manifestPath)) {
+				fprintf(stderr,"error: map directory path '%s' is too long\n", baseDir);
+				return false;
+			}
+			sprintf(tempPath, "%s.tmp", manifestPath);
+
+			FILE *manifestFile=fopen(tempPath, "w");
+			if (manifestFile==NULL) {
+				fprintf(stderr,"error: could not create map manifest at '%s'\n", tempPath);
+				return false;
+			}
+
+			bool result=true;
+			result&=(fwrite(&header, sizeof(header), 1, manifestFile)==1);
+			if (!manifestTextures.empty()) // data() may be NULL if empty
+				result&=(fwrite(manifestTextures.data(), sizeof(ManifestTexture), manifestTextures.size(), manifestFile)==manifestTextures.size());
+			if (!manifestItems.empty())
+				result&=(fwrite(manifestItems.data(), sizeof(ManifestItem), manifestItems.size(), manifestFile)==manifestItems.size());
+			if (!strings.empty())
+				result&=(fwrite(strings.data(), 1, strings.size(), manifestFile)==strings.size());
+			result&=(fclose(manifestFile)==0);
+
+			if (result)
+				result&=(rename(tempPath, manifestPath)==0);
+			if (!result) {
+				fprintf(stderr,"error: could not write map manifest at '%s'\n", manifestPath);
+				unlink(tempPath);
+			}
+
+			return result;
+		}
+
 		bool Map::saveRegions(void) {
+			if (readOnly)
+				return false;
+
 			bool success=true;
 
 			// Save all regions.
-			const char *regionsDirPath=getRegionsDir();
+			for(unsigned i=0; i<regionShardsCount; ++i) {
+				RegionShard *shard=&regionShards[i];
+				shard->lock.lock();
+
+				for(auto const *regionData: shard->regions) {
+					// Is the region even dirty?
+					MapRegion *region=regionData->ptr;
+					if (!region->getIsDirty())
+						continue;
+
+					// Save region.
+					success&=regionSave(region, regionData->offsetX, regionData->offsetY, true);
+				}
 
-			regionsLock.lock();
+				shard->lock.unlock();
+			}
 
-			for(unsigned i=0; i<regionsCount; ++i) {
-				// Grab region.
-				MapRegion *region=getRegionAtIndex(i);
+			// Wait for regions evicted earlier to be saved.
+			success&=saveFlush();
 
-				// Is the region even dirty?
-				if (!region->getIsDirty())
-					continue;
+			// Ensure any records appended to the log have reached the disk.
+			if (regionsLog!=NULL)
+				success&=regionsLog->sync();
+
+			return success;
+		}
+
+		bool Map::rewriteRegions(Util::ProgressFunctor *progressFunctor, void *progressUserData) {
+			if (readOnly) {
+				fprintf(stderr,"error: cannot rewrite regions of a map opened read only\n");
+				return false;
+			}
+
+			const Util::TimeMs startTime=Util::getTimeMs();
+
+			unsigned regionsWide=mapWidth/MapRegion::tilesSize;
+			unsigned regionsHigh=mapHeight/MapRegion::tilesSize;
+
+			bool success=true;
+			for(unsigned regionY=0; regionY<regionsHigh; ++regionY) {
+				for(unsigned regionX=0; regionX<regionsWide; ++regionX) {
+					// Skip regions which have never been saved.
+					if (!regionExists(regionX, regionY))
+						continue;
+
+					// Mark region dirty so that it is saved (in the current format) when evicted or at the end.
+					MapRegion *region=getRegionAtOffset(regionX, regionY, false);
+					if (region==NULL) {
+						fprintf(stderr,"error: could not load region at %u,%u for rewriting\n", regionX, regionY);
+						success=false;
+						continue;
+					}
+					region->setDirty();
+				}
 
-				// Save region.
-				success&=region->save(regionsDirPath, regionsByIndex[i]->offsetX, regionsByIndex[i]->offsetY);
+				// Update progress.
+				if (progressFunctor!=NULL) {
+					Util::TimeMs elapsedTimeMs=Util::getTimeMs()-startTime;
+					if (!progressFunctor((regionY+1.0)/regionsHigh, elapsedTimeMs, progressUserData))
+						return false;
+				}
 			}
 
-			regionsLock.unlock();
+			success&=saveRegions();
+
+			// Fold the log into the region files too, in case it has records for regions which were not rewritten above.
+			if (regionsLog!=NULL)
+				success&=logCompact();
+
+			// All regions are now in the pack (if used).
+			if (success && regionsPack!=NULL)
+				success&=regionsPack->setIsComplete(true);
 
 			return success;
 		}
 
-		bool Map::loadRegion(unsigned regionX, unsigned regionY, const char *regionPath) {
-			assert(regionX<regionsSize && regionY<regionsSize);
-			assert(regionX*MapRegion::tilesSize<mapWidth && regionY*MapRegion::tilesSize<mapHeight);
-			assert(regionPath!=NULL);
+		MapRegion *Map::loadRegion(unsigned regionX, unsigned regionY, bool create) {
+			return loadRegionData(regionX, regionY, create, NULL, 0, 0);
+		}
+
+		MapRegion *Map::loadRegionData(unsigned regionX, unsigned regionY, bool create, const uint8_t *data, uint64_t dataSize, unsigned dataSaves) {
+			assert(regionX<regionsWide && regionY<regionsHigh);
+
+			// Regions which do not exist (and are not to be created) can be given up on straight away, without evicting anything to make room or looking for their file.
+			if (!create && regionsExistence!=NULL && !regionsExistence->get(regionX, regionY))
+				return NULL;
+
+			RegionData *regionData=getRegionData(regionX, regionY, true);
+			if (regionData==NULL)
+				return NULL;
 
 			// Grab lock
-			regionsLock.lock();
-
-			// Do we need to evict a region to make space for the new one?
-			assert(regionsCount<=regionsLoadedMax);
-			if (regionsCount==regionsLoadedMax) {
-				// Find the last-recently used region.
-				RegionData *regionData=regionsByAge[regionsCount-1];
-				assert(regionData!=NULL);
-				MapRegion *region=regionData->ptr;
-
-				// If this region is dirty, save it back to disk.
-				if (region->getIsDirty() && !region->save(getRegionsDir(), regionData->offsetX, regionData->offsetY)) {
+			RegionShard *shard=getRegionShard(regionX, regionY);
+			shard->lock.lock();
+
+			// Another thread may have loaded this region while we were waiting for the lock.
+			MapRegion *region=regionProtect(regionData);
+			if (region!=NULL) {
+				streamingPin(regionData);
+				shard->lock.unlock();
+				return region;
+			}
+
+			// Evict regions until there is space in the cache for the new one.
+			// Note: if every remaining region is pinned then we go over budget rather than wait.
+			regionRecharge(shard);
+			while(!shard->regions.empty() && shard->bytes+MapRegion::getMemoryUsageEstimate()>shard->cacheBytes) {
+				size_t regionsCount=shard->regions.size();
+				if (!regionEvict(shard)) {
 					// Unable to save modified region - abort to avoid losing data
-					regionsLock.unlock();
-					return false;
+					shard->lock.unlock();
+					return NULL;
 				}
-
-				// Unload the region.
-				regionUnload(regionData->index);
+				if (shard->regions.size()==regionsCount)
+					break;
 			}
 
-			// Create new blank region.
-			MapRegion *region=new MapRegion(regionX, regionY);
+			// If the region was evicted but has not been saved yet then the file is stale, so take back the region itself instead.
+			region=saveReclaimRegion(regionData);
 			if (region==NULL) {
-				regionsLock.unlock();
-				return false;
-			}
-
-			// Add region to map.
-			assert(regionsCount<regionsLoadedMax);
-			assert(regionsByOffset[regionY][regionX].ptr==NULL);
-
-			regionsByOffset[regionY][regionX].ptr=region;
-			regionsByOffset[regionY][regionX].index=regionsCount;
-			regionsByOffset[regionY][regionX].offsetX=regionX;
-			regionsByOffset[regionY][regionX].offsetY=regionY;
-			regionsByIndex[regionsCount]=&(regionsByOffset[regionY][regionX]);
+				// Create new blank region.
+				region=new MapRegion(regionX, regionY, regionsPool);
+				if (region==NULL) {
+					shard->lock.unlock();
+					return NULL;
+				}
 
-			memmove(regionsByAge+1, regionsByAge, (regionsCount)*sizeof(RegionData *));
-			regionsByAge[0]=regionsByIndex[regionsCount];
+				// Attempt to load region data from file (or the data already read in, as long as the region has not been saved since).
+				// Note: this is done before adding the region to the map so that other threads never see a partially loaded region.
+				if (data!=NULL && regionData->saves.load(std::memory_order_acquire)!=dataSaves)
+					data=NULL;
+				if (!regionLoad(region, regionX, regionY, data, dataSize) && !create) {
+					delete region;
+					shard->lock.unlock();
+					return NULL;
+				}
+			}
 
-			++regionsCount;
+			// Add region to map, noting that it now exists (if newly created) so that it can be found again even before it is saved (e.g. once evicted and waiting for a save thread).
+			if (regionsExistence!=NULL)
+				regionsExistence->set(regionX, regionY);
+			regionData->index=shard->regions.size();
+			regionData->offsetX=regionX;
+			regionData->offsetY=regionY;
+			regionData->bytes=region->getMemoryUsage();
+			regionData->snapshotBytes=region->getSnapshotMemoryUsage();
+			regionData->referenced=(streamingAccessDepth==0);
+			regionData->state=RegionStateCold;
+			shard->regions.push_back(regionData);
+			shard->bytes+=regionData->bytes;
+
+			regionData->ptr.store(region, std::memory_order_release);
+			regionProtect(regionData);
+			streamingPin(regionData);
 
 			// Release lock
-			regionsLock.unlock();
+			shard->lock.unlock();
 
-			// Attempt to load region data from file.
-			return region->load(regionPath);
+			return region;
 		}
 
 		bool Map::markRegionDirtyAtTileOffset(unsigned offsetX, unsigned offsetY, bool create) {
@@ -605,25 +1066,42 @@ namespace Engine {
 			if (region==NULL)
 				return false;
 
-			region->setDirty();
+			region->setDirtyAtOffset(offsetX%MapRegion::tilesSize, offsetY%MapRegion::tilesSize);
 
 			return true;
 		}
 
 		void Map::tick(void) {
-			// Call region tick on each loaded region.
-			for(unsigned i=0; i<regionsCount; ++i) {
-				MapRegion *region=regionsByIndex[i]->ptr;
+			// Collect list of loaded regions, pinning each so that it cannot be evicted before its objects are ticked.
+			// Note: we cannot hold the shard locks while ticking as moving objects may need to load regions.
+			std::vector<RegionData *> regions;
+			for(unsigned i=0; i<regionShardsCount; ++i) {
+				RegionShard *shard=&regionShards[i];
+				shard->lock.lock();
+				for(auto *regionData: shard->regions) {
+					regionData->pins.fetch_add(1, std::memory_order_relaxed);
+					regions.push_back(regionData);
+				}
+				shard->lock.unlock();
+			}
 
+			// Call region tick on each loaded region.
+			for(RegionData *regionData: regions) {
+				MapRegion *region=regionData->ptr.load(std::memory_order_acquire);
 				// TODO: Move this logic into MapRegion itself so that objects list can be made private.
 				// TODO: be careful as objects could be removed from our object list if we move them into a different region
 				for(unsigned i=0; i<region->objects.size(); i++) {
 					CoordVec delta=region->objects[i]->tick();
 					moveObject(region->objects[i], region->objects[i]->getCoordTopLeft()+delta);
 				}
+				unpinRegion(regionData->offsetX, regionData->offsetY);
 			}
 		}
 
+		bool Map::getIsReadOnly(void) const {
+			return readOnly;
+		}
+
 		unsigned Map::getWidth(void) const {
 			return mapWidth;
 		}
@@ -632,14 +1110,30 @@ namespace Engine {
 			return mapHeight;
 		}
 
+		size_t Map::getRegionCacheBytes(void) const {
+			return regionsCacheBytes;
+		}
+
 		MapTile *Map::getTileAtCoordVec(const CoordVec &vec, GetTileFlag flags) {
+			// Writes are bracketed by the current WriteScope, so that the region is marked dirty only once a snapshot can no longer be taken midway through.
+			if (flags & GetTileFlag::Dirty) {
+				if (vec.x<0 || vec.y<0)
+					return NULL;
+
+				CoordComponent tileX=vec.x/CoordsPerTile;
+				CoordComponent tileY=vec.y/CoordsPerTile;
+				MapRegion *region=writeScopeRegion(tileX/MapRegion::tilesSize, tileY/MapRegion::tilesSize, (flags & GetTileFlag::Create)!=0);
+				if (region==NULL)
+					return NULL;
+
+				region->setDirtyAtOffset(tileX%MapRegion::tilesSize, tileY%MapRegion::tilesSize);
+				return region->getTileAtCoordVec(vec);
+			}
+
 			MapRegion *region=getRegionAtCoordVec(vec, (flags & GetTileFlag::Create)!=0);
 			if (region==NULL)
 				return NULL;
 
-			if (flags & GetTileFlag::Dirty)
-				region->setDirty();
-
 			return region->getTileAtCoordVec(vec);
 		}
 
@@ -647,17 +1141,20 @@ namespace Engine {
 			assert(offsetX>=0 && offsetX<regionsSize*MapRegion::tilesSize);
 			assert(offsetY>=0 && offsetY<regionsSize*MapRegion::tilesSize);
 
+			// Writes are bracketed by the current WriteScope (see getTileAtCoordVec).
 			unsigned regionX=offsetX/MapRegion::tilesSize;
 			unsigned regionY=offsetY/MapRegion::tilesSize;
-			MapRegion *region=getRegionAtOffset(regionX, regionY, (flags & GetTileFlag::Create)!=0);
+			bool create=((flags & GetTileFlag::Create)!=0);
+			MapRegion *region=((flags & GetTileFlag::Dirty) ? writeScopeRegion(regionX, regionY, create) : getRegionAtOffset(regionX, regionY, create));
 			if (region==NULL)
 				return NULL;
 
-			if (flags & GetTileFlag::Dirty)
-				region->setDirty();
-
 			unsigned regionTileOffsetX=offsetX%MapRegion::tilesSize;
 			unsigned regionTileOffsetY=offsetY%MapRegion::tilesSize;
+
+			if (flags & GetTileFlag::Dirty)
+				region->setDirtyAtOffset(regionTileOffsetX, regionTileOffsetY);
+
 			return region->getTileAtOffset(regionTileOffsetX, regionTileOffsetY);
 		}
 
@@ -675,54 +1172,179 @@ namespace Engine {
 
 		MapRegion *Map::getRegionAtOffset(unsigned regionX, unsigned regionY, bool create) {
 			// Out of bounds?
-			if (regionX*MapRegion::tilesSize>=mapWidth || regionY*MapRegion::tilesSize>=mapHeight)
+			if (regionX>=regionsWide || regionY>=regionsHigh)
 				return NULL;
 
-			// Region not loaded?
-			if (regionsByOffset[regionY][regionX].ptr==NULL) {
-				// Create path.
-				const char *regionsDirPath=getRegionsDir();
-				char regionPath[4096]; // TODO: this better
-				sprintf(regionPath, "%s/%u,%u", regionsDirPath, regionX, regionY); // TODO: Check return.
-
-				// Attempt to load region.
-				if (!loadRegion(regionX, regionY, regionPath)) {
-					if (!create) {
-						// Failed - ensure this region is unloaded as it is not correct.
-						for(unsigned r=0; r<regionsCount; ++r)
-							if (regionsByIndex[r]->offsetX==regionX && regionsByIndex[r]->offsetY==regionY) {
-								regionUnload(r);
-								break;
-							}
-					}
+			// Track which region this thread last used, for detecting sequential access.
+			if (prefetchThreadCount>0 && (prefetchLastAccess.map!=this || prefetchLastAccess.regionX!=regionX || prefetchLastAccess.regionY!=regionY))
+				prefetchNoteAccess(regionX, regionY);
+
+			// Region already loaded?
+			// Note: this is the common case and so is lock-free.
+			RegionData *regionData=getRegionData(regionX, regionY, false);
+			MapRegion *region=(regionData!=NULL ? regionProtect(regionData) : NULL);
+			if (region!=NULL) {
+				// Mark region as recently used for the clock algorithm (avoiding the write if already set as this is the common case).
+				// Streaming accesses are not counted, so that a pass over the whole map does not look like every region is in use.
+				if (streamingAccessDepth==0) {
+					if (!regionData->referenced.load(std::memory_order_relaxed))
+						regionData->referenced.store(true, std::memory_order_relaxed);
+					return region;
+				}
+
+				// Streaming accesses pin the region instead, unless it was unloaded meanwhile (in which case it is loaded again below).
+				if (streamingPinsFind(this, regionX, regionY))
+					return region;
+				RegionShard *shard=getRegionShard(regionX, regionY);
+				std::lock_guard<std::mutex> guard(shard->lock);
+				if (regionData->ptr.load(std::memory_order_relaxed)==region) {
+					streamingPin(regionData);
+					return region;
 				}
 			}
 
-			// Return region (or NULL if we could not load/create).
-			return regionsByOffset[regionY][regionX].ptr;
+			// Region not loaded - attempt to load (or create) it.
+			return loadRegion(regionX, regionY, create);
 		}
 
-		bool Map::addObject(MapObject *object) {
-			assert(object!=NULL);
+		bool Map::getRegionPyramid(unsigned regionX, unsigned regionY, unsigned level, MapPyramid::Cell *cells) {
+			assert(level>=MapPyramid::levelMin && level<=MapPyramid::levelMax);
+			assert(cells!=NULL);
 
-			CoordVec vec=object->getCoordTopLeft();
-			MapRegion *region=getRegionAtCoordVec(vec, false);
-			if (region==NULL)
+			// Out of bounds?
+			if (regionX>=regionsWide || regionY>=regionsHigh)
 				return false;
 
-			return region->addObject(object);
-		}
-
-		bool Map::moveObject(MapObject *object, const CoordVec &newPos) {
-			assert(object!=NULL);
+			// If the region has changes which have not been saved yet then its pyramid file (if any) is stale.
+			RegionData *regionData=getRegionData(regionX, regionY, false);
+			MapRegion *region=(regionData!=NULL ? regionProtect(regionData) : NULL);
+			bool isDirty=(region!=NULL && region->getIsDirty());
+			if (!isDirty && regionData!=NULL) {
+				std::lock_guard<std::mutex> guard(saveLock);
+				isDirty=(regionData->saving!=NULL);
+			}
 
-			// No change?
-			CoordVec oldPos=object->getCoordTopLeft();
-			if (newPos==oldPos)
+			// Otherwise try the pyramid file first, as this avoids loading the region at all.
+			if (!isDirty && MapPyramid::load(getPyramidDir(), regionX, regionY, level, cells))
+				return true;
+
+			// Fall back on computing cells from the region itself (e.g. for maps saved before pyramids were added).
+			region=getRegionAtOffset(regionX, regionY, false);
+			if (region==NULL)
+				return false;
+
+			MapPyramid::compute(region, level, cells);
+
+			// Write the missing pyramid file so that next time the region need not be loaded.
+			if (!isDirty && !readOnly && !region->getIsDirty())
+				MapPyramid::save(getPyramidDir(), regionX, regionY, region);
+
+			return true;
+		}
+
+		bool Map::getRegionStats(unsigned regionX, unsigned regionY, MapStats::Entry *entry) {
+			assert(entry!=NULL);
+
+			// Out of bounds?
+			if (regionX>=regionsWide || regionY>=regionsHigh)
+				return false;
+
+			// If the region has changes which have not been saved yet then its stats entry (if any) is stale.
+			RegionData *regionData=getRegionData(regionX, regionY, false);
+			MapRegion *region=(regionData!=NULL ? regionProtect(regionData) : NULL);
+			bool isDirty=(region!=NULL && region->getIsDirty());
+			if (!isDirty && regionData!=NULL) {
+				std::lock_guard<std::mutex> guard(saveLock);
+				isDirty=(regionData->saving!=NULL);
+			}
+
+			// Otherwise try the stats file first, as this avoids loading the region at all.
+			if (!isDirty && regionsStats->get(regionX, regionY, entry))
+				return true;
+
+			// Fall back on computing stats from the region itself (e.g. for maps saved before stats were added).
+			region=getRegionAtOffset(regionX, regionY, false);
+			if (region==NULL)
+				return false;
+
+			MapStats::compute(region, seaLevel, entry);
+
+			// Write the missing entry so that next time the region need not be loaded.
+			if (!isDirty && !readOnly && !region->getIsDirty())
+				regionsStats->set(regionX, regionY, *entry);
+
+			return true;
+		}
+
+		void Map::prefetchRegion(unsigned regionX, unsigned regionY) {
+			if (prefetchThreadCount==0)
+				return;
+
+			// Out of bounds, missing or already loaded?
+			if (regionX>=regionsWide || regionY>=regionsHigh)
+				return;
+			if (regionsExistence!=NULL && !regionsExistence->get(regionX, regionY))
+				return;
+			RegionData *regionData=getRegionData(regionX, regionY, false);
+			if (regionData!=NULL && regionData->ptr.load(std::memory_order_relaxed)!=NULL)
+				return;
+
+			std::unique_lock<std::mutex> lock(prefetchLock);
+
+			// Start threads if this is the first hint.
+			if (!prefetchThreadsStarted) {
+				for(unsigned i=0; i<prefetchThreadCount; ++i)
+					prefetchThreads[i]=new std::thread(&Map::prefetchThreadFunctor, this);
+				prefetchThreadsStarted=true;
+			}
+
+			// Add to queue (if not already present), dropping the oldest hint if full.
+			unsigned entry=regionY*regionsSize+regionX;
+			for(unsigned queued: prefetchQueue)
+				if (queued==entry)
+					return;
+
+			if (prefetchQueue.size()>=prefetchQueueMax)
+				prefetchQueue.pop_front();
+			prefetchQueue.push_back(entry);
+
+			lock.unlock();
+			prefetchCond.notify_one();
+		}
+
+		void Map::prefetchRegionAtCoordVec(const CoordVec &vec) {
+			if (vec.x<0 || vec.y<0)
+				return;
+
+			CoordComponent tileX=vec.x/Physics::CoordsPerTile;
+			CoordComponent tileY=vec.y/Physics::CoordsPerTile;
+			prefetchRegion(tileX/MapRegion::tilesSize, tileY/MapRegion::tilesSize);
+		}
+
+		bool Map::addObject(MapObject *object) {
+			assert(object!=NULL);
+
+			CoordVec vec=object->getCoordTopLeft();
+			MapRegion *region=getRegionAtCoordVec(vec, false);
+			if (region==NULL)
+				return false;
+
+			return region->addObject(object);
+		}
+
+		bool Map::moveObject(MapObject *object, const CoordVec &newPos) {
+			assert(object!=NULL);
+
+			// No change?
+			CoordVec oldPos=object->getCoordTopLeft();
+			if (newPos==oldPos)
 				return true;
 
 			// TODO: Add and removing to/from tiles can be improved by considering newPos-pos.
 
+			// Bracket our modifications to the tiles involved (see WriteScope).
+			WriteScope writes;
+
 			CoordVec vec;
 
 			// Compute old dimensions.
@@ -890,6 +1512,10 @@ namespace Engine {
 			return regionsDir;
 		}
 
+		const char *Map::getPyramidDir(void) const {
+			return pyramidDir;
+		}
+
 		const char *Map::getTexturesDir(void) const {
 			return texturesDir;
 		}
@@ -898,67 +1524,1262 @@ namespace Engine {
 			return itemsDir;
 		}
 
-		MapRegion *Map::getRegionAtIndex(unsigned index) {
-			assert(index<regionsCount);
+		void Map::prefetchInit(const Options *options) {
+			prefetchThreadCount=(options!=NULL ? options->prefetchThreads : Options().prefetchThreads);
+			if (prefetchThreadCount>prefetchThreadsMax)
+				prefetchThreadCount=prefetchThreadsMax;
+			prefetchThreadsStarted=false;
+			prefetchStop=false;
+
+			// Decide how to read batches of region files (preferring io_uring unless disabled by option or environment variable).
+			bool useUring=(options!=NULL ? options->prefetchUring : Options().prefetchUring);
+			const char *uringStr=getenv("MAP_REGION_URING");
+			if (uringStr!=NULL && strcmp(uringStr, "0")==0)
+				useUring=false;
+			prefetchIO=(prefetchThreadCount>0 ? new MapIO(prefetchBatchMax, useUring) : NULL);
+		}
+
+		void Map::prefetchStopThreads(void) {
+			std::unique_lock<std::mutex> lock(prefetchLock);
+			if (!prefetchThreadsStarted)
+				return;
+
+			prefetchStop=true;
+			prefetchQueue.clear();
+			lock.unlock();
+			prefetchCond.notify_all();
 
-			return regionsByIndex[index]->ptr;
+			for(unsigned i=0; i<prefetchThreadCount; ++i) {
+				prefetchThreads[i]->join();
+				delete prefetchThreads[i];
+			}
+
+			lock.lock();
+			prefetchThreadsStarted=false;
+			prefetchStop=false;
 		}
 
-		const MapRegion *Map::getRegionAtIndex(unsigned index) const {
-			assert(index<regionsCount);
+		void Map::prefetchThreadFunctor(void) {
+			std::unique_lock<std::mutex> lock(prefetchLock);
+			while(1) {
+				// Wait for a hint.
+				prefetchCond.wait(lock, [this]{ return prefetchStop || !prefetchQueue.empty(); });
+				if (prefetchStop)
+					break;
 
-			return regionsByIndex[index]->ptr;
+				// Most recent hints are the most likely to still be relevant so take from the back.
+				// Several are taken at once (if queued) so that their files can be read together.
+				unsigned entries[prefetchBatchMax];
+				unsigned entriesCount=0;
+				while(entriesCount<prefetchBatchMax && !prefetchQueue.empty()) {
+					entries[entriesCount++]=prefetchQueue.back();
+					prefetchQueue.pop_back();
+				}
+				lock.unlock();
+
+				prefetchLoadBatch(entries, entriesCount);
+				regionHazardsClear();
+
+				lock.lock();
+			}
 		}
 
-		void Map::updateRegionAge(const MapRegion *region) {
-			assert(region!=NULL);
+		void Map::prefetchLoadBatch(const unsigned *entries, unsigned count) {
+			assert(entries!=NULL);
+			assert(count<=prefetchBatchMax);
+
+			// Find each region's file data (in the pack or its own file), skipping those which are already loaded or have nothing to load.
+			unsigned regionXs[prefetchBatchMax], regionYs[prefetchBatchMax];
+			unsigned saves[prefetchBatchMax];
+			int ownFds[prefetchBatchMax]; // region files opened here, or -1
+			MapIO::Read reads[prefetchBatchMax];
+			unsigned regionsCount=0;
+			size_t batchBytes=0;
+			for(unsigned i=0; i<count; ++i) {
+				unsigned regionX=entries[i]%regionsSize;
+				unsigned regionY=entries[i]/regionsSize;
+				RegionData *regionData=getRegionData(regionX, regionY, true);
+				if (regionData==NULL || regionData->ptr.load(std::memory_order_relaxed)!=NULL)
+					continue;
+
+				// Note the save count before reading, so that loadRegionData can tell if the file changed meanwhile.
+				unsigned regionSaves=regionData->saves.load(std::memory_order_acquire);
+
+				MapIO::Read *read=&reads[regionsCount];
+				int ownFd=-1;
+				MapPack::Extent extent;
+				if (regionsPack!=NULL && regionsPack->getExtent(regionX, regionY, &extent)) {
+					read->fd=regionsPack->getFd();
+					read->offset=extent.offset;
+					read->size=extent.size;
+				} else if (regionsPack==NULL || !regionsPack->getIsComplete()) {
+					char regionPath[4096];
+					int regionPathLen=snprintf(regionPath, sizeof(regionPath), "%s/%u,%u", getRegionsDir(), regionX, regionY);
+					if (regionPathLen<0 || (size_t)regionPathLen>=sizeof(regionPath)) {
+						fprintf(stderr,"error: regions directory path '%s' is too long\n", getRegionsDir());
+						continue;
+					}
+					ownFd=open(regionPath, O_RDONLY);
+					struct stat regionStat;
+					if (ownFd==-1)
+						continue;
+					if (fstat(ownFd, &regionStat)!=0) {
+						close(ownFd);
+						continue;
+					}
+					read->fd=ownFd;
+					read->offset=0;
+					read->size=regionStat.st_size;
+				} else
+					continue;
+
+				// Regions beyond the batch's budget are simply loaded now, reading their file as normal.
+				read->data=NULL;
+				if (batchBytes+read->size<=prefetchBatchBytesMax)
+					read->data=malloc(read->size);
+				if (read->data==NULL) {
+					if (ownFd!=-1)
+						close(ownFd);
+					loadRegion(regionX, regionY, false);
+					continue;
+				}
+				batchBytes+=read->size;
+
+				regionXs[regionsCount]=regionX;
+				regionYs[regionsCount]=regionY;
+				saves[regionsCount]=regionSaves;
+				ownFds[regionsCount]=ownFd;
+				++regionsCount;
+			}
+
+			// Read every file at once, then parse each into its region.
+			prefetchIO->read(reads, regionsCount);
+
+			for(unsigned i=0; i<regionsCount; ++i) {
+				loadRegionData(regionXs[i], regionYs[i], false, (reads[i].result ? (const uint8_t *)reads[i].data : NULL), reads[i].size, saves[i]);
+
+				free(reads[i].data);
+				if (ownFds[i]!=-1)
+					close(ownFds[i]);
+			}
+		}
+
+		void Map::prefetchNoteAccess(unsigned regionX, unsigned regionY) {
+			PrefetchAccess *last=&prefetchLastAccess;
+
+			// Moved to a neighbouring region in the same direction as last time?
+			// If so queue the next few regions in that direction.
+			int dx=(int)regionX-(int)last->regionX;
+			int dy=(int)regionY-(int)last->regionY;
+			bool isStep=(last->map==this && abs(dx)+abs(dy)==1);
+			if (isStep && dx==last->dx && dy==last->dy)
+				for(unsigned i=1; i<=prefetchSequentialDistance; ++i)
+					prefetchRegion(regionX+dx*i, regionY+dy*i); // note: wraps to large values (and so is ignored) if going off the top/left
+
+			last->map=this;
+			last->regionX=regionX;
+			last->regionY=regionY;
+			last->dx=(isStep ? dx : 0);
+			last->dy=(isStep ? dy : 0);
+		}
+
+		void Map::saveInit(const Options *options) {
+			saveThreadCount=(options!=NULL ? options->saveThreads : Options().saveThreads);
+			if (saveThreadCount>saveThreadsMax)
+				saveThreadCount=saveThreadsMax;
+			saveThreadsStarted=false;
+			saveStop=false;
+			saveFailed=false;
+			saveInProgressCount=0;
+			saveQueueBytes=0;
+
+			// Bound memory used by regions waiting to be saved (note: regionsInit must be called first).
+			saveQueueBytesMax=(options!=NULL ? options->saveQueueBytes : 0);
+			if (saveQueueBytesMax==0)
+				saveQueueBytesMax=regionsCacheBytes/8;
+		}
 
-			// See if this region is already the newest (as is common when performing many operations within a single region)
-			if (regionsByAge[0]->ptr==region)
+		void Map::saveStopThreads(void) {
+			std::unique_lock<std::mutex> lock(saveLock);
+			if (!saveThreadsStarted)
 				return;
 
-			// Update age array
-			regionsLock.lock();
+			// Note: threads finish saving any queued regions before exiting.
+			saveStop=true;
+			lock.unlock();
+			saveCond.notify_all();
 
-			for(int i=0; i<regionsCount; i++) {
-				if (regionsByAge[i]->ptr==region) {
-					// Found - move to front.
-					RegionData *regionDataPtr=regionsByAge[i];
-					memmove(regionsByAge+1, regionsByAge, i*sizeof(RegionData *));
-					regionsByAge[0]=regionDataPtr;
-					regionsLock.unlock();
-					return;
+			for(unsigned i=0; i<saveThreadCount; ++i) {
+				saveThreads[i]->join();
+				delete saveThreads[i];
+			}
+
+			lock.lock();
+			saveThreadsStarted=false;
+			saveStop=false;
+		}
+
+		void Map::saveThreadFunctor(void) {
+			std::unique_lock<std::mutex> lock(saveLock);
+			while(1) {
+				// Wait for a region to save.
+				saveCond.wait(lock, [this]{ return saveStop || !saveQueue.empty(); });
+				if (saveQueue.empty())
+					break;
+
+				RegionData *regionData=saveQueue.front();
+				saveQueue.pop_front();
+
+				// Region may have been reclaimed by loadRegion since being queued.
+				MapRegion *region=regionData->saving;
+				if (region==NULL)
+					continue;
+
+				regionData->savingInProgress=true;
+				++saveInProgressCount;
+				lock.unlock();
+
+				bool result=regionSave(region, regionData->offsetX, regionData->offsetY, true);
+				if (!result)
+					fprintf(stderr,"error: could not save region at %u,%u (will retry on next map save)\n", regionData->offsetX, regionData->offsetY);
+
+				lock.lock();
+				regionData->savingInProgress=false;
+				--saveInProgressCount;
+
+				// On success the region can be freed, otherwise it is kept (see saveFlush).
+				if (result) {
+					regionData->saving=NULL;
+					saveQueueBytes-=regionData->bytes;
+					regionRetire(region);
+				} else
+					saveFailed=true;
+
+				saveDoneCond.notify_all();
+			}
+		}
+
+		bool Map::saveFlush(void) {
+			std::unique_lock<std::mutex> lock(saveLock);
+			if (!saveThreadsStarted)
+				return true;
+
+			// Wait for queue to drain.
+			saveDoneCond.wait(lock, [this]{ return saveQueue.empty() && saveInProgressCount==0; });
+
+			// Retry any regions which could not be saved in the background.
+			if (saveFailed) {
+				bool success=true;
+				for(unsigned i=0; i<regionBlocksWide*regionBlocksHigh; ++i) {
+					RegionBlock *block=regionBlocks[i].load(std::memory_order_relaxed);
+					if (block==NULL)
+						continue;
+
+					for(unsigned y=0; y<regionBlockSize; ++y)
+						for(unsigned x=0; x<regionBlockSize; ++x) {
+							RegionData *regionData=&block->regions[y][x];
+							if (regionData->saving==NULL)
+								continue;
+
+							if (!regionSave(regionData->saving, regionData->offsetX, regionData->offsetY, true)) {
+								success=false;
+								continue;
+							}
+
+							saveQueueBytes-=regionData->bytes;
+							regionRetire(regionData->saving);
+							regionData->saving=NULL;
+						}
 				}
+
+				if (!success)
+					return false;
+
+				saveFailed=false;
+				saveDoneCond.notify_all();
 			}
-			assert(false);
 
-			regionsLock.unlock();
+			return true;
 		}
 
-		void Map::regionUnload(unsigned index) {
-			assert(index<regionsCount);
+		bool Map::saveQueueRegion(RegionShard *shard, RegionData *regionData) {
+			assert(shard!=NULL);
+			assert(regionData!=NULL);
 
-			// Remove from regionsByAge array.
-			for(unsigned i=0; i<regionsCount; ++i) {
-				if (regionsByAge[i]==regionsByIndex[index]) {
-					memmove(regionsByAge+i, regionsByAge+i+1, (regionsCount-1-i)*sizeof(RegionData *));
-					regionsByAge[regionsCount-1]=NULL;
-					break;
+			if (saveThreadCount==0)
+				return false;
+
+			std::unique_lock<std::mutex> lock(saveLock);
+
+			// Start threads if this is the first region to be saved.
+			if (!saveThreadsStarted) {
+				for(unsigned i=0; i<saveThreadCount; ++i)
+					saveThreads[i]=new std::thread(&Map::saveThreadFunctor, this);
+				saveThreadsStarted=true;
+			}
+
+			// Wait for space in the queue (always allowing at least one region).
+			saveDoneCond.wait(lock, [this, regionData]{ return saveFailed || saveQueueBytes==0 || saveQueueBytes+regionData->bytes<=saveQueueBytesMax; });
+			if (saveFailed)
+				return false;
+
+			// Unload region and queue it.
+			// Note: the region is unloaded while saveLock is held so that loadRegion always finds it either loaded or in the queue.
+			assert(regionData->saving==NULL);
+			regionData->saving=regionUnload(shard, regionData->index);
+			regionData->savingInProgress=false;
+			saveQueueBytes+=regionData->bytes;
+			saveQueue.push_back(regionData);
+
+			lock.unlock();
+			saveCond.notify_one();
+
+			return true;
+		}
+
+		MapRegion *Map::saveReclaimRegion(RegionData *regionData) {
+			assert(regionData!=NULL);
+
+			std::unique_lock<std::mutex> lock(saveLock);
+
+			// If a save thread is writing the region then wait for it to finish (after which the file is up to date).
+			saveDoneCond.wait(lock, [regionData]{ return !regionData->savingInProgress; });
+
+			MapRegion *region=regionData->saving;
+			if (region==NULL)
+				return NULL;
+
+			// Remove region from queue (the queue entry itself is skipped by the save threads).
+			regionData->saving=NULL;
+			saveQueueBytes-=regionData->bytes;
+
+			lock.unlock();
+			saveDoneCond.notify_all();
+
+			return region;
+		}
+
+		void Map::regionsInit(const Options *options) {
+			unsigned i;
+
+			// The index itself is allocated by regionsIndexInit once the map's size is known.
+			regionsWide=regionsHigh=0;
+			regionBlocksWide=regionBlocksHigh=0;
+			regionBlocks=NULL;
+
+			// Decide on region cache budget (in order of preference: explicit option, environment variable, fraction of physical memory).
+			regionsCacheBytes=0;
+			if (options!=NULL)
+				regionsCacheBytes=options->regionCacheBytes;
+
+			const char *envCacheStr=getenv("MAP_REGION_CACHE");
+			if (regionsCacheBytes==0 && envCacheStr!=NULL && !Util::parseSize(envCacheStr, &regionsCacheBytes)) {
+				fprintf(stderr,"warning: could not parse MAP_REGION_CACHE value '%s' (expected e.g. '4096M' or '2G')\n", envCacheStr);
+				regionsCacheBytes=0;
+			}
+
+			if (regionsCacheBytes==0)
+				regionsCacheBytes=Util::getPhysicalMemory()/4;
+
+			size_t regionsCacheBytesMin=regionsLoadedMin*MapRegion::getMemoryUsageEstimate();
+			if (regionsCacheBytes<regionsCacheBytesMin)
+				regionsCacheBytes=regionsCacheBytesMin;
+
+			// Decide on codec and encoding for saving regions (again preferring explicit option, then environment variable).
+			regionsFileFormat=MapRegion::FileFormat();
+			const char *codecStr=(options!=NULL ? options->regionCodec : NULL);
+			if (codecStr==NULL)
+				codecStr=getenv("MAP_REGION_CODEC");
+			if (codecStr!=NULL) {
+				MapCodec::Type codec;
+				if (!MapCodec::typeFromString(codecStr, &codec))
+					fprintf(stderr,"warning: unknown region codec '%s' (expected 'none', 'lz' or 'zstd')\n", codecStr);
+				else if (!MapCodec::isAvailable(codec))
+					fprintf(stderr,"warning: region codec '%s' is not available in this build\n", codecStr);
+				else
+					regionsFileFormat.codec=codec;
+			}
+
+			const char *encodingStr=(options!=NULL ? options->regionEncoding : NULL);
+			if (encodingStr==NULL)
+				encodingStr=getenv("MAP_REGION_ENCODING");
+			if (encodingStr!=NULL && !MapRegion::encodingFromString(encodingStr, &regionsFileFormat.encoding))
+				fprintf(stderr,"warning: unknown region encoding '%s' (expected 'full', 'float' or 'quantized')\n", encodingStr);
+
+			regionsPack=NULL;
+			regionsStats=NULL;
+			regionsExistence=NULL;
+			regionsLog=NULL;
+
+			logThread=NULL;
+			logStop=false;
+			logCompactBytes=0;
+
+			// Decide on how much memory to keep from evicted regions for reuse, and how it should be backed.
+			size_t poolBytes=(options!=NULL ? options->regionPoolBytes : 0);
+			const char *envPoolStr=getenv("MAP_REGION_POOL");
+			if (poolBytes==0 && envPoolStr!=NULL && !Util::parseSize(envPoolStr, &poolBytes)) {
+				fprintf(stderr,"warning: could not parse MAP_REGION_POOL value '%s' (expected e.g. '256M' or '1G')\n", envPoolStr);
+				poolBytes=0;
+			}
+			if (poolBytes==0)
+				poolBytes=regionsCacheBytes/16;
+
+			bool hugePages=(options!=NULL && options->regionHugePages);
+			const char *hugePagesStr=getenv("MAP_REGION_HUGEPAGES");
+			if (!hugePages && hugePagesStr!=NULL)
+				hugePages=(strcmp(hugePagesStr, "1")==0);
+
+			regionsPool=new MapRegion::BufferPool(poolBytes, hugePages);
+
+			// Split budget between shards.
+			size_t regionsCacheCount=regionsCacheBytes/MapRegion::getMemoryUsageEstimate();
+			regionShardsCount=std::min((size_t)regionShardsMax, std::max((size_t)1, regionsCacheCount/regionShardsMinRegions));
+
+			for(i=0; i<regionShardsCount; ++i) {
+				RegionShard *shard=&regionShards[i];
+				shard->clockHand=0;
+				shard->bytes=0;
+				shard->hotBytes=0;
+				shard->cacheBytes=regionsCacheBytes/regionShardsCount;
+				shard->regions.reserve(regionsCacheCount/regionShardsCount+1);
+			}
+		}
+
+		bool Map::regionsPackOpen(const Options *options) {
+			assert(regionsPack==NULL);
+
+			char packPath[1024]; // TODO: better
+			sprintf(packPath, "%s/regions.pack", baseDir);
+
+			// Use pack if it already exists, or if requested (by option or environment variable).
+			// Note: read only maps can only use an existing pack.
+			bool create=(options!=NULL && options->regionPack);
+			const char *packStr=getenv("MAP_REGION_PACK");
+			if (!create && packStr!=NULL)
+				create=(strcmp(packStr, "1")==0);
+			if (readOnly)
+				create=false;
+
+			if (!create && !Util::isFile(packPath))
+				return true;
+
+			regionsPack=new MapPack(std::max(regionsWide, regionsHigh));
+			if (!regionsPack->open(packPath, create, readOnly)) {
+				fprintf(stderr,"error: could not open region pack file at '%s'\n", packPath);
+				delete regionsPack;
+				regionsPack=NULL;
+				return false;
+			}
+
+			return true;
+		}
+
+		bool Map::regionsIndexInit(void) {
+			assert(regionBlocks==NULL);
+
+			regionsWide=mapWidth/MapRegion::tilesSize;
+			regionsHigh=mapHeight/MapRegion::tilesSize;
+			regionBlocksWide=(regionsWide+regionBlockSize-1)/regionBlockSize;
+			regionBlocksHigh=(regionsHigh+regionBlockSize-1)/regionBlockSize;
+
+			regionBlocks=new std::atomic<RegionBlock *>[regionBlocksWide*regionBlocksHigh];
+			if (regionBlocks==NULL)
+				return false;
+			for(unsigned i=0; i<regionBlocksWide*regionBlocksHigh; ++i)
+				regionBlocks[i].store(NULL, std::memory_order_relaxed);
+
+			return true;
+		}
+
+		bool Map::regionsStatsOpen(void) {
+			assert(regionsStats==NULL);
+
+			char statsPath[1024]; // TODO: better
+			sprintf(statsPath, "%s/regionstats", baseDir);
+
+			regionsStats=new MapStats(std::max(regionsWide, regionsHigh));
+			if (!regionsStats->open(statsPath, readOnly)) {
+				fprintf(stderr,"error: could not open region stats file at '%s'\n", statsPath);
+				delete regionsStats;
+				regionsStats=NULL;
+				return false;
+			}
+
+			return true;
+		}
+
+		bool Map::regionsExistenceOpen(void) {
+			assert(regionsExistence==NULL);
+
+			char existencePath[1024]; // TODO: better
+			sprintf(existencePath, "%s/regionexistence", baseDir);
+
+			regionsExistence=new MapExistence(std::max(regionsWide, regionsHigh));
+			bool isValid;
+			if (!regionsExistence->open(existencePath, readOnly, regionsExistenceGetStamp(), &isValid)) {
+				fprintf(stderr,"error: could not open region existence file at '%s'\n", existencePath);
+				delete regionsExistence;
+				regionsExistence=NULL;
+				return false;
+			}
+
+			if (isValid)
+				return true;
+
+			// Rebuild bitmap from the pack's index and region files.
+			if (regionsPack!=NULL) {
+				std::vector<std::pair<unsigned, unsigned> > regions;
+				regionsPack->getRegions(&regions);
+				for(auto const &region: regions)
+					if (region.first<regionsWide && region.second<regionsHigh)
+						regionsExistence->set(region.first, region.second);
+			}
+
+			if (regionsPack==NULL || !regionsPack->getIsComplete()) {
+				DIR *dirFd=opendir(getRegionsDir());
+				if (dirFd!=NULL) {
+					struct dirent *dirEntry;
+					while((dirEntry=readdir(dirFd))!=NULL) {
+						// Skip anything other than region files (e.g. those left part way through being saved).
+						unsigned regionX, regionY;
+						int nameLen=0;
+						if (sscanf(dirEntry->d_name, "%u,%u%n", &regionX, &regionY, &nameLen)!=2 || dirEntry->d_name[nameLen]!='\0')
+							continue;
+
+						if (regionX<regionsWide && regionY<regionsHigh)
+							regionsExistence->set(regionX, regionY);
+					}
+
+					closedir(dirFd);
 				}
 			}
 
-			// Free the region and clear the RegionData pointer.
-			MapRegion *region=getRegionAtIndex(index);
+			return true;
+		}
+
+		uint64_t Map::regionsExistenceGetStamp(void) const {
+			// Creating a region always modifies either the regions directory (adding its file) or the pack file, so their modification times (along with which files they are) are enough to tell whether anything could have changed.
+			struct stat fileStats[2];
+			memset(fileStats, 0, sizeof(fileStats));
+
+			char packPath[1024]; // TODO: better
+			sprintf(packPath, "%s/regions.pack", baseDir);
+			stat(getRegionsDir(), &fileStats[0]); // missing files are simply left zeroed
+			stat(packPath, &fileStats[1]);
+
+			// Hash fields (FNV-1a, a word at a time).
+			uint64_t stamp=14695981039346656037llu;
+			for(unsigned i=0; i<2; ++i) {
+				const uint64_t values[]={(uint64_t)fileStats[i].st_dev, (uint64_t)fileStats[i].st_ino, (uint64_t)fileStats[i].st_size, (uint64_t)fileStats[i].st_mtim.tv_sec, (uint64_t)fileStats[i].st_mtim.tv_nsec};
+				for(uint64_t value: values)
+					stamp=(stamp^value)*1099511628211llu;
+			}
+
+			return (stamp!=0 ? stamp : 1); // 0 is reserved for files which have never matched
+		}
+
+		bool Map::regionsLogOpen(const Options *options) {
+			assert(regionsLog==NULL);
+
+			char logPath[1024]; // TODO: better
+			sprintf(logPath, "%s/regions.log", baseDir);
+
+			// Use log if it already exists (as its records are needed to load regions correctly), or if requested (by option or environment variable).
+			// Note: read only maps can only use an existing log.
+			bool create=(options!=NULL && options->regionLog);
+			const char *logStr=getenv("MAP_REGION_LOG");
+			if (!create && logStr!=NULL)
+				create=(strcmp(logStr, "1")==0);
+			if (readOnly)
+				create=false;
+
+			if (!create && !Util::isFile(logPath))
+				return true;
+
+			regionsLog=new MapLog();
+			if (!regionsLog->open(logPath, readOnly)) {
+				fprintf(stderr,"error: could not open region log file at '%s'\n", logPath);
+				delete regionsLog;
+				regionsLog=NULL;
+				return false;
+			}
+
+			logCompactBytes=(options!=NULL ? options->regionLogCompactBytes : 0);
+			if (logCompactBytes==0)
+				logCompactBytes=(64u<<20);
+
+			// Start thread to sync and compact the log in the background.
+			if (!readOnly)
+				logThread=new std::thread(&Map::logThreadFunctor, this);
+
+			return true;
+		}
+
+		void Map::logStopThread(void) {
+			if (logThread==NULL)
+				return;
+
+			logLock.lock();
+			logStop=true;
+			logLock.unlock();
+			logCond.notify_all();
+
+			logThread->join();
+			delete logThread;
+			logThread=NULL;
+		}
+
+		void Map::logThreadFunctor(void) {
+			std::unique_lock<std::mutex> lock(logLock);
+			while(!logStop) {
+				// Wait a while so that records appended meanwhile are all flushed together.
+				logCond.wait_for(lock, std::chrono::milliseconds((unsigned)logSyncIntervalMs), [this]{ return logStop; });
+				lock.unlock();
+
+				if (!regionsLog->sync())
+					fprintf(stderr,"error: could not sync region log\n");
+
+				// Fold the log back into the region files once it grows large.
+				if (regionsLog->getSize()>logCompactBytes && !logCompact())
+					fprintf(stderr,"error: could not compact region log (will retry later)\n");
+
+				lock.lock();
+			}
+		}
+
+		bool Map::logCompact(void) {
+			std::lock_guard<std::mutex> compactGuard(logCompactLock);
+
+			// Save each region with records in full.
+			std::vector<std::pair<unsigned, unsigned> > regions;
+			regionsLog->getRegions(&regions);
+
+			bool success=true;
+			for(auto const &region: regions)
+				success&=logCompactRegion(region.first, region.second);
+
+			// Drop the records which are no longer needed (keeping those for any regions which were skipped, or have been modified since).
+			success&=regionsLog->rewrite();
+
+			return success;
+		}
+
+		bool Map::logCompactRegion(unsigned regionX, unsigned regionY) {
+			if (regionX>=regionsWide || regionY>=regionsHigh)
+				return false;
+
+			RegionData *regionData=getRegionData(regionX, regionY, true);
+			if (regionData==NULL)
+				return false;
+
+			RegionShard *shard=getRegionShard(regionX, regionY);
+			std::unique_lock<std::mutex> shardLock(shard->lock);
+
+			// If the region is loaded then simply save it in full (as saveRegions would).
+			MapRegion *region=regionData->ptr;
+			if (region!=NULL)
+				return regionSave(region, regionX, regionY, false);
+
+			// If it is waiting to be saved then leave it for next time.
+			std::unique_lock<std::mutex> saveLockGuard(saveLock);
+			if (regionData->saving!=NULL || regionData->savingInProgress)
+				return true;
+
+			// Otherwise save a private copy, with loadRegion made to wait meanwhile (as for a region being saved by a save thread, see saveReclaimRegion).
+			regionData->savingInProgress=true;
+			++saveInProgressCount;
+			saveLockGuard.unlock();
+			shardLock.unlock();
+
+			region=new MapRegion(regionX, regionY, regionsPool);
+			bool result=(regionLoad(region, regionX, regionY, NULL, 0) && regionSave(region, regionX, regionY, false));
 			delete region;
 
-			regionsByIndex[index]->ptr=NULL;
+			saveLockGuard.lock();
+			regionData->savingInProgress=false;
+			--saveInProgressCount;
+			saveLockGuard.unlock();
+			saveDoneCond.notify_all();
+
+			return result;
+		}
+
+		Map::RegionShard *Map::getRegionShard(unsigned regionX, unsigned regionY) {
+			// Mix coordinates so that neighbouring regions (as commonly loaded together) tend to fall into different shards.
+			unsigned hash=(regionX*73856093u)^(regionY*19349663u);
+			return &regionShards[hash%regionShardsCount];
+		}
+
+		Map::RegionData *Map::getRegionData(unsigned regionX, unsigned regionY, bool create) {
+			assert(regionX<regionsWide && regionY<regionsHigh);
+
+			std::atomic<RegionBlock *> *blockPtr=&regionBlocks[(regionY/regionBlockSize)*regionBlocksWide+(regionX/regionBlockSize)];
+			RegionBlock *block=blockPtr->load(std::memory_order_acquire);
+			if (block==NULL) {
+				if (!create)
+					return NULL;
+
+				// Allocate new block.
+				block=new RegionBlock;
+				if (block==NULL)
+					return NULL;
+				for(unsigned y=0; y<regionBlockSize; ++y)
+					for(unsigned x=0; x<regionBlockSize; ++x) {
+						RegionData *regionData=&block->regions[y][x];
+						regionData->ptr=NULL;
+						regionData->referenced=false;
+						regionData->state=RegionStateCold;
+						regionData->pins=0;
+						regionData->saving=NULL;
+						regionData->savingInProgress=false;
+						regionData->saves=0;
+					}
+
+				// Publish it, unless another thread got there first (in which case use theirs instead).
+				RegionBlock *expected=NULL;
+				if (!blockPtr->compare_exchange_strong(expected, block, std::memory_order_acq_rel)) {
+					delete block;
+					block=expected;
+				}
+			}
+
+			return &block->regions[regionY%regionBlockSize][regionX%regionBlockSize];
+		}
+
+		bool Map::regionExists(unsigned regionX, unsigned regionY) {
+			if (regionsExistence!=NULL && !regionsExistence->get(regionX, regionY))
+				return false;
+
+			MapPack::Extent extent;
+			if (regionsPack!=NULL && (regionsPack->getExtent(regionX, regionY, &extent) || regionsPack->getIsComplete()))
+				return (extent.offset!=0);
+
+			char regionPath[4096];
+			int regionPathLen=snprintf(regionPath, sizeof(regionPath), "%s/%u,%u", getRegionsDir(), regionX, regionY);
+			if (regionPathLen<0 || (size_t)regionPathLen>=sizeof(regionPath)) {
+				fprintf(stderr,"error: regions directory path '%s' is too long\n", getRegionsDir());
+				return false;
+			}
+			return Util::isFile(regionPath);
+		}
+
+		bool Map::regionLoad(MapRegion *region, unsigned regionX, unsigned regionY, const uint8_t *data, uint64_t dataSize) {
+			assert(region!=NULL);
+
+			// Try pack first, although regions may still be in their own file if they have not been saved since the pack was created.
+			bool loaded;
+			MapPack::Extent extent;
+			if (regionsPack!=NULL && regionsPack->getExtent(regionX, regionY, &extent))
+				loaded=region->load(regionsPack, regionX, regionY, data, dataSize);
+			else if (regionsPack!=NULL && regionsPack->getIsComplete())
+				loaded=false;
+			else {
+				char regionPath[4096];
+				int regionPathLen=snprintf(regionPath, sizeof(regionPath), "%s/%u,%u", getRegionsDir(), regionX, regionY);
+				if (regionPathLen>=0 && (size_t)regionPathLen<sizeof(regionPath))
+					loaded=region->load(regionPath, readOnly, data, dataSize);
+				else {
+					fprintf(stderr,"error: regions directory path '%s' is too long\n", getRegionsDir());
+					loaded=false;
+				}
+			}
+
+			// Apply any modifications saved to the log since the file was written.
+			if (loaded && regionsLog!=NULL)
+				loaded=region->loadLog(regionsLog, regionX, regionY);
+
+			return loaded;
+		}
+
+		bool Map::regionSave(MapRegion *region, unsigned regionX, unsigned regionY, bool allowLog) {
+			assert(region!=NULL);
+
+			// Let anyone who read the region's file without holding a lock (see prefetchLoadBatch) know that it is changing, both before and after writing it.
+			RegionData *regionData=getRegionData(regionX, regionY, true);
+			if (regionData!=NULL)
+				regionData->saves.fetch_add(1, std::memory_order_acq_rel);
+
+			// Small modifications are simply appended to the log (if used).
+			bool saved=false;
+			if (allowLog && regionsLog!=NULL && !regionsLog->getIsReadOnly())
+				saved=region->save(regionsLog, regionX, regionY);
+
+			// Otherwise write the whole region.
+			if (!saved) {
+				// If the log has records for the region then they are still replayed over the new file until a base record follows them, so first bring them up to date with what is about to be written (making sure that reaches the disk first).
+				// This way replaying them can never undo anything, even if the base record is lost.
+				bool hasRecords=(regionsLog!=NULL && regionsLog->getHasRecords(regionX, regionY));
+				if (hasRecords && !(region->saveLogLatest(regionsLog, regionX, regionY) && regionsLog->sync()))
+					saved=false;
+				else if (regionsPack==NULL)
+					saved=region->save(getRegionsDir(), regionX, regionY, regionsFileFormat);
+				else {
+					// Save into pack.
+					MapPack::Extent extent;
+					bool wasInPack=regionsPack->getExtent(regionX, regionY, &extent);
+					saved=region->save(regionsPack, regionX, regionY, regionsFileFormat);
+
+					// If this is the first time the region has been saved into the pack then remove its old file (if any).
+					if (saved && !wasInPack && !regionsPack->getIsComplete()) {
+						char regionPath[4096];
+						int regionPathLen=snprintf(regionPath, sizeof(regionPath), "%s/%u,%u", getRegionsDir(), regionX, regionY);
+						if (regionPathLen>=0 && (size_t)regionPathLen<sizeof(regionPath))
+							unlink(regionPath);
+						else
+							fprintf(stderr,"error: regions directory path '%s' is too long\n", getRegionsDir());
+					}
+				}
+
+				// The log's records for the region are now all included in its file.
+				// Note: failing this does not fail the save, as replaying the records is harmless (see above).
+				if (saved && hasRecords)
+					regionsLog->append(regionX, regionY, MapLog::RecordBase, NULL, 0);
+			}
+
+			if (regionData!=NULL)
+				regionData->saves.fetch_add(1, std::memory_order_release);
+			if (!saved)
+				return false;
+
+			// Update pyramid to match.
+			// Note: failing this does not fail the save, as the pyramid can always be recomputed from the region, but a stale file must not be left behind.
+			if (!MapPyramid::save(getPyramidDir(), regionX, regionY, region))
+				MapPyramid::remove(getPyramidDir(), regionX, regionY);
+
+			// Similarly update stats.
+			MapStats::Entry statsEntry;
+			MapStats::compute(region, seaLevel, &statsEntry);
+			if (!regionsStats->set(regionX, regionY, statsEntry))
+				regionsStats->remove(regionX, regionY);
+
+			return true;
+		}
+
+		bool Map::regionEvict(RegionShard *shard) {
+			assert(shard!=NULL);
+			assert(!shard->regions.empty());
+
+			// Advance the clock hand until we find a cold region which has not been used since we last passed it (and is not pinned).
+			// Regions are split into cold and hot as in CLOCK-Pro/2Q, so that a scan over the whole map only cycles through cold regions rather than evicting everything:
+			// Cold regions used again are kept for another pass as a test, and promoted to hot if used on that pass too.
+			// Hot regions are only demoted back to cold (for the next pass to consider) once they take up more than regionHotPercent of the budget, and then only if unused since the hand last passed.
+			// Note: this terminates within three sweeps unless every region is pinned, as referenced flags are cleared as we go and unused hot regions are taken on the third sweep if nothing else can be (e.g. when the budget only has room for a few regions).
+			RegionData *regionData;
+			size_t hotBytesMax=shard->cacheBytes/100*regionHotPercent;
+			for(size_t steps=0; ; ++steps) {
+				if (steps>=3*shard->regions.size())
+					return true;
+
+				if (shard->clockHand>=shard->regions.size())
+					shard->clockHand=0;
+
+				regionData=shard->regions[shard->clockHand];
+				if (regionData->pins.load(std::memory_order_acquire)==0) { // acquire pairs with unpinRegion's release, so the holder's writes are visible
+					bool referenced=regionData->referenced.exchange(false, std::memory_order_relaxed);
+					if (regionData->state==RegionStateHot) {
+						if (!referenced && steps>=2*shard->regions.size())
+							break;
+						if (!referenced && shard->hotBytes>hotBytesMax) {
+							regionData->state=RegionStateCold;
+							shard->hotBytes-=regionData->bytes;
+						}
+					} else if (!referenced)
+						break;
+					else if (regionData->state==RegionStateCold)
+						regionData->state=RegionStateColdTested;
+					else {
+						regionData->state=RegionStateHot;
+						shard->hotBytes+=regionData->bytes;
+					}
+				}
+
+				++shard->clockHand;
+			}
+
+			// If this region is dirty then hand it to a save thread, so that the caller can carry on without waiting for the write.
+			// Failing that save it back to disk ourselves.
+			// Note: for read only maps any changes are simply discarded.
+			MapRegion *region=regionData->ptr;
+			if (region->getIsDirty() && !readOnly) {
+				if (saveQueueRegion(shard, regionData))
+					return true;
+				if (!regionSave(region, regionData->offsetX, regionData->offsetY, true))
+					return false;
+			}
+
+			// Unload the region.
+			// Note: this moves the last region into the hand's slot, which will be considered next.
+			regionRetire(regionUnload(shard, regionData->index));
+
+			return true;
+		}
+
+		void Map::regionRecharge(RegionShard *shard) {
+			assert(shard!=NULL);
+
+			// Snapshots are taken and replaced while regions are loaded, so their memory is charged as it changes rather than only on load.
+			// Note: regions cannot be freed while listed in the shard, and we hold its lock.
+			for(size_t i=0; i<shard->regions.size(); ++i) {
+				RegionData *regionData=shard->regions[i];
+				size_t snapshotBytes=regionData->ptr.load(std::memory_order_relaxed)->getSnapshotMemoryUsage();
+				if (snapshotBytes==regionData->snapshotBytes)
+					continue;
+
+				size_t bytes=regionData->bytes-regionData->snapshotBytes+snapshotBytes;
+				shard->bytes=shard->bytes-regionData->bytes+bytes;
+				if (regionData->state==RegionStateHot)
+					shard->hotBytes=shard->hotBytes-regionData->bytes+bytes;
+				regionData->bytes=bytes;
+				regionData->snapshotBytes=snapshotBytes;
+			}
+		}
+
+		MapRegion *Map::pinRegion(unsigned regionX, unsigned regionY, bool create) {
+			RegionShard *shard=getRegionShard(regionX, regionY);
+
+			while(1) {
+				MapRegion *region=getRegionAtOffset(regionX, regionY, create);
+				if (region==NULL)
+					return NULL;
+				RegionData *regionData=getRegionData(regionX, regionY, false); // block must exist as the region was loaded
+
+				// The region may have been unloaded since we looked it up (though not freed, see regionProtect), in which case we have to try again.
+				// Note: the shard lock is needed so that eviction cannot check the pin count between our lookup and incrementing it.
+				std::lock_guard<std::mutex> guard(shard->lock);
+				if (regionData->ptr.load(std::memory_order_relaxed)==region) {
+					regionData->pins.fetch_add(1, std::memory_order_relaxed);
+					return region;
+				}
+			}
+		}
+
+		void Map::unpinRegion(unsigned regionX, unsigned regionY) {
+			RegionData *regionData=getRegionData(regionX, regionY, false);
+			assert(regionData!=NULL);
+			assert(regionData->pins.load(std::memory_order_relaxed)>0);
+			regionData->pins.fetch_sub(1, std::memory_order_release);
+		}
+
+		MapRegion *Map::regionUnload(RegionShard *shard, unsigned index) {
+			assert(shard!=NULL);
+			assert(index<shard->regions.size());
+
+			// Clear the RegionData pointer (so that new lookups miss).
+			// Note: this must be ordered before any check for hazards (see regionProtect).
+			RegionData *regionData=shard->regions[index];
+			MapRegion *region=regionData->ptr;
+			regionData->ptr.store(NULL, std::memory_order_seq_cst);
+
+			shard->bytes-=regionData->bytes;
+			if (regionData->state==RegionStateHot)
+				shard->hotBytes-=regionData->bytes;
 
 			// Copy last array element into this gap and update its index.
-			regionsByIndex[index]=regionsByIndex[regionsCount-1];
-			regionsByIndex[index]->index=index;
+			shard->regions[index]=shard->regions.back();
+			shard->regions[index]->index=index;
+			shard->regions.pop_back();
+
+			return region;
+		}
+
+		MapRegion *Map::regionProtect(RegionData *regionData) {
+			assert(regionData!=NULL);
+
+			RegionHazards *hazards=regionHazardsGet();
+			MapRegion *region=regionData->ptr.load(std::memory_order_acquire);
+			while(region!=NULL) {
+				// Already protected?
+				for(unsigned i=0; i<regionHazardsMax; ++i)
+					if (hazards->regions[i].load(std::memory_order_relaxed)==region)
+						return region;
+
+				// Protect it, then check that it was not unloaded before regionRetire could see this.
+				hazards->regions[hazards->next].store(region, std::memory_order_seq_cst);
+				MapRegion *check=regionData->ptr.load(std::memory_order_seq_cst);
+				if (check==region) {
+					hazards->next=(hazards->next+1)%regionHazardsMax;
+					return region;
+				}
+				region=check;
+			}
+
+			return NULL;
+		}
+
+		void Map::regionRetire(MapRegion *region) {
+			assert(region!=NULL);
+
+			std::lock_guard<std::mutex> guard(retiredLock);
+			retiredRegions.push_back(region);
 
-			// Decrement index next.
-			--regionsCount;
+			// Free every retired region which no thread has protected (including those kept from earlier calls).
+			for(size_t i=0; i<retiredRegions.size(); ) {
+				if (regionHazardsFind(retiredRegions[i])) {
+					++i;
+					continue;
+				}
+				delete retiredRegions[i];
+				retiredRegions[i]=retiredRegions.back();
+				retiredRegions.pop_back();
+			}
+		}
+
+		Map::RegionView::RegionView(class Map *map): map(map) {
+			assert(map!=NULL);
+
+			region=NULL;
+			regionX=regionY=0;
+			isWrite=false;
+		}
+
+		Map::RegionView::RegionView(class Map *map, unsigned regionX, unsigned regionY, GetTileFlag flags): RegionView(map) {
+			setRegion(regionX, regionY, flags);
+		}
+
+		Map::RegionView::~RegionView() {
+			clear();
+		}
+
+		bool Map::RegionView::setRegion(unsigned regionX, unsigned regionY, GetTileFlag flags) {
+			clear();
+
+			// Out of bounds?
+			if (regionX*MapRegion::tilesSize>=map->getWidth() || regionY*MapRegion::tilesSize>=map->getHeight())
+				return false;
+
+			region=map->pinRegion(regionX, regionY, (flags & GetTileFlag::Create)!=0);
+			if (region==NULL)
+				return false;
+
+			this->regionX=regionX;
+			this->regionY=regionY;
+
+			if (flags & GetTileFlag::Dirty) {
+				region->beginWrite();
+				region->setDirty();
+				isWrite=true;
+			}
+
+			return true;
+		}
+
+		void Map::RegionView::clear(void) {
+			if (region==NULL)
+				return;
+
+			// Mark region dirty again in case a snapshot was taken between setRegion and the modifications which followed.
+			if (isWrite) {
+				region->setDirty();
+				region->endWrite();
+				isWrite=false;
+			}
+
+			map->unpinRegion(regionX, regionY);
+			region=NULL;
+		}
+
+		bool Map::RegionView::getIsValid(void) const {
+			return (region!=NULL);
+		}
+
+		unsigned Map::RegionView::getRegionX(void) const {
+			return regionX;
+		}
+
+		unsigned Map::RegionView::getRegionY(void) const {
+			return regionY;
+		}
+
+		MapRegion *Map::RegionView::getRegion(void) const {
+			return region;
+		}
+
+		MapTile::FileData *Map::RegionView::getTileFileData(void) {
+			assert(region!=NULL);
+			return region->getTileFileData();
+		}
+
+		MapTile::Layer (*Map::RegionView::getLayers(void))[MapTile::layersMax] {
+			return getTileFileData()->layers;
+		}
+
+		double *Map::RegionView::getHeights(void) {
+			return getTileFileData()->height;
+		}
+
+		double *Map::RegionView::getMoistures(void) {
+			return getTileFileData()->moisture;
+		}
+
+		double *Map::RegionView::getTemperatures(void) {
+			return getTileFileData()->temperature;
+		}
+
+		uint64_t *Map::RegionView::getBitsets(void) {
+			return getTileFileData()->bitset;
+		}
+
+		uint16_t *Map::RegionView::getLandmassIds(void) {
+			return getTileFileData()->landmassId;
+		}
+
+		MapTile *Map::RegionView::getTileAtOffset(unsigned offsetX, unsigned offsetY) {
+			assert(region!=NULL);
+			assert(offsetX<MapRegion::tilesSize && offsetY<MapRegion::tilesSize);
+			return region->getTileAtOffset(offsetX, offsetY);
+		}
+
+		void Map::RegionView::setDirty(void) {
+			assert(region!=NULL);
+			region->setDirty();
+		}
+
+		void Map::RegionView::setDirtyAtOffset(unsigned offsetX, unsigned offsetY) {
+			assert(region!=NULL);
+			region->setDirtyAtOffset(offsetX, offsetY);
+		}
+
+		Map::WorkingSet::WorkingSet(class Map *map): map(map) {
+			assert(map!=NULL);
+		}
+
+		Map::WorkingSet::~WorkingSet() {
+			clear();
+		}
+
+		bool Map::WorkingSet::add(unsigned regionX, unsigned regionY, bool create) {
+			if (getContains(regionX, regionY))
+				return true;
+
+			if (map->pinRegion(regionX, regionY, create)==NULL)
+				return false;
+
+			entries.push_back(regionY*regionsSize+regionX);
+
+			return true;
+		}
+
+		void Map::WorkingSet::addNeighbourhood(unsigned regionX, unsigned regionY, unsigned radius) {
+			// Wrap around the edges of the map (as the tiles themselves do), taking care not to visit a region twice if the map is narrower than the neighbourhood.
+			const unsigned regionsWide=map->getWidth()/MapRegion::tilesSize;
+			const unsigned regionsHigh=map->getHeight()/MapRegion::tilesSize;
+			const unsigned countX=std::min(2*radius+1, regionsWide);
+			const unsigned countY=std::min(2*radius+1, regionsHigh);
+
+			for(unsigned dy=0; dy<countY; ++dy)
+				for(unsigned dx=0; dx<countX; ++dx)
+					add((regionX+regionsWide-radius%regionsWide+dx)%regionsWide, (regionY+regionsHigh-radius%regionsHigh+dy)%regionsHigh, false);
+		}
+
+		void Map::WorkingSet::setNeighbourhood(unsigned regionX, unsigned regionY, unsigned radius) {
+			// Pin the new neighbourhood before unpinning the old one, so that regions in both stay loaded throughout (pins are counted, so pinning them twice is harmless).
+			std::vector<unsigned> oldEntries;
+			oldEntries.swap(entries);
+
+			addNeighbourhood(regionX, regionY, radius);
+
+			for(auto entry: oldEntries)
+				map->unpinRegion(entry%regionsSize, entry/regionsSize);
+		}
+
+		void Map::WorkingSet::clear(void) {
+			for(auto entry: entries)
+				map->unpinRegion(entry%regionsSize, entry/regionsSize);
+			entries.clear();
+		}
+
+		bool Map::WorkingSet::getContains(unsigned regionX, unsigned regionY) const {
+			return (std::find(entries.begin(), entries.end(), regionY*regionsSize+regionX)!=entries.end());
+		}
+
+		size_t Map::WorkingSet::getCount(void) const {
+			return entries.size();
+		}
+
+		void Map::streamingPin(RegionData *regionData) {
+			if (streamingAccessDepth==0 || streamingPinsFind(this, regionData->offsetX, regionData->offsetY))
+				return;
+
+			regionData->pins.fetch_add(1, std::memory_order_relaxed);
+			streamingPinsLast=streamingPins.size();
+			streamingPins.push_back({this, regionData->offsetX, regionData->offsetY});
+		}
+
+		Map::StreamingAccess::StreamingAccess() {
+			++streamingAccessDepth;
+			pinsStart=streamingPins.size();
+		}
+
+		Map::StreamingAccess::~StreamingAccess() {
+			release();
+			assert(streamingAccessDepth>0);
+			--streamingAccessDepth;
+		}
+
+		void Map::StreamingAccess::release(void) {
+			assert(streamingPins.size()>=pinsStart);
+			while(streamingPins.size()>pinsStart) {
+				StreamingPin *pin=&streamingPins.back();
+				pin->map->unpinRegion(pin->regionX, pin->regionY);
+				streamingPins.pop_back();
+			}
+		}
+
+		bool Map::StreamingAccess::getIsActive(void) {
+			return (streamingAccessDepth>0);
+		}
+
+		MapRegion *Map::writeScopeRegion(unsigned regionX, unsigned regionY, bool create) {
+			// Without a scope the write could not be bracketed, and snapshots taken meanwhile would be torn.
+			assert(writeScopeDepth>0);
+			if (writeScopeDepth==0)
+				return getRegionAtOffset(regionX, regionY, create);
+
+			// Already writing to this region?
+			// Note: the last entry is checked first as writes tend to stay within one region.
+			if (writeScopeEntriesLast<writeScopeEntries.size()) {
+				const WriteScopeEntry *entry=&writeScopeEntries[writeScopeEntriesLast];
+				if (entry->map==this && entry->regionX==regionX && entry->regionY==regionY)
+					return entry->region;
+			}
+			for(size_t i=0; i<writeScopeEntries.size(); ++i)
+				if (writeScopeEntries[i].map==this && writeScopeEntries[i].regionX==regionX && writeScopeEntries[i].regionY==regionY) {
+					writeScopeEntriesLast=i;
+					return writeScopeEntries[i].region;
+				}
+
+			// Pin the region (so that it is still loaded to end the write) and begin writing before anything is modified.
+			MapRegion *region=pinRegion(regionX, regionY, create);
+			if (region==NULL)
+				return NULL;
+			region->beginWrite();
+
+			writeScopeEntriesLast=writeScopeEntries.size();
+			writeScopeEntries.push_back({this, region, regionX, regionY});
+
+			return region;
+		}
+
+		Map::WriteScope::WriteScope() {
+			++writeScopeDepth;
+			entriesStart=writeScopeEntries.size();
+		}
+
+		Map::WriteScope::~WriteScope() {
+			release();
+			assert(writeScopeDepth>0);
+			--writeScopeDepth;
+		}
+
+		void Map::WriteScope::release(void) {
+			assert(writeScopeEntries.size()>=entriesStart);
+			while(writeScopeEntries.size()>entriesStart) {
+				WriteScopeEntry *entry=&writeScopeEntries.back();
+				entry->region->endWrite();
+				entry->map->unpinRegion(entry->regionX, entry->regionY);
+				writeScopeEntries.pop_back();
+			}
 		}
 	};
 };
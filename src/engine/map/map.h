@@ -1,11 +1,21 @@
 #ifndef ENGINE_GRAPHICS_MAP_H
 #define ENGINE_GRAPHICS_MAP_H
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
+#include <thread>
 #include <vector>
 
+#include "mapexistence.h"
+#include "mapio.h"
+#include "maplog.h"
 #include "mapobject.h"
+#include "mappack.h"
+#include "mappyramid.h"
 #include "mapregion.h"
+#include "mapstats.h"
 #include "maptexture.h"
 #include "maptile.h"
 #include "../physics/coord.h"
@@ -28,31 +38,161 @@ namespace Engine {
 				CreateDirty=3,
 			};
 
-			static const unsigned regionsSize=256; // numbers of regions per side, with total number of regions equal to regionsSize squared
+			// Zero (or NULL/false) fields fall back on environment variables, see README.md.
+			struct Options {
+				size_t regionCacheBytes=0; // Memory budget for loaded regions.
+				const char *regionCodec=NULL; // 'none', 'lz' or 'zstd'.
+				const char *regionEncoding=NULL; // 'full', 'float' or 'quantized'.
+				unsigned prefetchThreads=2; // 0 disables prefetching.
+				bool prefetchUring=true; // Read prefetched files via io_uring where supported.
+				unsigned saveThreads=1; // 0 saves regions as they are evicted.
+				bool regionPack=false; // Store regions in a single 'regions.pack' file.
+				size_t saveQueueBytes=0; // Memory for evicted regions awaiting save (0 for an eighth of the cache).
+				size_t regionPoolBytes=0; // Memory kept from evicted regions for reuse.
+				bool regionHugePages=false; // Back tile data with transparent huge pages.
+				bool regionLog=false; // Append small changes to 'regions.log'.
+				size_t regionLogCompactBytes=0; // Log size which triggers compaction (0 for 64M).
+				bool readOnly=false; // Open without the lock file and never save.
+			};
+
+			static const unsigned regionsSize=65536; // maximum number of regions per side
+
+			// Pins a single region, giving direct access to its tile data.
+			class RegionView {
+			public:
+				static const unsigned stride=MapRegion::tilesSize; // distance between rows in the arrays below
+
+				RegionView(class Map *map); // creates an empty view (see setRegion)
+				RegionView(class Map *map, unsigned regionX, unsigned regionY, GetTileFlag flags); // as setRegion
+				~RegionView();
+
+				// Pins the given region in place of any current one, returning false if it does not exist.
+				bool setRegion(unsigned regionX, unsigned regionY, GetTileFlag flags);
+				void clear(void); // Unpins any current region.
+
+				bool getIsValid(void) const; // True if a region is currently pinned.
+				unsigned getRegionX(void) const;
+				unsigned getRegionY(void) const;
+				MapRegion *getRegion(void) const;
+
+				// Note: these expand uniform regions, and should be fetched again after a save.
+				MapTile::FileData *getTileFileData(void);
+				MapTile::Layer (*getLayers(void))[MapTile::layersMax];
+				double *getHeights(void);
+				double *getMoistures(void);
+				double *getTemperatures(void);
+				uint64_t *getBitsets(void);
+				uint16_t *getLandmassIds(void);
+
+				MapTile *getTileAtOffset(unsigned offsetX, unsigned offsetY); // Offsets are within the region.
+
+				// Marks modifications made via the above (unless created with Dirty).
+				void setDirty(void);
+				void setDirtyAtOffset(unsigned offsetX, unsigned offsetY);
+			private:
+				class Map *map;
+				MapRegion *region;
+				unsigned regionX, regionY;
+				bool isWrite; // see Dirty flag in setRegion
+
+				RegionView(const RegionView &)=delete;
+				RegionView &operator=(const RegionView &)=delete;
+			};
+
+			// Keeps a set of regions pinned for as long as it exists.
+			class WorkingSet {
+			public:
+				WorkingSet(class Map *map);
+				~WorkingSet();
+
+				bool add(unsigned regionX, unsigned regionY, bool create); // Returns false if the region does not exist or is out of bounds.
+				void addNeighbourhood(unsigned regionX, unsigned regionY, unsigned radius); // Adds existing regions within radius (wrapping around).
+				void setNeighbourhood(unsigned regionX, unsigned regionY, unsigned radius); // As addNeighbourhood, but also removes regions outside it.
+				void clear(void); // Unpins all regions.
+
+				bool getContains(unsigned regionX, unsigned regionY) const;
+				size_t getCount(void) const;
+			private:
+				class Map *map;
+				std::vector<unsigned> entries; // entries are regionY*regionsSize+regionX
 
-			Map(const char *mapBaseDirPath, unsigned mapWidth, unsigned mapHeight); // creates a new map, must not exist already. width and height are rounded up to a non-zero multiple of MapRegion::tilesSize, and are capped at Map::regionsSize*MapRegion::tilesSize.
-			Map(const char *mapBaseDirPath, bool ignoreLock); // loads an existing map
+				WorkingSet(const WorkingSet &)=delete;
+				WorkingSet &operator=(const WorkingSet &)=delete;
+			};
+
+			// Treats the creating thread's accesses as a one-off pass over the map (see regionEvict).
+			class StreamingAccess {
+			public:
+				StreamingAccess();
+				~StreamingAccess();
+
+				void release(void); // Unpins the regions used since this scope began.
+
+				static bool getIsActive(void); // True if the current thread is within a scope.
+			private:
+				size_t pinsStart;
+
+				StreamingAccess(const StreamingAccess &)=delete;
+				StreamingAccess &operator=(const StreamingAccess &)=delete;
+			};
+
+			// Brackets the creating thread's Dirty tile accesses with MapRegion::beginWrite/endWrite, pinning each region written until the scope ends.
+			// Dirty accesses via getTileAtOffset/getTileAtCoordVec require one. Scopes can be nested.
+			class WriteScope {
+			public:
+				WriteScope();
+				~WriteScope();
+
+				void release(void); // Ends writes to the regions used since this scope began.
+			private:
+				size_t entriesStart;
+
+				WriteScope(const WriteScope &)=delete;
+				WriteScope &operator=(const WriteScope &)=delete;
+			};
+
+			Map(const char *mapBaseDirPath, unsigned mapWidth, unsigned mapHeight, const Options *options=NULL); // creates a new map, must not exist already. width and height are rounded up to a non-zero multiple of MapRegion::tilesSize, and are capped at Map::regionsSize*MapRegion::tilesSize.
+			Map(const char *mapBaseDirPath, bool ignoreLock, const Options *options=NULL); // loads an existing map
 			~Map();
 
-			bool save(void); // Saves everything recursively.
+			bool save(void); // Saves everything recursively (returns false if read only).
 			bool saveMetadata(void) const; // Creates directories.
 			bool saveTextures(void) const; // Only saves list of textures (requires directory exists).
 			bool saveItems(void) const; // Only saves list of item 'definitions' (requires directory exists).
+			bool saveManifest(void) const; // Only saves the manifest (requires textures and items have been saved).
 			bool saveRegions(void); // Only saves regions (requires directory exists).
+			bool rewriteRegions(Util::ProgressFunctor *progressFunctor, void *progressUserData); // Resaves every existing region in the current format.
 
-			bool loadRegion(unsigned regionX, unsigned regionY, const char *regionPath);
+			MapRegion *loadRegion(unsigned regionX, unsigned regionY, bool create); // Returns NULL if missing and create is false.
 			bool markRegionDirtyAtTileOffset(unsigned offsetX, unsigned offsetY, bool create);
 
 			void tick(void);
 
+			bool getIsReadOnly(void) const;
 			unsigned getWidth(void) const;
 			unsigned getHeight(void) const;
+			size_t getRegionCacheBytes(void) const;
 
+			// Unpinned pointers are only valid until this thread looks up several other regions.
 			MapTile *getTileAtCoordVec(const CoordVec &vec, GetTileFlag flags);
 			MapTile *getTileAtOffset(unsigned offsetX, unsigned offsetY, GetTileFlag flags);
 			MapRegion *getRegionAtCoordVec(const CoordVec &vec, bool create);
 			MapRegion *getRegionAtOffset(unsigned regionX, unsigned regionY, bool create);
 
+			// As getRegionAtOffset, but pinned until unpinRegion (pins are counted).
+			MapRegion *pinRegion(unsigned regionX, unsigned regionY, bool create);
+			void unpinRegion(unsigned regionX, unsigned regionY);
+
+			// Reads the region's pyramid cells at the given level, returning false if missing.
+			bool getRegionPyramid(unsigned regionX, unsigned regionY, unsigned level, MapPyramid::Cell *cells);
+
+			// Reads the region's summary statistics, returning false if missing.
+			bool getRegionStats(unsigned regionX, unsigned regionY, MapStats::Entry *entry);
+
+			// Hints that the given region will be needed soon.
+			void prefetchRegion(unsigned regionX, unsigned regionY);
+			void prefetchRegionAtCoordVec(const CoordVec &vec);
+
 			bool addObject(MapObject *object);
 			bool moveObject(MapObject *object, const CoordVec &newPos);
 
@@ -75,44 +215,201 @@ namespace Engine {
 			// These are similar but are not covered by the above function.
 			double seaLevel, alpineLevel, forestLevel;
 		private:
-			static const unsigned regionsLoadedMax=32; // TODO: Decide this better
+			static const unsigned regionsLoadedMin=8; // least number of regions the cache budget allows
 
 			int lockFd;
 
 			unsigned mapWidth, mapHeight; // these should both be multiples of MapRegion::tilesSize
 
 			char *baseDir;
+			// Metadata, textures and items in a single file.
+			struct ManifestHeader {
+				char magic[4]; // see manifestMagic
+				uint32_t version;
+				uint32_t size; // total size, to detect partial writes
+				uint32_t mapWidth, mapHeight;
+				uint32_t textureCount, itemCount; // entries following the header, followed by their strings
+				uint32_t padding;
+				double minHeight, maxHeight;
+				double minTemperature, maxTemperature;
+				double minMoisture, maxMoisture;
+				double seaLevel, alpineLevel, forestLevel;
+			};
+
+			struct ManifestTexture {
+				uint16_t id;
+				uint8_t mapColourR, mapColourG, mapColourB;
+				uint8_t padding;
+				uint32_t scale;
+				uint32_t fileNameOffset; // into the strings, relative to the textures directory
+			};
+
+			struct ManifestItem {
+				uint16_t id;
+				uint16_t padding;
+				uint32_t nameOffset; // into the strings
+			};
+
+			static const char manifestMagic[4];
+			static const uint32_t manifestVersion=1;
+			static const size_t manifestReadSize=65536; // initial read, usually the whole manifest
+
+			bool manifestLoad(void); // Returns false (loading nothing) if there is no valid manifest.
+			void scanLoad(void); // Loads from the individual files, throwing on failure.
+
 			char *texturesDir;
 			char *itemsDir;
 			char *regionsDir;
 			char *mapTiledDir;
+			char *pyramidDir;
+
+			bool readOnly; // see Options::readOnly
+
+			static const unsigned regionShardsMax=16;
+			static const unsigned regionShardsMinRegions=4; // least regions per shard
+
+			// Clock states (see regionEvict).
+			enum RegionState : uint8_t {
+				RegionStateCold, // evicted once found unused
+				RegionStateColdTested, // used again since loaded
+				RegionStateHot, // only evicted once demoted
+			};
+			static const unsigned regionHotPercent=75; // share of a shard's budget hot regions may use
 
 			struct RegionData {
-				MapRegion *ptr; // Pointer to region itself.
-				unsigned index; // Index into regionsByIndex array.
-				unsigned offsetX, offsetY; // Indicies into regionsByOffset array.
+				std::atomic<MapRegion *> ptr; // Written with the shard lock held, read without.
+				std::atomic<bool> referenced; // Set on non-streaming access, cleared by the clock hand.
+				RegionState state; // Protected by the shard lock.
+				std::atomic<unsigned> pins; // Incremented with the shard lock held.
+				unsigned index; // Index into owning shard's regions array.
+				unsigned offsetX, offsetY; // Region offset (set when loaded).
+				size_t bytes; // Charged against the shard's budget.
+				size_t snapshotBytes; // Share of bytes charged for the region's latest snapshot (see regionRecharge).
+				MapRegion *saving; // Evicted while dirty and awaiting save. Protected by saveLock.
+				bool savingInProgress; // Set while saving is written. Protected by saveLock.
+				std::atomic<unsigned> saves; // Incremented before and after each save, to detect stale reads.
 			};
 
-			unsigned regionsCount;
-			RegionData *regionsByIndex[regionsLoadedMax]; // These are pointers into regionsByOffset array.
-			RegionData *regionsByAge[regionsLoadedMax]; // These are pointers into regionsByOffset array.
-			RegionData regionsByOffset[regionsSize][regionsSize]; // [y][x]
-			std::mutex regionsLock;
+			// Loaded regions are split between shards, each with its own lock, budget and clock.
+			struct RegionShard {
+				std::mutex lock;
+				std::vector<RegionData *> regions; // These are pointers into region blocks (see regionBlocks).
+				unsigned clockHand; // Index of the next eviction candidate.
+				size_t bytes; // Sum of 'bytes' field for all regions in this shard.
+				size_t hotBytes; // As bytes but only for hot regions.
+				size_t cacheBytes; // Budget for this shard.
+			};
+
+			size_t regionsCacheBytes; // Budget for loaded regions (across all shards).
+			MapRegion::FileFormat regionsFileFormat; // Used when saving regions.
+			MapPack *regionsPack; // If NULL then each region is stored in its own file.
+			MapStats *regionsStats; // Summary statistics for each saved region (see getRegionStats).
+			MapExistence *regionsExistence; // Which regions have been saved.
+			MapRegion::BufferPool *regionsPool; // Memory recycled between regions.
+			MapLog *regionsLog; // If NULL then regions are always saved in full.
+			unsigned regionShardsCount;
+			RegionShard regionShards[regionShardsMax];
+			std::mutex retiredLock;
+			std::vector<MapRegion *> retiredRegions; // unloaded but still protected (see regionRetire)
+
+			// Regions are indexed in blocks, allocated on first use and freed with the map.
+			static const unsigned regionBlockSize=32; // regions per side of each block
+			struct RegionBlock {
+				RegionData regions[regionBlockSize][regionBlockSize]; // [y][x]
+			};
+
+			unsigned regionsWide, regionsHigh; // map size in regions
+			unsigned regionBlocksWide, regionBlocksHigh;
+			std::atomic<RegionBlock *> *regionBlocks; // [blockY*regionBlocksWide+blockX], NULL until needed
 
 			MapTexture *textures[MapTexture::IdMax];
 
 			MapItem *items[MapItem::IdMax];
 
 			const char *getRegionsDir(void) const;
+			const char *getPyramidDir(void) const;
 			const char *getTexturesDir(void) const;
 			const char *getItemsDir(void) const;
 
-			MapRegion *getRegionAtIndex(unsigned index);
-			const MapRegion *getRegionAtIndex(unsigned index) const;
+			static const unsigned prefetchThreadsMax=16;
+			static const unsigned prefetchQueueMax=64; // oldest hints are dropped beyond this
+			static const unsigned prefetchSequentialDistance=2; // regions queued ahead of a thread moving in a straight line
+			static const unsigned prefetchBatchMax=16; // most hints taken at once
+			static const size_t prefetchBatchBytesMax=(64u<<20); // most file data read per batch
+
+			unsigned prefetchThreadCount;
+			std::thread *prefetchThreads[prefetchThreadsMax]; // started on first use
+			bool prefetchThreadsStarted;
+			bool prefetchStop;
+			std::mutex prefetchLock;
+			std::condition_variable prefetchCond;
+			std::deque<unsigned> prefetchQueue; // entries are regionY*regionsSize+regionX
+			MapIO *prefetchIO; // NULL if prefetching is disabled
+
+			static const unsigned saveThreadsMax=16;
+
+			unsigned saveThreadCount;
+			std::thread *saveThreads[saveThreadsMax]; // started on first use
+			bool saveThreadsStarted;
+			bool saveStop;
+			bool saveFailed; // after which regions are saved as evicted
+			std::mutex saveLock;
+			std::condition_variable saveCond; // signalled when a region is queued or threads should stop
+			std::condition_variable saveDoneCond; // signalled when a save thread finishes with a region
+			std::deque<RegionData *> saveQueue;
+			unsigned saveInProgressCount;
+			size_t saveQueueBytes; // Sum of 'bytes' field for all regions with 'saving' set.
+			size_t saveQueueBytesMax;
+
+			static const unsigned logSyncIntervalMs=100; // how often the log is flushed to disk
+
+			std::thread *logThread; // syncs and compacts the log (or NULL)
+			bool logStop;
+			std::mutex logLock; // protects logStop
+			std::condition_variable logCond; // signalled when the thread should stop
+			std::mutex logCompactLock; // held while compacting
+			size_t logCompactBytes; // see Options::regionLogCompactBytes
+
+			void regionsInit(const Options *options);
+			bool regionsIndexInit(void); // Allocates the region index once the map's size is known.
+			bool regionsPackOpen(const Options *options); // Opens the pack file if it exists or is requested.
+			bool regionsStatsOpen(void); // Opens the stats file (creating it if needed).
+			bool regionsExistenceOpen(void); // Opens the existence bitmap, rebuilding it if stale. Requires the pack is open.
+			uint64_t regionsExistenceGetStamp(void) const; // Describes the regions directory and pack file.
+			bool regionsLogOpen(const Options *options); // Opens the log file if it exists or is requested.
+
+			void logStopThread(void);
+			void logThreadFunctor(void);
+			bool logCompact(void); // Folds every logged region into its file, then rewrites the log.
+			bool logCompactRegion(unsigned regionX, unsigned regionY); // Saves the region in full, so that its log records are no longer needed.
+
+			void prefetchInit(const Options *options);
+			void prefetchStopThreads(void);
+			void prefetchThreadFunctor(void);
+			void prefetchLoadBatch(const unsigned *entries, unsigned count); // Reads the entries' files together, then loads them.
+			void prefetchNoteAccess(unsigned regionX, unsigned regionY); // Called when the current thread moves to a different region.
+
+			void saveInit(const Options *options);
+			void saveStopThreads(void);
+			void saveThreadFunctor(void);
+			bool saveFlush(void); // Waits for queued saves, retrying any failures.
+			bool saveQueueRegion(RegionShard *shard, RegionData *regionData); // Unloads a dirty region and queues it for saving, if possible. Requires shard's lock is held.
+			MapRegion *saveReclaimRegion(RegionData *regionData); // Takes back a region awaiting save, or returns NULL.
 
-			void updateRegionAge(const MapRegion *region);
+			RegionShard *getRegionShard(unsigned regionX, unsigned regionY);
+			RegionData *getRegionData(unsigned regionX, unsigned regionY, bool create); // Returns NULL if the region's block is unallocated and create is false.
 
-			void regionUnload(unsigned index);
+			bool regionExists(unsigned regionX, unsigned regionY); // True if the region has been saved.
+			MapRegion *loadRegionData(unsigned regionX, unsigned regionY, bool create, const uint8_t *data, uint64_t dataSize, unsigned dataSaves); // As loadRegion, using data read earlier unless the region has been saved since.
+			bool regionLoad(MapRegion *region, unsigned regionX, unsigned regionY, const uint8_t *data, uint64_t dataSize); // Reads from the pack or the region's file, then applies log records.
+			bool regionSave(MapRegion *region, unsigned regionX, unsigned regionY, bool allowLog); // Saves to the log (if allowed), pack or file, then updates pyramid and stats.
+			bool regionEvict(RegionShard *shard); // Unloads a region chosen by the clock, saving it if dirty. Requires shard's lock is held.
+			void regionRecharge(RegionShard *shard); // Updates the shard's charges for snapshots taken (or dropped) since its regions were loaded. Requires shard's lock is held.
+			MapRegion *regionUnload(RegionShard *shard, unsigned index); // Removes region from the shard for the caller to retire. Requires shard's lock is held.
+			MapRegion *regionProtect(RegionData *regionData); // Returns the loaded region (or NULL), protected from being freed for a while.
+			void regionRetire(MapRegion *region); // Frees region once no thread has it protected.
+			void streamingPin(RegionData *regionData); // Pins for the current StreamingAccess scope, if any. Requires shard's lock is held.
+			MapRegion *writeScopeRegion(unsigned regionX, unsigned regionY, bool create); // As pinRegion, but once per WriteScope and with beginWrite called.
 		};
 	};
 };
@@ -0,0 +1,347 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef ENGINE_MAP_ZSTD
+#include <zstd.h>
+#endif
+
+#include "mapcodec.h"
+
+namespace Engine {
+	namespace Map {
+		// Parameters for the built-in codec, which produces LZ4 compatible blocks.
+		static const size_t lzMinMatch=4;
+		static const size_t lzLastLiterals=5; // final bytes which are always stored as literals
+		static const size_t lzMatchSafeDistance=12; // no match may start within this many bytes of the end
+		static const size_t lzMaxOffset=65535;
+		static const unsigned lzHashBits=16;
+
+		bool MapCodec::isAvailable(Type type) {
+			switch(type) {
+				case None:
+				case Lz:
+					return true;
+				case Zstd:
+#ifdef ENGINE_MAP_ZSTD
+					return true;
+#else
+					return false;
+#endif
+				case TypeNB:
+				break;
+			}
+
+			return false;
+		}
+
+		const char *MapCodec::typeToString(Type type) {
+			switch(type) {
+				case None: return "none"; break;
+				case Lz: return "lz"; break;
+				case Zstd: return "zstd"; break;
+				case TypeNB: break;
+			}
+
+			return "unknown";
+		}
+
+		bool MapCodec::typeFromString(const char *str, Type *type) {
+			assert(str!=NULL);
+			assert(type!=NULL);
+
+			for(int i=0; i<TypeNB; ++i)
+				if (strcmp(str, typeToString((Type)i))==0) {
+					*type=(Type)i;
+					return true;
+				}
+
+			return false;
+		}
+
+		size_t MapCodec::compressBound(Type type, size_t srcSize) {
+			switch(type) {
+				case None:
+					return srcSize;
+				case Lz:
+					return lzCompressBound(srcSize);
+				case Zstd:
+#ifdef ENGINE_MAP_ZSTD
+					return ZSTD_compressBound(srcSize);
+#else
+					return 0;
+#endif
+				case TypeNB:
+				break;
+			}
+
+			return 0;
+		}
+
+		bool MapCodec::compress(Type type, const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity, size_t *dstSize) {
+			assert(src!=NULL);
+			assert(dst!=NULL);
+			assert(dstSize!=NULL);
+
+			switch(type) {
+				case None:
+					if (srcSize>dstCapacity)
+						return false;
+					memcpy(dst, src, srcSize);
+					*dstSize=srcSize;
+					return true;
+				case Lz:
+					return lzCompress(src, srcSize, dst, dstCapacity, dstSize);
+				case Zstd: {
+#ifdef ENGINE_MAP_ZSTD
+					size_t result=ZSTD_compress(dst, dstCapacity, src, srcSize, 3);
+					if (ZSTD_isError(result))
+						return false;
+					*dstSize=result;
+					return true;
+#else
+					return false;
+#endif
+				} break;
+				case TypeNB:
+				break;
+			}
+
+			return false;
+		}
+
+		bool MapCodec::decompress(Type type, const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize) {
+			assert(src!=NULL);
+			assert(dst!=NULL);
+
+			switch(type) {
+				case None:
+					if (srcSize!=dstSize)
+						return false;
+					memcpy(dst, src, srcSize);
+					return true;
+				case Lz:
+					return lzDecompress(src, srcSize, dst, dstSize);
+				case Zstd: {
+#ifdef ENGINE_MAP_ZSTD
+					size_t result=ZSTD_decompress(dst, dstSize, src, srcSize);
+					return (!ZSTD_isError(result) && result==dstSize);
+#else
+					return false;
+#endif
+				} break;
+				case TypeNB:
+				break;
+			}
+
+			return false;
+		}
+
+		void MapCodec::filterEncode(Filter filter, const uint8_t *src, uint8_t *dst, size_t recordSize, size_t recordCount) {
+			assert(src!=NULL);
+			assert(dst!=NULL);
+			assert(src!=dst);
+			assert(recordSize%8==0);
+
+			switch(filter) {
+				case FilterNone:
+					memcpy(dst, src, recordSize*recordCount);
+				break;
+				case FilterWordDelta: {
+					// Output is laid out as [word][byte][record], so for example all of the high bytes of the height field are together.
+					size_t wordCount=recordSize/8;
+					for(size_t w=0; w<wordCount; ++w) {
+						uint64_t prev=0;
+						for(size_t r=0; r<recordCount; ++r) {
+							uint64_t value;
+							memcpy(&value, src+r*recordSize+w*8, 8);
+							uint64_t delta=value^prev;
+							prev=value;
+
+							for(size_t b=0; b<8; ++b)
+								dst[(w*8+b)*recordCount+r]=(delta>>(8*b)) & 0xFF;
+						}
+					}
+				} break;
+				case FilterNB:
+					assert(false);
+				break;
+			}
+		}
+
+		void MapCodec::filterDecode(Filter filter, const uint8_t *src, uint8_t *dst, size_t recordSize, size_t recordCount) {
+			assert(src!=NULL);
+			assert(dst!=NULL);
+			assert(src!=dst);
+			assert(recordSize%8==0);
+
+			switch(filter) {
+				case FilterNone:
+					memcpy(dst, src, recordSize*recordCount);
+				break;
+				case FilterWordDelta: {
+					size_t wordCount=recordSize/8;
+					for(size_t w=0; w<wordCount; ++w) {
+						uint64_t prev=0;
+						for(size_t r=0; r<recordCount; ++r) {
+							uint64_t delta=0;
+							for(size_t b=0; b<8; ++b)
+								delta|=((uint64_t)src[(w*8+b)*recordCount+r])<<(8*b);
+
+							uint64_t value=delta^prev;
+							prev=value;
+							memcpy(dst+r*recordSize+w*8, &value, 8);
+						}
+					}
+				} break;
+				case FilterNB:
+					assert(false);
+				break;
+			}
+		}
+
+		size_t MapCodec::lzCompressBound(size_t srcSize) {
+			return srcSize+srcSize/255+16;
+		}
+
+		bool MapCodec::lzCompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity, size_t *dstSize) {
+			if (dstCapacity<lzCompressBound(srcSize))
+				return false;
+
+			uint32_t *hashTable=(uint32_t *)malloc(sizeof(uint32_t)<<lzHashBits);
+			if (hashTable==NULL)
+				return false;
+			memset(hashTable, 0xFF, sizeof(uint32_t)<<lzHashBits);
+
+			uint8_t *out=dst;
+			size_t anchor=0; // start of pending literals
+			size_t pos=0;
+			size_t matchLimit=(srcSize>lzMatchSafeDistance ? srcSize-lzMatchSafeDistance : 0);
+
+			while(pos<matchLimit) {
+				// Look for a previous occurrence of the next 4 bytes.
+				uint32_t sequence;
+				memcpy(&sequence, src+pos, 4);
+				uint32_t hash=(sequence*2654435761u)>>(32-lzHashBits);
+				uint32_t candidate=hashTable[hash];
+				hashTable[hash]=pos;
+
+				uint32_t candidateSequence;
+				if (candidate==0xFFFFFFFFu || pos-candidate>lzMaxOffset || (memcpy(&candidateSequence, src+candidate, 4), candidateSequence!=sequence)) {
+					++pos;
+					continue;
+				}
+
+				// Extend match (stopping before the final literals).
+				size_t matchEnd=pos+lzMinMatch;
+				while(matchEnd<srcSize-lzLastLiterals && src[matchEnd]==src[candidate+(matchEnd-pos)])
+					++matchEnd;
+
+				// Write token, literals, offset and match length.
+				size_t literalLength=pos-anchor;
+				size_t matchLength=matchEnd-pos-lzMinMatch;
+				uint8_t *token=out++;
+				*token=((literalLength<15 ? literalLength : 15)<<4)|(matchLength<15 ? matchLength : 15);
+
+				if (literalLength>=15) {
+					size_t remaining=literalLength-15;
+					for(; remaining>=255; remaining-=255)
+						*out++=255;
+					*out++=remaining;
+				}
+				memcpy(out, src+anchor, literalLength);
+				out+=literalLength;
+
+				size_t offset=pos-candidate;
+				*out++=offset & 0xFF;
+				*out++=offset>>8;
+
+				if (matchLength>=15) {
+					size_t remaining=matchLength-15;
+					for(; remaining>=255; remaining-=255)
+						*out++=255;
+					*out++=remaining;
+				}
+
+				pos=matchEnd;
+				anchor=pos;
+			}
+
+			// Write final literals.
+			size_t literalLength=srcSize-anchor;
+			*out++=(literalLength<15 ? literalLength : 15)<<4;
+			if (literalLength>=15) {
+				size_t remaining=literalLength-15;
+				for(; remaining>=255; remaining-=255)
+					*out++=255;
+				*out++=remaining;
+			}
+			memcpy(out, src+anchor, literalLength);
+			out+=literalLength;
+
+			free(hashTable);
+
+			*dstSize=out-dst;
+			return true;
+		}
+
+		bool MapCodec::lzDecompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize) {
+			const uint8_t *in=src, *inEnd=src+srcSize;
+			uint8_t *out=dst, *outEnd=dst+dstSize;
+
+			while(in<inEnd) {
+				uint8_t token=*in++;
+
+				// Copy literals.
+				size_t literalLength=token>>4;
+				if (literalLength==15) {
+					uint8_t extra;
+					do {
+						if (in>=inEnd)
+							return false;
+						extra=*in++;
+						literalLength+=extra;
+					} while(extra==255);
+				}
+				if (literalLength>(size_t)(inEnd-in) || literalLength>(size_t)(outEnd-out))
+					return false;
+				memcpy(out, in, literalLength);
+				in+=literalLength;
+				out+=literalLength;
+
+				// The last sequence has no match.
+				if (in==inEnd)
+					break;
+
+				// Copy match (byte by byte as it may overlap itself, which is how runs are encoded).
+				if (inEnd-in<2)
+					return false;
+				size_t offset=in[0]|(in[1]<<8);
+				in+=2;
+				if (offset==0 || offset>(size_t)(out-dst))
+					return false;
+
+				size_t matchLength=token & 0xF;
+				if (matchLength==15) {
+					uint8_t extra;
+					do {
+						if (in>=inEnd)
+							return false;
+						extra=*in++;
+						matchLength+=extra;
+					} while(extra==255);
+				}
+				matchLength+=lzMinMatch;
+				if (matchLength>(size_t)(outEnd-out))
+					return false;
+
+				const uint8_t *match=out-offset;
+				for(size_t i=0; i<matchLength; ++i)
+					out[i]=match[i];
+				out+=matchLength;
+			}
+
+			return (out==outEnd);
+		}
+	};
+};
@@ -0,0 +1,45 @@
+#ifndef ENGINE_GRAPHICS_MAPCODEC_H
+#define ENGINE_GRAPHICS_MAPCODEC_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Engine {
+	namespace Map {
+		// Block compression used for region files.
+		// Zstd support is only compiled in if ENGINE_MAP_ZSTD is defined (see README).
+		class MapCodec {
+		public:
+			enum Type {
+				None, // data stored as-is (allows region files to be memory mapped)
+				Lz, // built-in LZ4 style codec (fast, modest ratio)
+				Zstd, // requires libzstd (slower, better ratio)
+				TypeNB,
+			};
+
+			enum Filter {
+				FilterNone,
+				FilterWordDelta, // data is treated as an array of fixed size records made of 64 bit words, with each word XORed against the same word in the previous record and then byte-shuffled so similar bytes are adjacent
+				FilterNB,
+			};
+
+			static bool isAvailable(Type type);
+			static const char *typeToString(Type type);
+			static bool typeFromString(const char *str, Type *type); // accepts 'none', 'lz' and 'zstd'
+
+			static size_t compressBound(Type type, size_t srcSize); // worst case compressed size
+			static bool compress(Type type, const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity, size_t *dstSize);
+			static bool decompress(Type type, const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize); // dstSize must be exactly the original size
+
+			static void filterEncode(Filter filter, const uint8_t *src, uint8_t *dst, size_t recordSize, size_t recordCount); // recordSize must be a multiple of 8, src and dst must not overlap
+			static void filterDecode(Filter filter, const uint8_t *src, uint8_t *dst, size_t recordSize, size_t recordCount);
+
+		private:
+			static size_t lzCompressBound(size_t srcSize);
+			static bool lzCompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity, size_t *dstSize);
+			static bool lzDecompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize);
+		};
+	};
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapexistence.h"
+
+namespace Engine {
+	namespace Map {
+		const char MapExistence::fileMagic[4]={'6', '4', 'G', 'E'};
+
+		MapExistence::MapExistence(unsigned regionsSize): regionsSize(regionsSize) {
+			fd=-1;
+			readOnly=false;
+			mapping=NULL;
+			mappingSize=0;
+			bits=NULL;
+		}
+
+		MapExistence::~MapExistence() {
+			close();
+		}
+
+		bool MapExistence::open(const char *path, bool gReadOnly, uint64_t stamp, bool *isValid) {
+			assert(path!=NULL);
+			assert(isValid!=NULL);
+			assert(fd==-1 && mapping==NULL);
+
+			readOnly=gReadOnly;
+			*isValid=false;
+
+			// Open file, creating it if needed.
+			fd=::open(path, (readOnly ? O_RDONLY : O_RDWR|O_CREAT), S_IRUSR|S_IWUSR);
+			if (fd==-1 && !readOnly)
+				return false;
+
+			struct stat bitsStat;
+			if (fd!=-1 && fstat(fd, &bitsStat)!=0) {
+				close();
+				return false;
+			}
+
+			FileHeader header;
+			if (fd!=-1 && bitsStat.st_size>0) {
+				// Read and check header.
+				if (pread(fd, &header, sizeof(header), 0)!=sizeof(header) || memcmp(header.magic, fileMagic, sizeof(fileMagic))!=0 || header.version>fileVersion || header.regionsSize<regionsSize) {
+					fprintf(stderr,"error: '%s' is not a region existence file (or has an unsupported format)\n", path);
+					close();
+					return false;
+				}
+				regionsSize=header.regionsSize;
+				mappingSize=bitsOffset+(size_t)regionsSize*getRowWords()*sizeof(uint64_t);
+				*isValid=(header.stamp!=0 && header.stamp==stamp && (uint64_t)bitsStat.st_size>=mappingSize);
+			} else
+				mappingSize=bitsOffset+(size_t)regionsSize*getRowWords()*sizeof(uint64_t);
+
+			if (!*isValid && !readOnly) {
+				// (Re)create file with an empty bitmap (which is left sparse until bits are set) and no stamp until the caller has filled it in.
+				memset(&header, 0, sizeof(header));
+				memcpy(header.magic, fileMagic, sizeof(fileMagic));
+				header.version=fileVersion;
+				header.regionsSize=regionsSize;
+
+				if (ftruncate(fd, 0)!=0 || ftruncate(fd, mappingSize)!=0 || pwrite(fd, &header, sizeof(header), 0)!=sizeof(header)) {
+					close();
+					return false;
+				}
+			}
+
+			// Map bitmap, privately if read only so that bits can still be set in memory (or anonymously if there is nothing usable to map).
+			if (readOnly && !*isValid) {
+				if (fd!=-1)
+					::close(fd);
+				fd=-1;
+				mapping=mmap(NULL, mappingSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+			} else
+				mapping=mmap(NULL, mappingSize, PROT_READ|PROT_WRITE, (readOnly ? MAP_PRIVATE|MAP_NORESERVE : MAP_SHARED), fd, 0);
+			if (mapping==MAP_FAILED) {
+				mapping=NULL;
+				close();
+				return false;
+			}
+			bits=(uint64_t *)((uint8_t *)mapping+bitsOffset);
+
+			return true;
+		}
+
+		void MapExistence::close(void) {
+			if (mapping!=NULL)
+				munmap(mapping, mappingSize);
+			mapping=NULL;
+			mappingSize=0;
+			bits=NULL;
+
+			if (fd!=-1)
+				::close(fd);
+			fd=-1;
+		}
+
+		bool MapExistence::get(unsigned regionX, unsigned regionY) const {
+			assert(regionX<regionsSize && regionY<regionsSize);
+
+			if (bits==NULL)
+				return true; // no bitmap so assume the region could exist
+
+			const uint64_t *word=&bits[(size_t)regionY*getRowWords()+regionX/64];
+			return (__atomic_load_n(word, __ATOMIC_RELAXED) & (((uint64_t)1)<<(regionX%64)));
+		}
+
+		void MapExistence::set(unsigned regionX, unsigned regionY) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+
+			if (bits==NULL)
+				return;
+
+			// Avoid dirtying the page if the bit is already set (as is the common case).
+			uint64_t *word=&bits[(size_t)regionY*getRowWords()+regionX/64];
+			uint64_t bit=(((uint64_t)1)<<(regionX%64));
+			if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+				__atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+		}
+
+		bool MapExistence::setStamp(uint64_t stamp) {
+			if (fd==-1 || readOnly)
+				return true;
+
+			// The bitmap must reach the disk before the stamp claiming it is up to date.
+			if (msync(mapping, mappingSize, MS_SYNC)!=0)
+				return false;
+
+			((FileHeader *)mapping)->stamp=stamp;
+			return (msync(mapping, bitsOffset, MS_SYNC)==0);
+		}
+
+		size_t MapExistence::getRowWords(void) const {
+			return (regionsSize+63)/64;
+		}
+	};
+};
@@ -0,0 +1,54 @@
+#ifndef ENGINE_GRAPHICS_MAPEXISTENCE_H
+#define ENGINE_GRAPHICS_MAPEXISTENCE_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Engine {
+	namespace Map {
+		// Bitmap of which regions exist, so that looking up a region which has never been created (e.g. when drawing parts of the map which have not been generated) is a single bit test rather than a failed attempt to open its file.
+		// The bitmap is kept in a file alongside the regions and memory mapped, so that only the parts covering regions actually in use take any memory.
+		// The file also holds a stamp describing the region files as they were when the bitmap was last known to match them (see Map::regionsExistenceGetStamp). If this no longer matches when opened (e.g. after a crash, or the map being modified by an older version) then the bitmap has to be rebuilt.
+		// Note: a set bit does not guarantee that the region can be loaded (e.g. it may have been created but never saved), only that it has to be looked for.
+		class MapExistence {
+		public:
+			MapExistence(unsigned regionsSize); // regionsSize is the number of regions per side which the bitmap needs to cover
+			~MapExistence();
+
+			// Maps the bitmap file, creating it if needed. If readOnly is true then the file is never written to, with a missing file treated as empty and any changes only kept in memory.
+			// isValid is set to false if the bitmap cannot be trusted (the file is new or its stamp does not match the one given), in which case the bitmap is left clear for the caller to fill in.
+			bool open(const char *path, bool readOnly, uint64_t stamp, bool *isValid);
+			void close(void);
+
+			bool get(unsigned regionX, unsigned regionY) const;
+			void set(unsigned regionX, unsigned regionY);
+
+			bool setStamp(uint64_t stamp); // Flushes the bitmap to disk and then records the stamp it now matches (does nothing if read only).
+		private:
+			struct FileHeader {
+				char magic[4]; // see fileMagic
+				uint32_t version;
+				uint32_t regionsSize;
+				uint32_t padding;
+				uint64_t stamp; // 0 if the bitmap has never matched the regions
+			};
+
+			static const char fileMagic[4];
+			static const uint32_t fileVersion=1;
+			static const size_t bitsOffset=4096; // bitmap follows header on the next page
+
+			unsigned regionsSize; // bitmap stride, from the file header once open (and so possibly larger than requested)
+
+			int fd;
+			bool readOnly;
+
+			void *mapping;
+			size_t mappingSize;
+			uint64_t *bits; // rows of getRowWords words, within mapping
+
+			size_t getRowWords(void) const;
+		};
+	};
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "mapio.h"
+
+namespace Engine {
+	namespace Map {
+		MapIO::MapIO(unsigned queueDepth, bool useUring) {
+			assert(queueDepth>0);
+
+			ringFd=-1;
+			if (useUring)
+				uringInit(queueDepth);
+
+			threadCount=queueDepth;
+			if (threadCount>threadsMax)
+				threadCount=threadsMax;
+			threadsStarted=false;
+			threadsStop=false;
+			threadsReads=NULL;
+			threadsReadsCount=threadsReadsNext=threadsReadsDone=0;
+		}
+
+		MapIO::~MapIO() {
+			// Stop threads.
+			std::unique_lock<std::mutex> threadsLockGuard(threadsLock);
+			if (threadsStarted) {
+				threadsStop=true;
+				threadsLockGuard.unlock();
+				threadsCond.notify_all();
+
+				for(unsigned i=0; i<threadCount; ++i) {
+					threads[i]->join();
+					delete threads[i];
+				}
+			} else
+				threadsLockGuard.unlock();
+
+			uringDeinit();
+		}
+
+		void MapIO::read(Read *reads, size_t count) {
+			assert(reads!=NULL || count==0);
+
+			std::lock_guard<std::mutex> readLock(lock);
+
+			if (ringFd!=-1)
+				uringRead(reads, count);
+			else
+				threadsRead(reads, count);
+		}
+
+		bool MapIO::getIsUring(void) const {
+			return (ringFd!=-1);
+		}
+
+		bool MapIO::uringInit(unsigned queueDepth) {
+#ifdef __NR_io_uring_setup
+			// Create ring.
+			// Note: this fails if the kernel is too old or io_uring is disabled (e.g. by a seccomp filter), in which case the thread pool is used instead.
+			struct io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			int fd=syscall(__NR_io_uring_setup, queueDepth, &params);
+			if (fd<0)
+				return false;
+
+			// Map submission and completion rings (which may share a single mapping) and the submission entries.
+			sqRingSize=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+			cqRingSize=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+			bool singleMap=(params.features & IORING_FEAT_SINGLE_MMAP);
+			if (singleMap)
+				sqRingSize=cqRingSize=std::max(sqRingSize, cqRingSize);
+
+			sqRing=mmap(NULL, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			cqRing=(singleMap ? sqRing : mmap(NULL, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING));
+			sqes=mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (sqRing==MAP_FAILED || cqRing==MAP_FAILED || sqes==MAP_FAILED) {
+				if (sqRing!=MAP_FAILED)
+					munmap(sqRing, sqRingSize);
+				if (cqRing!=MAP_FAILED && !singleMap)
+					munmap(cqRing, cqRingSize);
+				if (sqes!=MAP_FAILED)
+					munmap(sqes, params.sq_entries*sizeof(struct io_uring_sqe));
+				close(fd);
+				return false;
+			}
+
+			ringFd=fd;
+			ringEntries=params.sq_entries;
+			sqHead=(unsigned *)((uint8_t *)sqRing+params.sq_off.head);
+			sqTail=(unsigned *)((uint8_t *)sqRing+params.sq_off.tail);
+			sqMask=*(unsigned *)((uint8_t *)sqRing+params.sq_off.ring_mask);
+			sqArray=(unsigned *)((uint8_t *)sqRing+params.sq_off.array);
+			cqHead=(unsigned *)((uint8_t *)cqRing+params.cq_off.head);
+			cqTail=(unsigned *)((uint8_t *)cqRing+params.cq_off.tail);
+			cqMask=*(unsigned *)((uint8_t *)cqRing+params.cq_off.ring_mask);
+			cqes=(uint8_t *)cqRing+params.cq_off.cqes;
+
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		void MapIO::uringDeinit(void) {
+			if (ringFd==-1)
+				return;
+
+			munmap(sqes, ringEntries*sizeof(struct io_uring_sqe));
+			if (cqRing!=sqRing)
+				munmap(cqRing, cqRingSize);
+			munmap(sqRing, sqRingSize);
+			close(ringFd);
+			ringFd=-1;
+		}
+
+		void MapIO::uringRead(Read *reads, size_t count) {
+			// Bytes read so far for each read, as the kernel may complete a read in several parts.
+			std::vector<size_t> done(count, 0);
+			std::vector<size_t> resubmit; // reads which were only partly completed (or interrupted)
+			for(size_t i=0; i<count; ++i)
+				reads[i].result=false;
+
+			size_t next=0;
+			unsigned inFlight=0; // submitted to the kernel but not yet completed
+			unsigned queued=0; // added to the submission ring but not yet taken by the kernel
+			while(next<count || !resubmit.empty() || inFlight>0 || queued>0) {
+				// Fill the submission ring, keeping the number in flight within the ring's size (the completion ring is at least as large, so can never overflow).
+				unsigned tail=*sqTail; // only we write this
+				while(inFlight+queued<ringEntries && (next<count || !resubmit.empty())) {
+					size_t i;
+					if (!resubmit.empty()) {
+						i=resubmit.back();
+						resubmit.pop_back();
+					} else {
+						i=next++;
+						if (reads[i].size==0) {
+							reads[i].result=true;
+							continue;
+						}
+					}
+
+					struct io_uring_sqe *sqe=&((struct io_uring_sqe *)sqes)[tail & sqMask];
+					memset(sqe, 0, sizeof(*sqe));
+					sqe->opcode=IORING_OP_READ;
+					sqe->fd=reads[i].fd;
+					sqe->off=reads[i].offset+done[i];
+					sqe->addr=(uint64_t)(uintptr_t)((uint8_t *)reads[i].data+done[i]);
+					sqe->len=(uint32_t)std::min(reads[i].size-done[i], (size_t)1<<30);
+					sqe->user_data=i;
+					sqArray[tail & sqMask]=(tail & sqMask);
+
+					++tail;
+					++queued;
+				}
+				__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+				if (inFlight+queued==0)
+					continue; // nothing left but zero length reads
+
+				// Submit, waiting for at least one read to complete.
+				int submitted=syscall(__NR_io_uring_enter, ringFd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				if (submitted<0) {
+					if (errno==EINTR || errno==EAGAIN || errno==EBUSY)
+						continue;
+
+					// Give up on the ring altogether, finishing this batch (and all later ones) via pread instead.
+					// Note: closing the ring cancels anything still in flight.
+					fprintf(stderr,"warning: io_uring failed (%s), falling back on threads\n", strerror(errno));
+					uringDeinit();
+					for(size_t i=0; i<count; ++i)
+						if (!reads[i].result)
+							reads[i].result=readSync(&reads[i], 0);
+					return;
+				}
+				queued-=submitted;
+				inFlight+=submitted;
+
+				// Collect completions.
+				unsigned head=*cqHead; // only we write this
+				unsigned cqTailNow=__atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+				for(; head!=cqTailNow; ++head) {
+					const struct io_uring_cqe *cqe=&((const struct io_uring_cqe *)cqes)[head & cqMask];
+					size_t i=cqe->user_data;
+					int res=cqe->res;
+					--inFlight;
+
+					if (res>0) {
+						done[i]+=res;
+						if (done[i]<reads[i].size)
+							resubmit.push_back(i);
+						else
+							reads[i].result=true;
+					} else if (res==-EINTR || res==-EAGAIN)
+						resubmit.push_back(i);
+					else
+						// End of file or an error (including kernels which lack IORING_OP_READ), so let pread decide.
+						reads[i].result=readSync(&reads[i], done[i]);
+				}
+				__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+			}
+		}
+
+		void MapIO::threadsRead(Read *reads, size_t count) {
+			std::unique_lock<std::mutex> threadsLockGuard(threadsLock);
+
+			// Start threads if this is the first batch.
+			if (!threadsStarted) {
+				for(unsigned i=0; i<threadCount; ++i)
+					threads[i]=new std::thread(&MapIO::threadFunctor, this);
+				threadsStarted=true;
+			}
+
+			// Hand batch to threads and wait for them to finish it.
+			threadsReads=reads;
+			threadsReadsCount=count;
+			threadsReadsNext=0;
+			threadsReadsDone=0;
+			threadsCond.notify_all();
+
+			threadsDoneCond.wait(threadsLockGuard, [this]{ return threadsReadsDone==threadsReadsCount; });
+			threadsReads=NULL;
+		}
+
+		void MapIO::threadFunctor(void) {
+			std::unique_lock<std::mutex> threadsLockGuard(threadsLock);
+			while(1) {
+				// Wait for a read.
+				threadsCond.wait(threadsLockGuard, [this]{ return threadsStop || (threadsReads!=NULL && threadsReadsNext<threadsReadsCount); });
+				if (threadsStop)
+					break;
+
+				Read *read=&threadsReads[threadsReadsNext++];
+				threadsLockGuard.unlock();
+
+				read->result=readSync(read, 0);
+
+				threadsLockGuard.lock();
+				if (++threadsReadsDone==threadsReadsCount)
+					threadsDoneCond.notify_one();
+			}
+		}
+
+		bool MapIO::readSync(Read *read, size_t done) {
+			assert(read!=NULL);
+
+			while(done<read->size) {
+				ssize_t result=pread(read->fd, (uint8_t *)read->data+done, read->size-done, read->offset+done);
+				if (result<0 && errno==EINTR)
+					continue;
+				if (result<=0)
+					return false;
+				done+=result;
+			}
+
+			return true;
+		}
+	};
+};
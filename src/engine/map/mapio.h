@@ -0,0 +1,69 @@
+#ifndef ENGINE_GRAPHICS_MAPIO_H
+#define ENGINE_GRAPHICS_MAPIO_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace Engine {
+	namespace Map {
+		// Performs many reads at once (e.g. every region file in a prefetch batch), so that the device sees them all together rather than one blocking read at a time.
+		// Uses io_uring where the kernel allows it, otherwise falls back on a small pool of threads each issuing pread calls.
+		class MapIO {
+		public:
+			struct Read {
+				int fd;
+				uint64_t offset;
+				void *data;
+				size_t size;
+				bool result; // set by read, true if all size bytes were read
+			};
+
+			MapIO(unsigned queueDepth, bool useUring); // queueDepth is the most reads in flight at once. If useUring is false then the thread pool is always used.
+			~MapIO();
+
+			void read(Read *reads, size_t count); // Returns once every read has completed (successfully or not). Safe to call from any thread, although calls are serviced one at a time.
+
+			bool getIsUring(void) const; // True if reads go via io_uring rather than the thread pool.
+		private:
+			static const unsigned threadsMax=16;
+
+			std::mutex lock; // held for the duration of each call to read
+
+			// io_uring state (ringFd is -1 if not in use).
+			int ringFd;
+			unsigned ringEntries;
+			void *sqRing, *cqRing;
+			size_t sqRingSize, cqRingSize;
+			void *sqes;
+			unsigned *sqHead, *sqTail, *cqHead, *cqTail; // shared with the kernel, so accessed via __atomic builtins
+			unsigned sqMask, cqMask;
+			unsigned *sqArray;
+			void *cqes;
+
+			// Thread pool state (threads are started on first use).
+			unsigned threadCount;
+			std::thread *threads[threadsMax];
+			bool threadsStarted;
+			bool threadsStop;
+			std::condition_variable threadsCond, threadsDoneCond;
+			std::mutex threadsLock; // protects the below
+			Read *threadsReads; // current batch, or NULL
+			size_t threadsReadsCount;
+			size_t threadsReadsNext; // index of next read to be taken by a thread
+			size_t threadsReadsDone;
+
+			bool uringInit(unsigned queueDepth);
+			void uringDeinit(void);
+			void uringRead(Read *reads, size_t count);
+			void threadsRead(Read *reads, size_t count);
+			void threadFunctor(void);
+
+			static bool readSync(Read *read, size_t done); // Reads whatever remains (after the first done bytes) using pread.
+		};
+	};
+};
+
+#endif
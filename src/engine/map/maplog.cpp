@@ -0,0 +1,325 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "maplog.h"
+
+namespace Engine {
+	namespace Map {
+		const char MapLog::fileMagic[4]={'6', '4', 'G', 'L'};
+
+		MapLog::MapLog() {
+			path=NULL;
+			fd=-1;
+			readOnly=false;
+			fileEnd=0;
+			syncedEnd=0;
+		}
+
+		MapLog::~MapLog() {
+			close();
+		}
+
+		bool MapLog::open(const char *gPath, bool gReadOnly) {
+			assert(gPath!=NULL);
+			assert(fd==-1);
+
+			readOnly=gReadOnly;
+			path=strdup(gPath);
+			if (path==NULL)
+				return false;
+
+			// Open file, creating it if needed.
+			fd=::open(path, (readOnly ? O_RDONLY : O_RDWR|O_CREAT), S_IRUSR|S_IWUSR);
+			if (fd==-1) {
+				if (readOnly)
+					return true; // read only maps may simply not have a log
+				close();
+				return false;
+			}
+
+			struct stat logStat;
+			if (fstat(fd, &logStat)!=0) {
+				close();
+				return false;
+			}
+
+			std::lock_guard<std::mutex> guard(lock);
+			if (logStat.st_size==0) {
+				if (readOnly) {
+					close();
+					return true;
+				}
+
+				// Write new header.
+				FileHeader header;
+				memcpy(header.magic, fileMagic, sizeof(fileMagic));
+				header.version=fileVersion;
+				if (pwrite(fd, &header, sizeof(header), 0)!=sizeof(header)) {
+					close();
+					return false;
+				}
+				fileEnd=sizeof(header);
+			} else {
+				// Read and check header.
+				FileHeader header;
+				if (pread(fd, &header, sizeof(header), 0)!=sizeof(header) || memcmp(header.magic, fileMagic, sizeof(fileMagic))!=0 || header.version>fileVersion) {
+					fprintf(stderr,"error: '%s' is not a region log file (or has an unsupported format)\n", path);
+					close();
+					return false;
+				}
+
+				// Index records.
+				if (!scan()) {
+					fprintf(stderr,"error: could not read region log file '%s'\n", path);
+					close();
+					return false;
+				}
+			}
+			syncedEnd=fileEnd;
+
+			return true;
+		}
+
+		void MapLog::close(void) {
+			if (fd!=-1)
+				::close(fd);
+			fd=-1;
+			free(path);
+			path=NULL;
+			index.clear();
+			fileEnd=syncedEnd=0;
+		}
+
+		bool MapLog::getIsReadOnly(void) const {
+			return readOnly;
+		}
+
+		uint64_t MapLog::getSize(void) const {
+			std::lock_guard<std::mutex> guard(lock);
+			return fileEnd;
+		}
+
+		bool MapLog::getHasRecords(unsigned regionX, unsigned regionY) const {
+			std::lock_guard<std::mutex> guard(lock);
+			return (index.find(getKey(regionX, regionY))!=index.end());
+		}
+
+		void MapLog::getRegions(std::vector<std::pair<unsigned, unsigned> > *regions) const {
+			assert(regions!=NULL);
+
+			std::lock_guard<std::mutex> guard(lock);
+			regions->clear();
+			regions->reserve(index.size());
+			for(auto const &entry: index)
+				regions->push_back(std::make_pair((unsigned)(entry.first & 0xFFFFFFFFu), (unsigned)(entry.first>>32)));
+		}
+
+		bool MapLog::append(unsigned regionX, unsigned regionY, RecordType type, const uint8_t *data, size_t size) {
+			assert(data!=NULL || size==0);
+
+			if (fd==-1 || readOnly || size>recordSizeMax)
+				return false;
+
+			RecordHeader header;
+			header.regionX=regionX;
+			header.regionY=regionY;
+			header.type=type;
+			header.size=size;
+			header.checksum=0;
+			header.padding=0;
+			header.checksum=getChecksum(&header, data);
+
+			struct iovec iov[2];
+			iov[0].iov_base=&header;
+			iov[0].iov_len=sizeof(header);
+			iov[1].iov_base=const_cast<uint8_t *>(data);
+			iov[1].iov_len=size;
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			// Write record in one go after the last.
+			// Note: if this fails part way then the file is cut back, as otherwise the garbage left behind would hide any later records when next opened.
+			if (pwritev(fd, iov, 2, fileEnd)!=(ssize_t)(sizeof(header)+size)) {
+				if (ftruncate(fd, fileEnd)!=0)
+					fprintf(stderr,"error: could not truncate region log file '%s' after failed write\n", path);
+				return false;
+			}
+
+			indexRecord(header, fileEnd);
+			fileEnd+=sizeof(header)+size;
+
+			return true;
+		}
+
+		bool MapLog::getRecords(unsigned regionX, unsigned regionY, std::vector<Record> *records) const {
+			assert(records!=NULL);
+
+			records->clear();
+
+			std::lock_guard<std::mutex> guard(lock);
+			auto iter=index.find(getKey(regionX, regionY));
+			if (iter==index.end())
+				return true;
+
+			records->resize(iter->second.size());
+			for(size_t i=0; i<iter->second.size(); ++i) {
+				RecordHeader header;
+				if (!readRecord(fd, iter->second[i], &header, &(*records)[i].data)) {
+					fprintf(stderr,"error: could not read record for region %u,%u from region log file '%s'\n", regionX, regionY, path);
+					records->clear();
+					return false;
+				}
+				(*records)[i].type=(RecordType)header.type;
+			}
+
+			return true;
+		}
+
+		bool MapLog::sync(void) {
+			std::lock_guard<std::mutex> syncGuard(syncLock);
+
+			// Grab the current end, so that we cover every record appended so far (while any appended meanwhile are left for the next call).
+			std::unique_lock<std::mutex> guard(lock);
+			uint64_t end=fileEnd;
+			guard.unlock();
+
+			if (fd==-1 || readOnly || syncedEnd>=end)
+				return true;
+
+			if (fdatasync(fd)!=0)
+				return false;
+			syncedEnd=end;
+
+			return true;
+		}
+
+		bool MapLog::rewrite(void) {
+			if (fd==-1 || readOnly)
+				return false;
+
+			std::lock_guard<std::mutex> syncGuard(syncLock);
+			std::lock_guard<std::mutex> guard(lock);
+
+			// Copy each region's current records into a new file.
+			char tempPath[4096];
+			int tempPathLen=snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+			if (tempPathLen<0 || (size_t)tempPathLen>=sizeof(tempPath)) {
+				fprintf(stderr,"error: region log path '%s' is too long\n", path);
+				return false;
+			}
+			int tempFd=::open(tempPath, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+			if (tempFd==-1)
+				return false;
+
+			FileHeader fileHeader;
+			memcpy(fileHeader.magic, fileMagic, sizeof(fileMagic));
+			fileHeader.version=fileVersion;
+			bool result=(pwrite(tempFd, &fileHeader, sizeof(fileHeader), 0)==sizeof(fileHeader));
+
+			uint64_t tempEnd=sizeof(fileHeader);
+			std::unordered_map<uint64_t, std::vector<uint64_t> > tempIndex;
+			std::vector<uint8_t> data;
+			for(auto iter=index.begin(); result && iter!=index.end(); ++iter) {
+				std::vector<uint64_t> *offsets=&tempIndex[iter->first];
+				for(uint64_t offset: iter->second) {
+					RecordHeader header;
+					if (!readRecord(fd, offset, &header, &data) || pwrite(tempFd, &header, sizeof(header), tempEnd)!=sizeof(header) || pwrite(tempFd, data.data(), data.size(), tempEnd+sizeof(header))!=(ssize_t)data.size()) {
+						result=false;
+						break;
+					}
+					offsets->push_back(tempEnd);
+					tempEnd+=sizeof(header)+data.size();
+				}
+			}
+
+			// Replace the old file once the new one is safely on disk.
+			result&=(result && fdatasync(tempFd)==0);
+			result&=(result && rename(tempPath, path)==0);
+			if (!result) {
+				::close(tempFd);
+				unlink(tempPath);
+				return false;
+			}
+
+			::close(fd);
+			fd=tempFd;
+			fileEnd=syncedEnd=tempEnd;
+			index.swap(tempIndex);
+
+			return true;
+		}
+
+		bool MapLog::scan(void) {
+			// Read each record in turn until the end of the file, or a record which was not completely written.
+			uint64_t offset=sizeof(FileHeader);
+			RecordHeader header;
+			std::vector<uint8_t> data;
+			while(readRecord(fd, offset, &header, &data)) {
+				indexRecord(header, offset);
+				offset+=sizeof(header)+header.size;
+			}
+			fileEnd=offset;
+
+			// Drop anything left after the last complete record, so that new records follow straight on.
+			struct stat logStat;
+			if (fstat(fd, &logStat)!=0)
+				return false;
+			if ((uint64_t)logStat.st_size>fileEnd) {
+				fprintf(stderr,"warning: dropping %llu bytes of partly written records from end of region log file '%s'\n", (unsigned long long)(logStat.st_size-fileEnd), path);
+				if (!readOnly && ftruncate(fd, fileEnd)!=0)
+					return false;
+			}
+
+			return true;
+		}
+
+		bool MapLog::readRecord(int fromFd, uint64_t offset, RecordHeader *header, std::vector<uint8_t> *data) const {
+			assert(header!=NULL);
+			assert(data!=NULL);
+
+			if (pread(fromFd, header, sizeof(*header), offset)!=sizeof(*header) || header->size>recordSizeMax)
+				return false;
+
+			data->resize(header->size);
+			if (header->size>0 && pread(fromFd, data->data(), header->size, offset+sizeof(*header))!=(ssize_t)header->size)
+				return false;
+
+			RecordHeader checkHeader=*header;
+			checkHeader.checksum=0;
+			return (getChecksum(&checkHeader, data->data())==header->checksum);
+		}
+
+		void MapLog::indexRecord(const RecordHeader &header, uint64_t offset) {
+			uint64_t key=getKey(header.regionX, header.regionY);
+			if (header.type==RecordBase)
+				index.erase(key);
+			else
+				index[key].push_back(offset);
+		}
+
+		uint64_t MapLog::getKey(unsigned regionX, unsigned regionY) {
+			return (((uint64_t)regionY)<<32)|regionX;
+		}
+
+		uint32_t MapLog::getChecksum(const RecordHeader *header, const uint8_t *data) {
+			assert(header!=NULL);
+			assert(data!=NULL || header->size==0);
+
+			// FNV-1a over the header and then the data.
+			uint32_t hash=2166136261u;
+			const uint8_t *bytes=(const uint8_t *)header;
+			for(size_t i=0; i<sizeof(*header); ++i)
+				hash=(hash^bytes[i])*16777619u;
+			for(size_t i=0; i<header->size; ++i)
+				hash=(hash^data[i])*16777619u;
+
+			return hash;
+		}
+	};
+};
@@ -0,0 +1,85 @@
+#ifndef ENGINE_GRAPHICS_MAPLOG_H
+#define ENGINE_GRAPHICS_MAPLOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Engine {
+	namespace Map {
+		// Append-only log of small region modifications (a few tiles, or objects moving about), so that saving them costs a small append rather than rewriting the whole region file.
+		// A region is read as its file (the base) with each of its records then applied in order. Once the region's file is next written in full a base record is appended, after which the earlier records are ignored.
+		// Such records are only actually removed when the log is rewritten (see rewrite), which Map does in the background once the log grows large (see Map::Options::regionLog).
+		class MapLog {
+		public:
+			enum RecordType {
+				RecordTiles=1, // data for some of the region's tiles (the layout is up to MapRegion)
+				RecordObjects=2, // every object within the region, replacing those before
+				RecordBase=3, // the region's file has been written in full (no data)
+			};
+
+			struct Record {
+				RecordType type;
+				std::vector<uint8_t> data;
+			};
+
+			MapLog();
+			~MapLog();
+
+			bool open(const char *path, bool readOnly); // Opens the log file, creating it if needed (unless readOnly is true, in which case a missing file simply has no records). A partly written record at the end (e.g. following a crash) is dropped.
+			void close(void);
+
+			bool getIsReadOnly(void) const;
+			uint64_t getSize(void) const; // Size of the log file, including records which are now ignored.
+			bool getHasRecords(unsigned regionX, unsigned regionY) const; // True if the region has records since its last base record.
+			void getRegions(std::vector<std::pair<unsigned, unsigned> > *regions) const; // Lists (x,y) of each region which has records.
+
+			// Appends a record, which is only certain to survive a crash once sync has returned.
+			// Base records drop all earlier records for the region from getRecords (but are not themselves returned).
+			bool append(unsigned regionX, unsigned regionY, RecordType type, const uint8_t *data, size_t size);
+			bool getRecords(unsigned regionX, unsigned regionY, std::vector<Record> *records) const; // Reads each of the region's records since its last base record, in order.
+			bool sync(void); // Waits for every record appended so far to reach the disk, with concurrent callers sharing a single flush.
+			bool rewrite(void); // Replaces the log with a new file holding just the records returned by getRecords (for all regions).
+		private:
+			struct FileHeader {
+				char magic[4]; // see fileMagic
+				uint32_t version;
+			};
+
+			struct RecordHeader {
+				uint32_t regionX, regionY;
+				uint32_t type; // RecordType
+				uint32_t size; // of the data which follows
+				uint32_t checksum; // of the header (with this field zero) and data, so that a partly written record can be detected
+				uint32_t padding;
+			};
+
+			static const char fileMagic[4];
+			static const uint32_t fileVersion=1;
+			static const uint32_t recordSizeMax=(1u<<30);
+
+			char *path;
+			int fd;
+			bool readOnly;
+
+			mutable std::mutex lock; // protects the below, and is held for all use of fd other than by sync
+			uint64_t fileEnd;
+			std::unordered_map<uint64_t, std::vector<uint64_t> > index; // offsets of each region's records since its last base record (see getKey)
+
+			std::mutex syncLock; // held while flushing (or rewriting), taken before lock if both are needed
+			uint64_t syncedEnd; // everything before this has been flushed
+
+			bool scan(void); // Fills index from the file, dropping any partly written record at the end. Requires lock is held.
+			bool readRecord(int fromFd, uint64_t offset, RecordHeader *header, std::vector<uint8_t> *data) const; // Returns false if the record is incomplete or corrupt.
+			void indexRecord(const RecordHeader &header, uint64_t offset); // Requires lock is held.
+
+			static uint64_t getKey(unsigned regionX, unsigned regionY);
+			static uint32_t getChecksum(const RecordHeader *header, const uint8_t *data);
+		};
+	};
+};
+
+#endif
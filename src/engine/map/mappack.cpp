@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "mappack.h"
+
+namespace Engine {
+	namespace Map {
+		const char MapPack::fileMagic[4]={'6', '4', 'G', 'P'};
+
+		MapPack::MapPack(unsigned regionsSize): regionsSize(regionsSize) {
+			indexBlocksSize=0;
+			fd=-1;
+			readOnly=false;
+			directory=NULL;
+			directorySize=0;
+			indexBlocks=NULL;
+			freeExtentsValid=false;
+			fileEnd=0;
+		}
+
+		MapPack::~MapPack() {
+			close();
+		}
+
+		bool MapPack::open(const char *path, bool create, bool gReadOnly) {
+			assert(path!=NULL);
+			assert(fd==-1);
+			assert(!(create && gReadOnly));
+
+			readOnly=gReadOnly;
+
+			// Open file, creating it if needed.
+			fd=::open(path, (readOnly ? O_RDONLY : O_RDWR)|(create ? O_CREAT : 0), S_IRUSR|S_IWUSR);
+			if (fd==-1) {
+				close();
+				return false;
+			}
+
+			struct stat packStat;
+			if (fstat(fd, &packStat)!=0) {
+				close();
+				return false;
+			}
+
+			if (packStat.st_size==0) {
+				if (!create) {
+					close();
+					return false;
+				}
+
+				// Write new header, with the directory left empty (as a hole in the file until index blocks are added).
+				indexBlocksSize=(regionsSize+indexBlockSize-1)/indexBlockSize;
+				directorySize=getIndexBlockCount()*sizeof(uint64_t);
+				memcpy(header.magic, fileMagic, sizeof(fileMagic));
+				header.version=fileVersion;
+				header.regionsSize=regionsSize;
+				header.flags=0;
+				header.indexOffset=extentAlign;
+				header.dataOffset=((header.indexOffset+directorySize+extentAlign-1)/extentAlign)*extentAlign;
+
+				if (ftruncate(fd, header.dataOffset)!=0 || pwrite(fd, &header, sizeof(header), 0)!=sizeof(header)) {
+					close();
+					return false;
+				}
+			} else {
+				// Read and check header.
+				if (pread(fd, &header, sizeof(header), 0)!=sizeof(header) || memcmp(header.magic, fileMagic, sizeof(fileMagic))!=0) {
+					fprintf(stderr,"error: '%s' is not a region pack file\n", path);
+					close();
+					return false;
+				}
+
+				if (header.version>fileVersion || header.regionsSize<regionsSize) {
+					fprintf(stderr,"error: region pack file '%s' has unsupported format (version %u, %u regions per side)\n", path, header.version, header.regionsSize);
+					close();
+					return false;
+				}
+				regionsSize=header.regionsSize;
+				indexBlocksSize=(regionsSize+indexBlockSize-1)/indexBlockSize;
+
+				if (header.version>=2) {
+					directorySize=getIndexBlockCount()*sizeof(uint64_t);
+					if ((uint64_t)packStat.st_size<header.indexOffset+directorySize) {
+						fprintf(stderr,"error: region pack file '%s' is truncated\n", path);
+						close();
+						return false;
+					}
+				}
+			}
+
+			indexBlocks=(IndexBlock **)calloc(getIndexBlockCount(), sizeof(IndexBlock *));
+			if (indexBlocks==NULL) {
+				close();
+				return false;
+			}
+
+			if (header.version>=2) {
+				// Map directory (which is only written via pwrite, so that it is always consistent with the blocks it points to).
+				void *mapping=mmap(NULL, directorySize, PROT_READ, MAP_SHARED, fd, header.indexOffset);
+				if (mapping==MAP_FAILED) {
+					close();
+					return false;
+				}
+				directory=(const uint64_t *)mapping;
+			} else {
+				// Version 1 files have a single dense index, which is split into blocks as it is read.
+				const size_t indexCount=(size_t)regionsSize*regionsSize;
+				Extent *index=(Extent *)malloc(indexCount*sizeof(Extent));
+				if (index==NULL || pread(fd, index, indexCount*sizeof(Extent), header.indexOffset)!=(ssize_t)(indexCount*sizeof(Extent))) {
+					fprintf(stderr,"error: could not read region pack file '%s' index\n", path);
+					free(index);
+					close();
+					return false;
+				}
+
+				for(size_t i=0; i<indexCount; ++i) {
+					if (index[i].offset==0)
+						continue;
+					Extent *entry=getIndexEntry(i%regionsSize, i/regionsSize, true);
+					if (entry==NULL) {
+						free(index);
+						close();
+						return false;
+					}
+					*entry=index[i];
+				}
+				free(index);
+			}
+
+			return true;
+		}
+
+		void MapPack::close(void) {
+			if (fd!=-1)
+				::close(fd);
+			fd=-1;
+
+			if (directory!=NULL)
+				munmap((void *)directory, directorySize);
+			directory=NULL;
+			directorySize=0;
+
+			if (indexBlocks!=NULL)
+				for(size_t i=0; i<getIndexBlockCount(); ++i)
+					delete indexBlocks[i];
+			free(indexBlocks);
+			indexBlocks=NULL;
+
+			freeExtents.clear();
+			freeExtentsValid=false;
+			fileEnd=0;
+		}
+
+		int MapPack::getFd(void) const {
+			return fd;
+		}
+
+		bool MapPack::getExtent(unsigned regionX, unsigned regionY, Extent *extent) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+			assert(extent!=NULL);
+
+			std::lock_guard<std::mutex> guard(lock);
+			const Extent *entry=getIndexEntry(regionX, regionY, false);
+			*extent=(entry!=NULL ? *entry : Extent());
+
+			return (extent->offset!=0);
+		}
+
+		void MapPack::getRegions(std::vector<std::pair<unsigned, unsigned> > *regions) {
+			assert(regions!=NULL);
+
+			std::lock_guard<std::mutex> guard(lock);
+			regions->clear();
+			for(size_t i=0; i<getIndexBlockCount(); ++i) {
+				const IndexBlock *block=getIndexBlock(i);
+				if (block==NULL)
+					continue;
+
+				unsigned blockX=(i%indexBlocksSize)*indexBlockSize;
+				unsigned blockY=(i/indexBlocksSize)*indexBlockSize;
+				for(unsigned j=0; j<indexBlockSize*indexBlockSize; ++j)
+					if (block->entries[j].offset!=0)
+						regions->push_back(std::make_pair(blockX+j%indexBlockSize, blockY+j/indexBlockSize));
+			}
+		}
+
+		bool MapPack::getIsComplete(void) const {
+			return (header.flags & FlagComplete);
+		}
+
+		bool MapPack::getIsReadOnly(void) const {
+			return readOnly;
+		}
+
+		bool MapPack::setIsComplete(bool isComplete) {
+			assert(!readOnly);
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (isComplete)
+				header.flags|=FlagComplete;
+			else
+				header.flags&=~FlagComplete;
+
+			return (pwrite(fd, &header, sizeof(header), 0)==sizeof(header));
+		}
+
+		bool MapPack::write(unsigned regionX, unsigned regionY, const uint8_t *data, size_t size, Extent *newExtent, Extent *oldExtent) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+			assert(data!=NULL);
+			assert(newExtent!=NULL);
+			assert(oldExtent!=NULL);
+			assert(!readOnly);
+
+			// Allocate extent.
+			Extent extent;
+			extent.size=size;
+			extent.capacity=((size+extentAlign-1)/extentAlign)*extentAlign;
+
+			lock.lock();
+			if (!freeExtentsValid && !loadFreeExtents()) {
+				lock.unlock();
+				return false;
+			}
+			extent.offset=allocateExtent(extent.capacity);
+			lock.unlock();
+
+			// Write data.
+			// Note: the lock is not needed here as nothing else refers to the new extent yet.
+			if (pwrite(fd, data, size, extent.offset)!=(ssize_t)size) {
+				std::lock_guard<std::mutex> guard(lock);
+				freeExtent(extent.offset, extent.capacity);
+				return false;
+			}
+
+			// Update index.
+			std::lock_guard<std::mutex> guard(lock);
+			Extent *entry=getIndexEntry(regionX, regionY, true);
+			if (entry==NULL) {
+				freeExtent(extent.offset, extent.capacity);
+				return false;
+			}
+			*oldExtent=*entry;
+			*entry=extent;
+			if (!writeIndexEntry(regionX, regionY)) {
+				*entry=*oldExtent;
+				freeExtent(extent.offset, extent.capacity);
+				return false;
+			}
+
+			*newExtent=extent;
+
+			return true;
+		}
+
+		bool MapPack::writeInPlace(unsigned regionX, unsigned regionY, uint64_t offset, const uint8_t *data, size_t size, bool isEnd) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+			assert(data!=NULL || size==0);
+			assert(!readOnly);
+
+			// Check data fits within the current extent.
+			lock.lock();
+			const Extent *entry=getIndexEntry(regionX, regionY, false);
+			Extent extent=(entry!=NULL ? *entry : Extent());
+			lock.unlock();
+
+			if (extent.offset==0 || offset<extent.offset || offset+size>extent.offset+extent.capacity)
+				return false;
+
+			// Write data and update index.
+			if (size>0 && pwrite(fd, data, size, offset)!=(ssize_t)size)
+				return false;
+
+			if (!isEnd)
+				return true;
+
+			std::lock_guard<std::mutex> guard(lock);
+			getIndexEntry(regionX, regionY, false)->size=offset+size-extent.offset; // blocks are never unloaded so this still exists
+
+			return writeIndexEntry(regionX, regionY);
+		}
+
+		void MapPack::release(const Extent &extent) {
+			if (extent.offset==0)
+				return;
+
+			std::lock_guard<std::mutex> guard(lock);
+			assert(freeExtentsValid); // extents to release only come from write
+			freeExtent(extent.offset, extent.capacity);
+		}
+
+		uint64_t MapPack::allocateExtent(uint64_t capacity) {
+			assert(capacity%extentAlign==0);
+			assert(freeExtentsValid);
+
+			// Use first free extent which is large enough, otherwise extend the file.
+			for(auto iter=freeExtents.begin(); iter!=freeExtents.end(); ++iter) {
+				if (iter->second<capacity)
+					continue;
+
+				uint64_t offset=iter->first;
+				uint64_t remaining=iter->second-capacity;
+				freeExtents.erase(iter);
+				if (remaining>0)
+					freeExtents[offset+capacity]=remaining;
+
+				return offset;
+			}
+
+			uint64_t offset=fileEnd;
+			fileEnd+=capacity;
+
+			return offset;
+		}
+
+		void MapPack::freeExtent(uint64_t offset, uint64_t capacity) {
+			assert(offset%extentAlign==0 && capacity%extentAlign==0);
+
+			// Merge with following free extent.
+			auto next=freeExtents.find(offset+capacity);
+			if (next!=freeExtents.end()) {
+				capacity+=next->second;
+				freeExtents.erase(next);
+			}
+
+			// Merge with preceeding free extent.
+			auto iter=freeExtents.lower_bound(offset);
+			if (iter!=freeExtents.begin()) {
+				--iter;
+				if (iter->first+iter->second==offset) {
+					offset=iter->first;
+					capacity+=iter->second;
+					freeExtents.erase(iter);
+				}
+			}
+
+			// Give space at the end back to the file, otherwise add to the free list.
+			if (offset+capacity==fileEnd)
+				fileEnd=offset;
+			else
+				freeExtents[offset]=capacity;
+		}
+
+		bool MapPack::loadFreeExtents(void) {
+			// Find every extent in use (which means reading every index block, as well as counting the blocks themselves).
+			std::vector<std::pair<uint64_t, uint64_t> > extents; // offset, capacity
+			for(size_t i=0; i<getIndexBlockCount(); ++i) {
+				const IndexBlock *block=getIndexBlock(i);
+				if (block==NULL) {
+					if (directory!=NULL && directory[i]!=0)
+						return false; // block could not be read
+					continue;
+				}
+
+				if (block->offset!=0)
+					extents.push_back(std::make_pair(block->offset, getIndexBlockCapacity()));
+				for(unsigned j=0; j<indexBlockSize*indexBlockSize; ++j)
+					if (block->entries[j].offset!=0)
+						extents.push_back(std::make_pair(block->entries[j].offset, block->entries[j].capacity));
+			}
+			std::sort(extents.begin(), extents.end());
+
+			// Build free list from the gaps between them.
+			freeExtents.clear();
+			fileEnd=header.dataOffset;
+			for(auto const &extent: extents) {
+				if (extent.first<fileEnd) {
+					fprintf(stderr,"error: region pack file has overlapping extents\n");
+					freeExtents.clear();
+					return false;
+				}
+				if (extent.first>fileEnd)
+					freeExtent(fileEnd, extent.first-fileEnd);
+				fileEnd=extent.first+extent.second;
+			}
+
+			freeExtentsValid=true;
+			return true;
+		}
+
+		size_t MapPack::getIndexBlockCount(void) const {
+			return (size_t)indexBlocksSize*indexBlocksSize;
+		}
+
+		uint64_t MapPack::getIndexBlockCapacity(void) const {
+			return ((sizeof(IndexBlock::entries)+extentAlign-1)/extentAlign)*extentAlign;
+		}
+
+		MapPack::IndexBlock *MapPack::getIndexBlock(size_t blockIndex) {
+			assert(blockIndex<getIndexBlockCount());
+
+			IndexBlock *block=indexBlocks[blockIndex];
+			if (block!=NULL || directory==NULL || directory[blockIndex]==0)
+				return block;
+
+			// Read block.
+			block=new IndexBlock;
+			if (block==NULL)
+				return NULL;
+			block->offset=directory[blockIndex];
+			if (pread(fd, block->entries, sizeof(block->entries), block->offset)!=(ssize_t)sizeof(block->entries)) {
+				fprintf(stderr,"error: could not read region pack index block at offset %llu\n", (unsigned long long)block->offset);
+				delete block;
+				return NULL;
+			}
+
+			indexBlocks[blockIndex]=block;
+			return block;
+		}
+
+		MapPack::Extent *MapPack::getIndexEntry(unsigned regionX, unsigned regionY, bool create) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+
+			size_t blockIndex=(size_t)(regionY/indexBlockSize)*indexBlocksSize+regionX/indexBlockSize;
+			IndexBlock *block=getIndexBlock(blockIndex);
+			if (block==NULL) {
+				if (!create || (directory!=NULL && directory[blockIndex]!=0))
+					return NULL;
+
+				// Allocate new (empty) block.
+				// Note: the block is written out before being added to the directory, so the directory never points at a partial block.
+				block=new IndexBlock();
+				if (block==NULL)
+					return NULL;
+				if (directory!=NULL) {
+					block->offset=allocateExtent(getIndexBlockCapacity());
+					if (pwrite(fd, block->entries, sizeof(block->entries), block->offset)!=(ssize_t)sizeof(block->entries) ||
+					    pwrite(fd, &block->offset, sizeof(block->offset), header.indexOffset+blockIndex*sizeof(uint64_t))!=sizeof(block->offset)) {
+						freeExtent(block->offset, getIndexBlockCapacity());
+						delete block;
+						return NULL;
+					}
+				}
+
+				indexBlocks[blockIndex]=block;
+			}
+
+			return &block->entries[(regionY%indexBlockSize)*indexBlockSize+regionX%indexBlockSize];
+		}
+
+		bool MapPack::writeIndexEntry(unsigned regionX, unsigned regionY) {
+			const Extent *entry=getIndexEntry(regionX, regionY, false);
+			assert(entry!=NULL);
+
+			uint64_t offset;
+			if (directory!=NULL) {
+				const IndexBlock *block=indexBlocks[(size_t)(regionY/indexBlockSize)*indexBlocksSize+regionX/indexBlockSize];
+				offset=block->offset+(entry-block->entries)*sizeof(Extent);
+			} else
+				offset=header.indexOffset+((size_t)regionY*regionsSize+regionX)*sizeof(Extent);
+
+			return (pwrite(fd, entry, sizeof(Extent), offset)==sizeof(Extent));
+		}
+	};
+};
@@ -0,0 +1,102 @@
+#ifndef ENGINE_GRAPHICS_MAPPACK_H
+#define ENGINE_GRAPHICS_MAPPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace Engine {
+	namespace Map {
+		// Single file container holding every region of a map (as an alternative to one file per region).
+		// The file starts with a header and a directory of index blocks (each covering indexBlockSize*indexBlockSize regions), followed by page aligned extents each holding one region file or index block.
+		// Index blocks are only allocated once a region within them is saved, and only read once used, so that the index costs a directory entry per block of the map plus a block for each part of the map actually saved.
+		// The directory covers regionsSize*regionsSize regions, which is chosen when the file is created to fit the map (any file with a larger directory than needed can still be opened).
+		// Version 1 files (with a single dense index instead, always read in full) can still be opened and written.
+		// Regions are rewritten into a newly allocated extent, and the index entry is only updated once the write has completed.
+		class MapPack {
+		public:
+			static const uint64_t extentAlign=4096; // extents start on this boundary so that uncompressed tile data within them can be memory mapped
+
+			struct Extent {
+				uint64_t offset; // 0 if there is no extent
+				uint64_t size; // bytes in use
+				uint64_t capacity; // bytes allocated (a multiple of extentAlign)
+			};
+
+			MapPack(unsigned regionsSize); // regionsSize is the number of regions per side which the index needs to cover
+			~MapPack();
+
+			bool open(const char *path, bool create, bool readOnly); // Opens an existing pack file (or creates a new empty one if create is true and no file exists). If readOnly is true then the file is never written to (and create must be false).
+			void close(void);
+
+			int getFd(void) const; // For reading extents (via pread or mmap), but writes should go via write.
+
+			bool getExtent(unsigned regionX, unsigned regionY, Extent *extent);
+			void getRegions(std::vector<std::pair<unsigned, unsigned> > *regions); // Lists (x,y) of each region which has an extent.
+			bool getIsComplete(void) const; // True if the pack is known to hold every saved region of the map (i.e. there are no separate region files left to look for).
+			bool getIsReadOnly(void) const;
+			bool setIsComplete(bool isComplete);
+
+			// Writes data into a newly allocated extent and then points the region's index entry at it.
+			// The previous extent (if any) is returned in oldExtent and must be passed to release once nothing maps it anymore.
+			bool write(unsigned regionX, unsigned regionY, const uint8_t *data, size_t size, Extent *newExtent, Extent *oldExtent);
+			// Writes data at the given offset within the region's current extent, if it fits within the extent's capacity (returns false otherwise).
+			// If isEnd is true then the extent's size is also updated to end after the data.
+			bool writeInPlace(unsigned regionX, unsigned regionY, uint64_t offset, const uint8_t *data, size_t size, bool isEnd);
+			void release(const Extent &extent);
+
+		private:
+			struct FileHeader {
+				char magic[4]; // see fileMagic
+				uint32_t version;
+				uint32_t regionsSize;
+				uint32_t flags; // see Flag enum
+				uint64_t indexOffset;
+				uint64_t dataOffset; // first extent starts at or after this
+			};
+
+			enum Flag {
+				FlagComplete=1, // see getIsComplete
+			};
+
+			static const unsigned indexBlockSize=32; // regions per side of each index block
+			struct IndexBlock {
+				uint64_t offset; // of the block's entries within the file (0 for version 1 files)
+				Extent entries[indexBlockSize*indexBlockSize]; // [y*indexBlockSize+x]
+			};
+
+			static const char fileMagic[4];
+			static const uint32_t fileVersion=2;
+
+			unsigned regionsSize; // from the file header once open (and so possibly larger than requested)
+			unsigned indexBlocksSize; // index blocks per side
+
+			int fd;
+			bool readOnly;
+			FileHeader header; // for version 2 files indexOffset is the directory's offset
+
+			const uint64_t *directory; // mapped from the file, offset of each index block (0 if none). NULL for version 1 files.
+			size_t directorySize;
+
+			std::mutex lock; // protects indexBlocks, freeExtents, freeExtentsValid and fileEnd
+			IndexBlock **indexBlocks; // NULL until loaded
+			std::map<uint64_t, uint64_t> freeExtents; // offset -> capacity, with neighbouring extents always merged
+			bool freeExtentsValid; // free list is only built on first write
+			uint64_t fileEnd; // new extents are allocated here if none in freeExtents are large enough
+
+			uint64_t allocateExtent(uint64_t capacity); // Requires lock is held.
+			void freeExtent(uint64_t offset, uint64_t capacity); // Requires lock is held.
+			bool loadFreeExtents(void); // Requires lock is held.
+			size_t getIndexBlockCount(void) const;
+			uint64_t getIndexBlockCapacity(void) const; // size of each index block's extent
+			IndexBlock *getIndexBlock(size_t blockIndex); // Loads block if needed. Returns NULL if there is no such block. Requires lock is held.
+			Extent *getIndexEntry(unsigned regionX, unsigned regionY, bool create); // Returns NULL if the region's block does not exist (and create is false or it could not be allocated). Requires lock is held.
+			bool writeIndexEntry(unsigned regionX, unsigned regionY); // Requires lock is held.
+		};
+	};
+};
+
+#endif
@@ -74,6 +74,12 @@ namespace Engine {
 		const unsigned regionX1=tileX1/MapRegion::tilesSize+1;
 		const unsigned regionY1=tileY1/MapRegion::tilesSize+1;
 
+		// If zoomed out far enough read region summaries instead of tiles, so that regions need not be loaded at all.
+		const unsigned pyramidLevel=(getLayerHasPyramid(layer) ? MapPyramid::getLevelForScale(std::min(xScale, yScale)) : 0);
+		MapPyramid::Cell *pyramidCells=NULL;
+		if (pyramidLevel>0)
+			pyramidCells=(MapPyramid::Cell *)malloc(MapPyramid::getLevelSize(pyramidLevel)*MapPyramid::getLevelSize(pyramidLevel)*sizeof(MapPyramid::Cell)); // TODO: Check return.
+
 		unsigned regionX, regionY;
 		for(regionY=regionY0; regionY<regionY1; ++regionY) {
 			const int regionTileY0=regionY*MapRegion::tilesSize;
@@ -88,7 +94,23 @@ namespace Engine {
 				const unsigned imageX0=std::max(0, (int)floor((regionTileX0-mapTileX)/xScale));
 				const unsigned imageX1=std::min(imageWidth, (int)floor((regionTileX1-mapTileX)/xScale));
 
-				bool regionExists=true; // until shown false later
+				// Read tiles from a snapshot of the region, so that other threads can keep modifying the map while we render.
+				// Note: regions which do not exist are left blank.
+				const MapRegion::Snapshot *snapshot=NULL;
+				bool havePyramidCells=false;
+				if (pyramidLevel>0)
+					havePyramidCells=map->getRegionPyramid(regionX, regionY, pyramidLevel, pyramidCells);
+				else {
+					MapRegion *region=map->getRegionAtOffset(regionX, regionY, false);
+					snapshot=(region!=NULL ? region->getSnapshot() : NULL);
+				}
+
+				// If every tile in this region is the same (e.g. open ocean) then the colour only needs choosing once (unless it depends on position).
+				bool regionIsUniform=(snapshot!=NULL && snapshot->getIsUniform() && layer!=MapTiled::ImageLayerRegionGrid);
+				uint8_t uniformR=0, uniformG=0, uniformB=0, uniformA=0;
+				if (regionIsUniform)
+					getColourForTile(map, regionTileX0, regionTileY0, snapshot->getTileAtOffset(0, 0), layer, &uniformR, &uniformG, &uniformB, &uniformA);
+
 				unsigned imageX, imageY;
 				for(imageY=imageY0; imageY<imageY1; ++imageY) {
 					for(imageX=imageX0; imageX<imageX1; ++imageX) {
@@ -96,20 +118,27 @@ namespace Engine {
 						CoordComponent imageTileX=imageX*xScale+mapTileX;
 						CoordComponent imageTileY=imageY*yScale+mapTileY;
 
-						const MapTile *tile=NULL;
-						if (regionExists) {
-							CoordVec vec={imageTileX*Physics::CoordsPerTile, imageTileY*Physics::CoordsPerTile};
-							tile=map->getTileAtCoordVec(vec, Engine::Map::Map::GetTileFlag::None);
-							if (tile==NULL) {
-								// If this tile does not exist, it must be because the whole region doesn't, so skip even trying to read the rest of the tiles within it.
-								regionExists=false;
-							}
+						if (regionIsUniform) {
+							pngRows[(imageY*imageWidth+imageX)*4+0]=uniformR;
+							pngRows[(imageY*imageWidth+imageX)*4+1]=uniformG;
+							pngRows[(imageY*imageWidth+imageX)*4+2]=uniformB;
+							pngRows[(imageY*imageWidth+imageX)*4+3]=uniformA;
+							continue;
 						}
 
+						const MapTile *tile=NULL;
+						if (snapshot!=NULL)
+							tile=snapshot->getTileAtOffset(imageTileX%MapRegion::tilesSize, imageTileY%MapRegion::tilesSize);
+
 						// Choose colour (based on topmost layer with a texture set).
 						uint8_t r=0, g=0, b=0, a=0;
 						if (tile!=NULL)
 							getColourForTile(map, imageTileX, imageTileY, tile, layer, &r, &g, &b, &a);
+						else if (havePyramidCells) {
+							const unsigned cellX=(imageTileX%MapRegion::tilesSize)>>pyramidLevel;
+							const unsigned cellY=(imageTileY%MapRegion::tilesSize)>>pyramidLevel;
+							getColourForCell(map, &pyramidCells[cellY*MapPyramid::getLevelSize(pyramidLevel)+cellX], layer, &r, &g, &b, &a);
+						}
 
 						// Write pixel.
 						pngRows[(imageY*imageWidth+imageX)*4+0]=r;
@@ -129,11 +158,16 @@ namespace Engine {
 						fflush(stdout);
 					}
 				}
+
+				if (snapshot!=NULL)
+					snapshot->release();
 			}
 		}
 		if (!quiet)
 			printf("\n");
 
+		free(pyramidCells);
+
 		// Write pixels.
 		int pngY;
 		for(pngY=0; pngY<imageHeight; ++pngY) {
@@ -201,32 +235,77 @@ namespace Engine {
 		*r=*g=*b=*a=0;
 	}
 
+	bool MapPngLib::getLayerHasPyramid(MapTiled::ImageLayer layer) {
+		return (layer==MapTiled::ImageLayerBase || layer==MapTiled::ImageLayerTemperature || layer==MapTiled::ImageLayerHeight || layer==MapTiled::ImageLayerMoisture);
+	}
+
+	void MapPngLib::getColourForCell(const class Map *map, const MapPyramid::Cell *cell, MapTiled::ImageLayer layer, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+		assert(map!=NULL);
+		assert(cell!=NULL);
+		assert(getLayerHasPyramid(layer));
+
+		switch(layer) {
+			case MapTiled::ImageLayerBase:
+				return MapPngLib::getColourForTexture(map, cell->textureId, r, g, b, a);
+			break;
+			case MapTiled::ImageLayerTemperature:
+				return MapPngLib::getColourForTemperature(map, cell->temperatureMean, r, g, b, a);
+			break;
+			case MapTiled::ImageLayerHeight:
+				return MapPngLib::getColourForHeight(map, cell->heightMean, r, g, b, a);
+			break;
+			case MapTiled::ImageLayerMoisture:
+				return MapPngLib::getColourForMoisture(map, cell->heightMean, cell->moistureMean, r, g, b, a);
+			break;
+		}
+
+		assert(false);
+		*r=*g=*b=*a=0;
+	}
+
 	void MapPngLib::getColourForTileBase(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
 		// Loop over layers from top to bottom looking for one with a texture set
 		for(int z=MapTile::layersMax-1; z>=0; --z) {
 			const MapTile::Layer *layer=tile->getLayer(z);
+			if (layer->textureId!=MapTexture::IdMax)
+				return getColourForTexture(map, layer->textureId, r, g, b, a);
+		}
 
-			if (layer->textureId!=MapTexture::IdMax) {
-				const MapTexture *texture=map->getTexture(layer->textureId);
-				if (texture!=NULL) {
-					*r=texture->getMapColourR();
-					*g=texture->getMapColourG();
-					*b=texture->getMapColourB();
-					*a=255;
-					return;
-				} else
-					assert(false);
-			}
+		getColourForTexture(map, MapTexture::IdMax, r, g, b, a);
+	}
+
+	void MapPngLib::getColourForTileTemperature(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+		getColourForTemperature(map, tile->getTemperature(), r, g, b, a);
+	}
+
+	void MapPngLib::getColourForTileHeight(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+		getColourForHeight(map, tile->getHeight(), r, g, b, a);
+	}
+
+	void MapPngLib::getColourForTileMoisture(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+		getColourForMoisture(map, tile->getHeight(), tile->getMoisture(), r, g, b, a);
+	}
+
+	void MapPngLib::getColourForTexture(const class Map *map, MapTexture::Id textureId, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+		if (textureId!=MapTexture::IdMax) {
+			const MapTexture *texture=map->getTexture(textureId);
+			if (texture!=NULL) {
+				*r=texture->getMapColourR();
+				*g=texture->getMapColourG();
+				*b=texture->getMapColourB();
+				*a=255;
+				return;
+			} else
+				assert(false);
 		}
 
 		*r=255;*g=0;*b=0;*a=255;
 	}
 
-	void MapPngLib::getColourForTileTemperature(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+	void MapPngLib::getColourForTemperature(const class Map *map, double temperature, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
 		*a=255;
 
-		// Grab temperature and normalise to [0, 1]
-		double temperature=tile->getTemperature();
+		// Normalise temperature to [0, 1]
 		double temperatureNormalised=(temperature-map->minTemperature)/(map->maxTemperature-map->minTemperature);
 
 		// Scale temperature up to [0, 1023]
@@ -257,11 +336,10 @@ namespace Engine {
 		}
 	}
 
-	void MapPngLib::getColourForTileHeight(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+	void MapPngLib::getColourForHeight(const class Map *map, double height, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
 		*a=255;
 
-		// Grab height and check for ocean tile as special case
-		double height=tile->getHeight();
+		// Check for ocean tile as special case
 		if (height<=map->seaLevel) {
 			*r=0;
 			*g=0;
@@ -300,19 +378,18 @@ namespace Engine {
 		}
 	}
 
-	void MapPngLib::getColourForTileMoisture(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
+	void MapPngLib::getColourForMoisture(const class Map *map, double height, double moisture, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a) {
 		*a=255;
 
 		// Special case for ocean tiles
-		if (tile->getHeight()<=map->seaLevel) {
+		if (height<=map->seaLevel) {
 			*r=0;
 			*g=0;
 			*b=255;
 			return;
 		}
 
-		// Grab moisture and normalise to [0, 1]
-		double moisture=tile->getMoisture();
+		// Normalise moisture to [0, 1]
 		double moistureNormalised=(moisture-map->minMoisture)/(map->maxMoisture-map->minMoisture);
 
 		// Choose colour (low moisture as white, high moisture as dark blue)
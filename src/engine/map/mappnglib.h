@@ -9,6 +9,7 @@
 
 #include "map.h"
 #include "mapobject.h"
+#include "mappyramid.h"
 #include "maptiled.h"
 #include "../util.h"
 
@@ -19,8 +20,12 @@ namespace Engine {
 	namespace Map {
 		class MapPngLib {
 		public:
+			// If each pixel covers at least two tiles per side then layers which can be drawn from summaries (see getLayerHasPyramid) are drawn from the regions' pyramids (see Map::getRegionPyramid) rather than individual tiles.
 			static bool generatePng(class Map *map, const char *imagePath, int mapTileX, int mapTileY, int mapTileWidth, int mapTileHeight, int imageWidth, int imageHeight, MapTiled::ImageLayer layer, bool quiet);
+
+			static bool getLayerHasPyramid(MapTiled::ImageLayer layer); // True if the layer only depends on attributes summarised by MapPyramid::Cell.
 		private:
+			static void getColourForCell(const class Map *map, const MapPyramid::Cell *cell, MapTiled::ImageLayer layer, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
 			static void getColourForTile(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, MapTiled::ImageLayer layer, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
 			static void getColourForTileBase(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
 			static void getColourForTileTemperature(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
@@ -30,6 +35,12 @@ namespace Engine {
 			static void getColourForTilePath(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
 			static void getColourForTilePolitical(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
 			static void getColourForTileRegionGrid(const class Map *map, int mapTileX, int mapTileY, const MapTile *tile, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
+
+			// Shared by the tile and cell functions above.
+			static void getColourForTexture(const class Map *map, MapTexture::Id textureId, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
+			static void getColourForTemperature(const class Map *map, double temperature, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
+			static void getColourForHeight(const class Map *map, double height, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
+			static void getColourForMoisture(const class Map *map, double height, double moisture, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a);
 		};
 	};
 };
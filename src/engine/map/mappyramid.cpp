@@ -0,0 +1,292 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mappyramid.h"
+
+namespace Engine {
+	namespace Map {
+		const char MapPyramid::fileMagic[4]={'6', '4', 'G', 'Y'};
+
+		static_assert(MapRegion::tilesSize==(1u<<MapPyramid::levelMax));
+
+		// Returns the most common of the given texture ids (preferring the earliest in case of a tie).
+		static MapTexture::Id mapPyramidTextureMode(const MapTexture::Id ids[4]) {
+			MapTexture::Id bestId=ids[0];
+			unsigned bestCount=0;
+			for(unsigned i=0; i<4; ++i) {
+				unsigned count=0;
+				for(unsigned j=0; j<4; ++j)
+					count+=(ids[j]==ids[i]);
+				if (count>bestCount) {
+					bestId=ids[i];
+					bestCount=count;
+				}
+			}
+
+			return bestId;
+		}
+
+		// Returns the texture of the topmost layer with one set.
+		static MapTexture::Id mapPyramidTopTexture(const MapTile::Layer layers[MapTile::layersMax]) {
+			for(int z=MapTile::layersMax-1; z>=0; --z)
+				if (layers[z].textureId!=MapTexture::IdMax)
+					return layers[z].textureId;
+
+			return MapTexture::IdMax;
+		}
+
+		unsigned MapPyramid::getLevelSize(unsigned level) {
+			assert(level>=levelMin && level<=levelMax);
+			return (MapRegion::tilesSize>>level);
+		}
+
+		unsigned MapPyramid::getLevelForScale(double tilesPerPixel) {
+			if (tilesPerPixel<(1u<<levelMin))
+				return 0;
+
+			unsigned level=floor(log2(tilesPerPixel));
+			return (level<levelMax ? level : levelMax);
+		}
+
+		void MapPyramid::compute(const MapRegion *region, unsigned level, Cell *cells) {
+			assert(region!=NULL);
+			assert(level>=levelMin && level<=levelMax);
+			assert(cells!=NULL);
+
+			const unsigned size=getLevelSize(level);
+
+			// Uniform regions (e.g. open ocean) have the same summary everywhere.
+			if (region->getIsUniform()) {
+				Cell cell;
+				computeUniform(region, &cell);
+				for(unsigned i=0; i<size*size; ++i)
+					cells[i]=cell;
+				return;
+			}
+
+			// Otherwise work up from the first level, alternating between two buffers.
+			if (level==levelMin) {
+				computeLevelMin(region->getTileFileData(), cells);
+				return;
+			}
+
+			const unsigned sizeMin=getLevelSize(levelMin);
+			Cell *buffer=(Cell *)malloc(2*sizeMin*sizeMin*sizeof(Cell)); // TODO: Check return.
+			Cell *below=buffer, *above=buffer+sizeMin*sizeMin;
+
+			computeLevelMin(region->getTileFileData(), below);
+			for(unsigned l=levelMin+1; l<level; ++l) {
+				computeLevelFromBelow(l, below, above);
+				std::swap(below, above);
+			}
+			computeLevelFromBelow(level, below, cells);
+
+			free(buffer);
+		}
+
+		bool MapPyramid::save(const char *pyramidDirPath, unsigned regionX, unsigned regionY, const MapRegion *region) {
+			assert(pyramidDirPath!=NULL);
+			assert(region!=NULL);
+
+			// Compute levels.
+			FileHeader header;
+			memcpy(header.magic, fileMagic, sizeof(fileMagic));
+			header.version=fileVersion;
+			header.flags=0;
+			header.padding=0;
+
+			const size_t cellsCount=(getLevelOffset(levelMin)-sizeof(FileHeader))/sizeof(Cell)+getLevelSize(levelMin)*getLevelSize(levelMin);
+			Cell *cells=(Cell *)malloc(cellsCount*sizeof(Cell));
+			if (cells==NULL)
+				return false;
+			auto levelCells=[&](unsigned level) { return cells+(getLevelOffset(level)-sizeof(FileHeader))/sizeof(Cell); };
+
+			size_t cellsUsed;
+			if (region->getIsUniform()) {
+				header.flags|=FileFlagUniform;
+				computeUniform(region, &cells[0]);
+				cellsUsed=1;
+			} else {
+				computeLevelMin(region->getTileFileData(), levelCells(levelMin));
+				for(unsigned level=levelMin+1; level<=levelMax; ++level)
+					computeLevelFromBelow(level, levelCells(level-1), levelCells(level));
+				cellsUsed=cellsCount;
+			}
+
+			// Write to a temporary file which then replaces the original (so that readers never see a partial file).
+			char path[1024], tempPath[1024+4];
+			int pathLen=snprintf(path, sizeof(path), "%s/%u,%u", pyramidDirPath, regionX, regionY);
+			if (pathLen<0 || (size_t)pathLen>=sizeof(path)) {
+				fprintf(stderr,"error: pyramid directory path '%s' is too long\n", pyramidDirPath);
+				free(cells);
+				return false;
+			}
+			sprintf(tempPath, "%s.tmp", path);
+
+			FILE *file=fopen(tempPath, "w");
+			if (file==NULL) {
+				fprintf(stderr,"error: could not create pyramid file at '%s'\n", tempPath);
+				free(cells);
+				return false;
+			}
+
+			bool result=true;
+			result&=(fwrite(&header, sizeof(header), 1, file)==1);
+			result&=(fwrite(cells, sizeof(Cell), cellsUsed, file)==cellsUsed);
+			result&=(fclose(file)==0);
+			free(cells);
+
+			if (result)
+				result&=(rename(tempPath, path)==0);
+			if (!result) {
+				fprintf(stderr,"error: could not write pyramid file at '%s'\n", path);
+				unlink(tempPath);
+			}
+
+			return result;
+		}
+
+		bool MapPyramid::load(const char *pyramidDirPath, unsigned regionX, unsigned regionY, unsigned level, Cell *cells) {
+			assert(pyramidDirPath!=NULL);
+			assert(level>=levelMin && level<=levelMax);
+			assert(cells!=NULL);
+
+			char path[1024]; // TODO: Prevent overflows.
+			sprintf(path, "%s/%u,%u", pyramidDirPath, regionX, regionY);
+
+			int fd=open(path, O_RDONLY);
+			if (fd==-1)
+				return false;
+
+			// Read and check header.
+			FileHeader header;
+			if (pread(fd, &header, sizeof(header), 0)!=sizeof(header) || memcmp(header.magic, fileMagic, sizeof(fileMagic))!=0 || header.version!=fileVersion) {
+				close(fd);
+				return false;
+			}
+
+			// Read cells for the requested level (or the single cell of a uniform region).
+			const unsigned size=getLevelSize(level);
+			bool result;
+			if (header.flags & FileFlagUniform) {
+				Cell cell;
+				result=(pread(fd, &cell, sizeof(cell), sizeof(header))==sizeof(cell));
+				for(unsigned i=0; i<size*size && result; ++i)
+					cells[i]=cell;
+			} else {
+				const ssize_t levelBytes=size*size*sizeof(Cell);
+				result=(pread(fd, cells, levelBytes, getLevelOffset(level))==levelBytes);
+			}
+
+			close(fd);
+
+			return result;
+		}
+
+		void MapPyramid::remove(const char *pyramidDirPath, unsigned regionX, unsigned regionY) {
+			assert(pyramidDirPath!=NULL);
+
+			char path[1024]; // TODO: Prevent overflows.
+			sprintf(path, "%s/%u,%u", pyramidDirPath, regionX, regionY);
+			unlink(path);
+		}
+
+		size_t MapPyramid::getLevelOffset(unsigned level) {
+			assert(level>=levelMin && level<=levelMax);
+
+			size_t offset=sizeof(FileHeader);
+			for(unsigned l=levelMax; l>level; --l)
+				offset+=getLevelSize(l)*getLevelSize(l)*sizeof(Cell);
+
+			return offset;
+		}
+
+		void MapPyramid::computeUniform(const MapRegion *region, Cell *cell) {
+			const MapTile *tile=region->getUniformTile();
+
+			cell->heightMin=cell->heightMax=cell->heightMean=tile->getHeight();
+			cell->moistureMean=tile->getMoisture();
+			cell->temperatureMean=tile->getTemperature();
+			cell->textureId=mapPyramidTopTexture(tile->getLayers());
+			cell->padding=0;
+		}
+
+		void MapPyramid::computeLevelMin(const MapTile::FileData *fileData, Cell *cells) {
+			assert(fileData!=NULL);
+
+			const unsigned size=getLevelSize(levelMin);
+			const unsigned span=(1u<<levelMin);
+			const double tileCount=span*span;
+
+			for(unsigned cellY=0; cellY<size; ++cellY)
+				for(unsigned cellX=0; cellX<size; ++cellX) {
+					double heightMin=INFINITY, heightMax=-INFINITY, heightSum=0.0, moistureSum=0.0, temperatureSum=0.0;
+					MapTexture::Id textureIds[4];
+					static_assert(levelMin==1); // i.e. each cell covers exactly four tiles, one per entry in textureIds
+
+					for(unsigned dy=0; dy<span; ++dy)
+						for(unsigned dx=0; dx<span; ++dx) {
+							unsigned i=(cellY*span+dy)*MapRegion::tilesSize+(cellX*span+dx);
+
+							double height=fileData->height[i];
+							heightMin=std::min(heightMin, height);
+							heightMax=std::max(heightMax, height);
+							heightSum+=height;
+							moistureSum+=fileData->moisture[i];
+							temperatureSum+=fileData->temperature[i];
+							textureIds[dy*span+dx]=mapPyramidTopTexture(fileData->layers[i]);
+						}
+
+					Cell *cell=&cells[cellY*size+cellX];
+					cell->heightMin=heightMin;
+					cell->heightMax=heightMax;
+					cell->heightMean=heightSum/tileCount;
+					cell->moistureMean=moistureSum/tileCount;
+					cell->temperatureMean=temperatureSum/tileCount;
+					cell->textureId=mapPyramidTextureMode(textureIds);
+					cell->padding=0;
+				}
+		}
+
+		void MapPyramid::computeLevelFromBelow(unsigned level, const Cell *below, Cell *cells) {
+			assert(level>levelMin && level<=levelMax);
+			assert(below!=NULL);
+			assert(cells!=NULL);
+
+			const unsigned size=getLevelSize(level);
+			const unsigned belowSize=getLevelSize(level-1);
+
+			for(unsigned cellY=0; cellY<size; ++cellY)
+				for(unsigned cellX=0; cellX<size; ++cellX) {
+					const Cell *children[4]={
+						&below[(cellY*2+0)*belowSize+(cellX*2+0)],
+						&below[(cellY*2+0)*belowSize+(cellX*2+1)],
+						&below[(cellY*2+1)*belowSize+(cellX*2+0)],
+						&below[(cellY*2+1)*belowSize+(cellX*2+1)],
+					};
+
+					Cell *cell=&cells[cellY*size+cellX];
+					cell->heightMin=children[0]->heightMin;
+					cell->heightMax=children[0]->heightMax;
+					cell->heightMean=cell->moistureMean=cell->temperatureMean=0.0;
+					MapTexture::Id textureIds[4];
+					for(unsigned i=0; i<4; ++i) {
+						cell->heightMin=std::min(cell->heightMin, children[i]->heightMin);
+						cell->heightMax=std::max(cell->heightMax, children[i]->heightMax);
+						cell->heightMean+=children[i]->heightMean/4;
+						cell->moistureMean+=children[i]->moistureMean/4;
+						cell->temperatureMean+=children[i]->temperatureMean/4;
+						textureIds[i]=children[i]->textureId;
+					}
+					cell->textureId=mapPyramidTextureMode(textureIds);
+					cell->padding=0;
+				}
+		}
+	};
+};
@@ -0,0 +1,59 @@
+#ifndef ENGINE_GRAPHICS_MAPPYRAMID_H
+#define ENGINE_GRAPHICS_MAPPYRAMID_H
+
+#include <cstdint>
+
+#include "mapregion.h"
+#include "maptexture.h"
+
+namespace Engine {
+	namespace Map {
+		// Per region multi-resolution summaries of tile attributes, for zoomed-out views which would otherwise need to read every tile.
+		// Level n has MapRegion::tilesSize>>n cells per side, each summarising a square of 2^n tiles per side, down to a single cell for the whole region at levelMax.
+		// Each region's levels are stored in their own file (alongside the regions), rewritten whenever the region is saved (see Map::regionSave).
+		class MapPyramid {
+		public:
+			static const unsigned levelMin=1;
+			static const unsigned levelMax=8; // equal to log2(MapRegion::tilesSize)
+
+			struct Cell {
+				float heightMin, heightMax, heightMean;
+				float moistureMean;
+				float temperatureMean;
+				MapTexture::Id textureId; // most common topmost texture (MapTexture::IdMax if none), with levels above levelMin taking the most common of the four cells below (so only approximate)
+				uint16_t padding;
+			};
+
+			static unsigned getLevelSize(unsigned level); // Cells per side.
+			static unsigned getLevelForScale(double tilesPerPixel); // Returns the coarsest level whose cells are no larger than the given number of tiles per side (capped at levelMax), or 0 if tiles should be read directly instead.
+
+			static void compute(const MapRegion *region, unsigned level, Cell *cells); // Summarises the region's tile data for a single level, filling getLevelSize(level) squared cells indexed as y*size+x.
+
+			static bool save(const char *pyramidDirPath, unsigned regionX, unsigned regionY, const MapRegion *region); // Computes every level and replaces the region's pyramid file.
+			static bool load(const char *pyramidDirPath, unsigned regionX, unsigned regionY, unsigned level, Cell *cells); // Reads a single level from the region's pyramid file, returning false if there is no (valid) file.
+			static void remove(const char *pyramidDirPath, unsigned regionX, unsigned regionY); // Removes the region's pyramid file (e.g. once it no longer matches the region).
+		private:
+			struct FileHeader {
+				char magic[4]; // see fileMagic
+				uint32_t version;
+				uint32_t flags; // see FileFlag enum
+				uint32_t padding;
+			};
+
+			enum FileFlag {
+				FileFlagUniform=1, // every cell of every level is identical, so only a single cell is stored
+			};
+
+			static const char fileMagic[4];
+			static const uint32_t fileVersion=1;
+
+			static size_t getLevelOffset(unsigned level); // Offset of the given level's cells within a (non-uniform) file. Levels are stored coarsest first.
+
+			static void computeUniform(const MapRegion *region, Cell *cell);
+			static void computeLevelMin(const MapTile::FileData *fileData, Cell *cells);
+			static void computeLevelFromBelow(unsigned level, const Cell *below, Cell *cells);
+		};
+	};
+};
+
+#endif
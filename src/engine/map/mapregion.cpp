@@ -1,7 +1,15 @@
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <new>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "mapregion.h"
 #include "../util.h"
@@ -10,80 +18,1257 @@ using namespace Engine;
 using namespace Engine::Physics;
 
 namespace Engine {
-	MapRegion::MapRegion(unsigned regionX, unsigned regionY): regionX(regionX), regionY(regionY) {
+	MapRegion::BufferPool::BufferPool(size_t maxBytes, bool hugePages): maxBytes(maxBytes), hugePages(hugePages) {
+		bytes=0;
+	}
+
+	MapRegion::BufferPool::~BufferPool() {
+		for(size_t i=0; i<fileDatas.size(); ++i)
+			munmap(fileDatas[i], tileFileDataSize);
+		for(size_t i=0; i<tiles.size(); ++i)
+			delete[] tiles[i];
+	}
+
+	MapTile::FileData *MapRegion::BufferPool::takeFileData(bool *isRecycled) {
+		assert(isRecycled!=NULL);
+
+		std::unique_lock<std::mutex> poolLock(lock);
+		if (!fileDatas.empty()) {
+			MapTile::FileData *fileData=fileDatas.back();
+			fileDatas.pop_back();
+			bytes-=tileFileDataSize;
+			*isRecycled=true;
+			return fileData;
+		}
+		poolLock.unlock();
+
+		*isRecycled=false;
+		return allocFileData(hugePages);
+	}
+
+	void MapRegion::BufferPool::giveFileData(MapTile::FileData *fileData) {
+		assert(fileData!=NULL);
+
+		std::unique_lock<std::mutex> poolLock(lock);
+		if (bytes+tileFileDataSize<=maxBytes) {
+			fileDatas.push_back(fileData);
+			bytes+=tileFileDataSize;
+			return;
+		}
+		poolLock.unlock();
+
+		munmap(fileData, tileFileDataSize);
+	}
+
+	MapTile *MapRegion::BufferPool::takeTiles(void) {
+		std::unique_lock<std::mutex> poolLock(lock);
+		if (!tiles.empty()) {
+			MapTile *result=tiles.back();
+			tiles.pop_back();
+			bytes-=bandTileCount*sizeof(MapTile);
+			return result;
+		}
+		poolLock.unlock();
+
+		return new MapTile[bandTileCount];
+	}
+
+	void MapRegion::BufferPool::giveTiles(MapTile *gTiles) {
+		assert(gTiles!=NULL);
+
+		std::unique_lock<std::mutex> poolLock(lock);
+		if (bytes+bandTileCount*sizeof(MapTile)<=maxBytes) {
+			for(unsigned i=0; i<bandTileCount; ++i)
+				gTiles[i].clearFileData();
+			tiles.push_back(gTiles);
+			bytes+=bandTileCount*sizeof(MapTile);
+			return;
+		}
+		poolLock.unlock();
+
+		delete[] gTiles;
+	}
+
+	size_t MapRegion::BufferPool::getBytes(void) const {
+		std::lock_guard<std::mutex> poolLock(lock);
+		return bytes;
+	}
+
+	MapTile::FileData *MapRegion::BufferPool::allocFileData(bool hugePages) {
+		if (!hugePages) {
+			void *fileData=mmap(NULL, tileFileDataSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			return (fileData!=MAP_FAILED ? (MapTile::FileData *)fileData : NULL);
+		}
+
+		// Huge pages can only be used for aligned parts of a mapping, so over allocate and then trim the mapping to an aligned start.
+		const size_t hugePageSize=(2u<<20);
+		size_t reserveSize=tileFileDataSize+hugePageSize;
+		void *reserve=mmap(NULL, reserveSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (reserve==MAP_FAILED)
+			return NULL;
+
+		uint8_t *start=(uint8_t *)reserve;
+		uint8_t *alignedStart=(uint8_t *)(((uintptr_t)start+hugePageSize-1) & ~(uintptr_t)(hugePageSize-1));
+		uint8_t *end=start+reserveSize;
+		uint8_t *alignedEnd=alignedStart+tileFileDataSize;
+		if (alignedStart>start)
+			munmap(start, alignedStart-start);
+		if (end>alignedEnd)
+			munmap(alignedEnd, end-alignedEnd);
+
+#ifdef MADV_HUGEPAGE
+		madvise(alignedStart, tileFileDataSize, MADV_HUGEPAGE); // only advice, so failure (e.g. transparent huge pages disabled) is harmless
+#endif
+
+		return (MapTile::FileData *)alignedStart;
+	}
+
+	MapRegion::MapRegion(unsigned regionX, unsigned regionY, BufferPool *pool): regionX(regionX), regionY(regionY), pool(pool) {
 		isDirty=false;
+		dirtyBands=0;
+		clearLog();
+		logAll=true; // until loaded from a file (or saved in full)
+		fileBandsValid=false;
+
+		// Reserve file data as an anonymous mapping (either new, in which case the kernel provides zeroed pages on demand, or recycled from another region).
+		// If the region is loaded from a file later this mapping is replaced in place, so tile instances remain valid.
+		bool isRecycled=false;
+		tileFileData=(pool!=NULL ? pool->takeFileData(&isRecycled) : BufferPool::allocFileData(false));
+		if (tileFileData==NULL)
+			throw std::bad_alloc();
+		tileFileDataIsFile=false;
+		tileFileDataIsPack=false;
+		tileFileDataIsAnonymous=true;
+		tileFileDataOffset=0;
+
+		// New regions are uniform (every field zero) until written.
+		// Only index 0 is valid for uniform regions (with the rest written when the region is loaded or expanded) so that is all recycled data needs clearing.
+		isUniform=true;
+		isUniformRestZero=!isRecycled;
+		uniformTile.setFileData(this, tileFileData, 0);
+		if (isRecycled) {
+			FileTile zeroTile=FileTile();
+			setFileTile(0, &zeroTile);
+		}
 
-		// Set file data to all zeros.
-		memset(tileFileData, 0, sizeof(tileFileData));
+		writersActive=0;
+		writeVersion=0;
+		snapshot=NULL;
+		snapshotBytes=0;
 
-		// Update tile instances with their file data.
-		unsigned tileX, tileY;
-		for(tileY=0; tileY<MapRegion::tilesSize; ++tileY)
-			for(tileX=0; tileX<MapRegion::tilesSize; ++tileX)
-				tileInstances[tileY][tileX].setFileData(&(tileFileData[tileY][tileX]));
+		// Tile instances are only created when first needed (many regions are only ever accessed in bulk via getTileFileData).
+		for(unsigned i=0; i<bandsCount; ++i)
+			tileInstances[i]=NULL;
 	}
 
 	MapRegion::~MapRegion() {
+		// Drop our reference to the latest snapshot (readers may still hold their own).
+		if (snapshot!=NULL)
+			snapshot->release();
+
+		// Free tile instances (or keep them for reuse).
+		for(unsigned i=0; i<bandsCount; ++i) {
+			MapTile *tiles=tileInstances[i].load();
+			if (tiles==NULL)
+				continue;
+			if (pool!=NULL)
+				pool->giveTiles(tiles);
+			else
+				delete[] tiles;
+		}
+
+		// Unmap file data (or keep it for reuse if it is not a file mapping).
+		// Note: for file backed regions any modified pages are still written back to the file by the kernel.
+		if (pool!=NULL && tileFileDataIsAnonymous)
+			pool->giveFileData(tileFileData);
+		else
+			munmap(tileFileData, tileFileDataSize);
 	}
 
-	bool MapRegion::load(const char *regionPath) {
+	const char MapRegion::fileMagic[4]={'6', '4', 'G', 'R'};
+
+	bool MapRegion::load(const char *regionPath, bool readOnly, const uint8_t *data, uint64_t dataSize) {
+		assert(regionPath!=NULL);
+
 		// Open region file.
-		FILE *regionFile=fopen(regionPath, "r");
-		if (regionFile==NULL)
+		int regionFd=open(regionPath, (readOnly ? O_RDONLY : O_RDWR));
+		if (regionFd==-1)
+			return false;
+
+		struct stat regionStat;
+		if (fstat(regionFd, &regionStat)!=0) {
+			close(regionFd);
+			return false;
+		}
+
+		// Read region (unless it has already been read in).
+		// Note: any mapping of the file remains valid after it is closed.
+		if (dataSize!=(uint64_t)regionStat.st_size)
+			data=NULL;
+		bool result=loadFd(regionFd, 0, regionStat.st_size, data, regionPath, false, readOnly);
+
+		close(regionFd);
+
+		return result;
+	}
+
+	bool MapRegion::load(MapPack *pack, unsigned regionX, unsigned regionY, const uint8_t *data, uint64_t dataSize) {
+		assert(pack!=NULL);
+
+		MapPack::Extent extent;
+		if (!pack->getExtent(regionX, regionY, &extent))
 			return false;
 
+		char regionName[64];
+		sprintf(regionName, "%u,%u (in pack)", regionX, regionY);
+
+		if (dataSize!=extent.size)
+			data=NULL;
+
+		return loadFd(pack->getFd(), extent.offset, extent.size, data, regionName, true, pack->getIsReadOnly());
+	}
+
+	bool MapRegion::save(const char *regionsDirPath, unsigned regionX, unsigned regionY, const FileFormat &format) {
+		assert(regionsDirPath!=NULL);
+		assert(MapCodec::isAvailable(format.codec));
+		assert(format.encoding<EncodingNB);
+
+		char regionFilePath[1024]; // TODO: Prevent overflows.
+		sprintf(regionFilePath, "%s/%u,%u", regionsDirPath, regionX, regionY);
+
+		// Take dirty bands (and modified tiles, see save for MapLog) now so that any modified during the save are still saved next time.
+		uint64_t version=writeVersion.load();
+		uint32_t bands=dirtyBands.exchange(0);
+		clearLog();
+
 		bool result=true;
 
-		// Read tile data.
-		size_t tileCount=tilesSize*tilesSize;
-		result&=(fread(&tileFileData, sizeof(MapTile::FileData), tileCount, regionFile)==tileCount);
+		bool mappable=(format.codec==MapCodec::None && format.encoding==EncodingFull);
+		bool patched=false;
+		if (!mappable && fileBandsValid && !fileBandsIsPack && fileBandsFormat.codec==format.codec && fileBandsFormat.encoding==format.encoding) {
+			// Only rewrite dirty bands (and objects) within the existing file.
+			// Note: banded tile data is never mapped so this is safe to do in place.
+			int regionFd=open(regionFilePath, O_WRONLY);
+			if (regionFd!=-1) {
+				patched=patchFile(regionFd, NULL, regionX, regionY, format, bands);
+				close(regionFd);
+			}
+		}
+
+		if (patched) {
+			// Nothing more to do.
+		} else if (tileFileDataIsFile && !tileFileDataIsPack && mappable) {
+			// Tiles are already in the page cache via the shared mapping so simply schedule writeback.
+			result&=(msync(tileFileData, tileFileDataSize, MS_ASYNC)==0);
+
+			// Rewrite objects following the tile data.
+			int regionFd=open(regionFilePath, O_WRONLY);
+			FILE *regionFile=(regionFd!=-1 ? fdopen(regionFd, "w") : NULL);
+			if (regionFile==NULL) {
+				if (regionFd!=-1)
+					close(regionFd);
+				dirtyBands.fetch_or(bands);
+				logAll=true;
+				return false;
+			}
+
+			result&=(ftruncate(regionFd, tileFileDataOffset+tileFileDataSize)==0);
+			result&=(fseek(regionFile, tileFileDataOffset+tileFileDataSize, SEEK_SET)==0);
+			result&=saveObjects(regionFile);
+
+			fclose(regionFile);
+		} else {
+			// Write the whole region to a temporary file which then replaces the original.
+			// Note: we cannot overwrite the original in place as tile data may currently be mapped from it.
+			char regionTempFilePath[1024];
+			int regionTempFilePathLen=snprintf(regionTempFilePath, sizeof(regionTempFilePath), "%s.tmp", regionFilePath);
+			FILE *regionFile=NULL;
+			if (regionTempFilePathLen>=0 && (size_t)regionTempFilePathLen<sizeof(regionTempFilePath))
+				regionFile=fopen(regionTempFilePath, "w+");
+			else
+				fprintf(stderr,"error: region file path '%s' is too long\n", regionFilePath);
+			if (regionFile==NULL) {
+				dirtyBands.fetch_or(bands);
+				logAll=true;
+				return false;
+			}
+
+			fileBandsValid=false;
+
+			FileHeader header;
+			result&=writeFile(regionFile, format, &header);
+
+			// Replace original file.
+			result&=(fflush(regionFile)==0);
+			if (result)
+				result&=(rename(regionTempFilePath, regionFilePath)==0);
+
+			// If possible switch to mapping the new file so that future saves only need to write back modified pages, otherwise ensure we are no longer mapping the old file.
+			if (result) {
+				if (mappable && !(header.flags & FileFlagUniform))
+					result&=mapFile(fileno(regionFile), header.tileDataOffset, false, false);
+				else if (tileFileDataIsFile)
+					result&=unmapFile();
+			}
+
+			// Remember band layout so that future saves can rewrite bands in place.
+			if (result && header.bands!=0) {
+				fileBandsValid=true;
+				fileBandsIsPack=false;
+				fileBandsFormat=format;
+			}
+
+			// Close file.
+			fclose(regionFile);
+			if (!result)
+				unlink(regionTempFilePath);
+		}
+
+		// Potentially update 'isDirty' flag.
+		if (result)
+			setSaved(version, bands);
+		else {
+			dirtyBands.fetch_or(bands);
+			logAll=true;
+		}
+
+		return result;
+	}
+
+	bool MapRegion::save(MapPack *pack, unsigned regionX, unsigned regionY, const FileFormat &format) {
+		assert(pack!=NULL);
+		assert(MapCodec::isAvailable(format.codec));
+		assert(format.encoding<EncodingNB);
+
+		// Take dirty bands (and modified tiles, see save for MapLog) now so that any modified during the save are still saved next time.
+		uint64_t version=writeVersion.load();
+		uint32_t bands=dirtyBands.exchange(0);
+		clearLog();
 
-		// Read object data.
-		MapObject mapObject;
-		while(mapObject.load(regionFile)) {
-			MapObject *newObject=new MapObject(mapObject);
+		bool mappable=(format.codec==MapCodec::None && format.encoding==EncodingFull);
+		if (tileFileDataIsFile && tileFileDataIsPack && mappable) {
+			// Tiles are already in the page cache via the shared mapping so simply schedule writeback.
+			bool result=(msync(tileFileData, tileFileDataSize, MS_ASYNC)==0);
 
-			if (!addObject(newObject)) {
-				delete newObject;
+			// Rewrite objects following the tile data, if they still fit within the region's extent (otherwise fall through to writing the region afresh).
+			char *objectsData=NULL;
+			size_t objectsSize=0;
+			FILE *objectsFile=open_memstream(&objectsData, &objectsSize);
+			if (objectsFile!=NULL) {
+				result&=saveObjects(objectsFile);
+				fclose(objectsFile);
+			} else
 				result=false;
+
+			bool written=(result && pack->writeInPlace(regionX, regionY, tileFileDataOffset+tileFileDataSize, (const uint8_t *)objectsData, objectsSize, true));
+			free(objectsData);
+
+			if (!result) {
+				dirtyBands.fetch_or(bands);
+				logAll=true;
+				return false;
+			}
+			if (written) {
+				setSaved(version, bands);
+				return true;
 			}
 		}
 
-		// Close region file.
+		if (!mappable && fileBandsValid && fileBandsIsPack && fileBandsFormat.codec==format.codec && fileBandsFormat.encoding==format.encoding) {
+			// Only rewrite dirty bands (and objects) within the region's existing extent.
+			if (patchFile(pack->getFd(), pack, regionX, regionY, format, bands)) {
+				setSaved(version, bands);
+				return true;
+			}
+		}
+
+		// Write whole region into memory and then into a new extent within the pack.
+		fileBandsValid=false;
+
+		char *regionData=NULL;
+		size_t regionSize=0;
+		FILE *regionFile=open_memstream(&regionData, &regionSize);
+		if (regionFile==NULL) {
+			dirtyBands.fetch_or(bands);
+			logAll=true;
+			return false;
+		}
+
+		FileHeader header;
+		bool result=writeFile(regionFile, format, &header);
 		fclose(regionFile);
 
+		MapPack::Extent newExtent, oldExtent;
+		result&=(result && pack->write(regionX, regionY, (const uint8_t *)regionData, regionSize, &newExtent, &oldExtent));
+		free(regionData);
+
+		// Switch mapping to the new extent (or away from the old one) before the old extent is released and possibly reused.
+		if (result) {
+			if (mappable && !(header.flags & FileFlagUniform))
+				result&=mapFile(pack->getFd(), newExtent.offset+header.tileDataOffset, true, false);
+			else if (tileFileDataIsFile)
+				result&=unmapFile();
+
+			// If remapping failed then we may still refer to the old extent so it is not safe to reuse it.
+			if (result)
+				pack->release(oldExtent);
+		}
+
+		// Remember band layout so that future saves can rewrite bands in place.
+		if (result && header.bands!=0) {
+			fileBandsValid=true;
+			fileBandsIsPack=true;
+			fileBandsFormat=format;
+		}
+
+		if (result)
+			setSaved(version, bands);
+		else {
+			dirtyBands.fetch_or(bands);
+			logAll=true;
+		}
+
 		return result;
 	}
 
-	bool MapRegion::save(const char *regionsDirPath, unsigned regionX, unsigned regionY) {
-		assert(regionsDirPath!=NULL);
+	bool MapRegion::save(MapLog *log, unsigned regionX, unsigned regionY) {
+		assert(log!=NULL);
 
-		// Create file.
-		char regionFilePath[1024]; // TODO: Prevent overflows.
-		sprintf(regionFilePath, "%s/%u,%u", regionsDirPath, regionX, regionY);
-		FILE *regionFile=fopen(regionFilePath, "w");
-		if (regionFile==NULL)
+		// Tile data mapped from the region's file only needs modified pages writing back, which is no more than appending them would cost.
+		if (tileFileDataIsFile || logAll.load() || logTileCount.load()>logTilesMax)
 			return false;
 
+		// Take modified tiles now so that any modified during the save are still saved next time.
+		// Note: dirty bands are left alone, as the region's file still needs them rewriting whenever it is next saved in full.
+		uint64_t version=writeVersion.load();
+		std::vector<unsigned> indices;
+		for(unsigned i=0; i<tilesSize*tilesSize/64; ++i) {
+			uint64_t bits=(logTileBits[i].load(std::memory_order_relaxed)!=0 ? logTileBits[i].exchange(0) : 0);
+			for(; bits!=0; bits&=bits-1)
+				indices.push_back(i*64+__builtin_ctzll(bits));
+		}
+		logTileCount.fetch_sub(indices.size());
+		bool objectsModified=logObjects.exchange(false);
+
+		// Append records.
 		bool result=true;
+		if (!indices.empty())
+			result&=appendLogTiles(log, regionX, regionY, indices);
+		if (result && objectsModified)
+			result&=appendLogObjects(log, regionX, regionY);
 
-		// Save tiles.
-		size_t tileCount=tilesSize*tilesSize;
-		result&=(fwrite(&tileFileData, sizeof(MapTile::FileData), tileCount, regionFile)==tileCount);
+		// If anything went wrong then we no longer know exactly what has been saved, so the whole region has to be saved instead.
+		if (result)
+			setSaved(version, 0);
+		else
+			logAll=true;
 
-		// Save objects.
-		result&=saveObjects(regionFile);
+		return result;
+	}
 
-		// Close file.
-		fclose(regionFile);
+	bool MapRegion::loadLog(MapLog *log, unsigned regionX, unsigned regionY) {
+		assert(log!=NULL);
 
-		// Potentially update 'isDirty' flag.
+		// Until every record has been applied the region does not match its file plus the log, so could only be saved in full.
+		logAll=true;
+
+		std::vector<MapLog::Record> records;
+		if (!log->getRecords(regionX, regionY, &records))
+			return false;
+
+		// Apply each record in turn.
+		uint32_t bands=0;
+		for(auto const &record: records) {
+			if (record.type==MapLog::RecordTiles) {
+				if (record.data.size()%sizeof(LogTile)!=0) {
+					fprintf(stderr,"error: region %u,%u has a log record with bad size %zu\n", regionX, regionY, record.data.size());
+					return false;
+				}
+
+				expandUniform();
+				const LogTile *tiles=(const LogTile *)record.data.data();
+				for(size_t i=0; i<record.data.size()/sizeof(LogTile); ++i) {
+					if (tiles[i].index>=tilesSize*tilesSize) {
+						fprintf(stderr,"error: region %u,%u has a log record with bad tile index %u\n", regionX, regionY, tiles[i].index);
+						return false;
+					}
+					setFileTile(tiles[i].index, &tiles[i].tile);
+					bands|=(1u<<(tiles[i].index/bandTileCount));
+				}
+			} else if (record.type==MapLog::RecordObjects) {
+				// Replace objects loaded from the file (or an earlier record).
+				for(auto *object: objects)
+					delete object;
+				objects.clear();
+				tileObjectsLock.lock();
+				tileObjects.clear();
+				tileObjectsLock.unlock();
+
+				if (record.data.empty())
+					continue;
+
+				FILE *objectsFile=fmemopen(const_cast<uint8_t *>(record.data.data()), record.data.size(), "r");
+				if (objectsFile==NULL)
+					return false;
+
+				bool result=true;
+				MapObject mapObject;
+				while(result && mapObject.load(objectsFile)) {
+					MapObject *newObject=new MapObject(mapObject);
+
+					if (!addObject(newObject)) {
+						delete newObject;
+						result=false;
+					}
+				}
+
+				fclose(objectsFile);
+				if (!result)
+					return false;
+			}
+		}
+
+		// As for loadFd, there is nothing new to save, although the file itself still lacks the modified bands (should it be saved in full, e.g. when the log is compacted).
+		isDirty=false;
+		dirtyBands=bands;
+		clearLog();
+
+		return true;
+	}
+
+	bool MapRegion::saveLogLatest(MapLog *log, unsigned regionX, unsigned regionY) {
+		assert(log!=NULL);
+
+		std::vector<MapLog::Record> records;
+		if (!log->getRecords(regionX, regionY, &records))
+			return false;
+
+		// Find every tile the records cover, and whether any hold objects.
+		std::vector<bool> covered(tilesSize*tilesSize, false);
+		std::vector<unsigned> indices;
+		bool hasObjects=false;
+		for(auto const &record: records) {
+			if (record.type==MapLog::RecordTiles) {
+				const LogTile *tiles=(const LogTile *)record.data.data();
+				for(size_t i=0; i<record.data.size()/sizeof(LogTile); ++i)
+					if (tiles[i].index<tilesSize*tilesSize && !covered[tiles[i].index]) {
+						covered[tiles[i].index]=true;
+						indices.push_back(tiles[i].index);
+					}
+			} else if (record.type==MapLog::RecordObjects)
+				hasObjects=true;
+		}
+
+		// Append their current state.
+		bool result=true;
+		if (!indices.empty())
+			result&=appendLogTiles(log, regionX, regionY, indices);
+		if (result && hasObjects)
+			result&=appendLogObjects(log, regionX, regionY);
+
+		return result;
+	}
+
+	bool MapRegion::loadFd(int fd, uint64_t offset, uint64_t size, const uint8_t *data, const char *name, bool isPack, bool readOnly) {
+		assert(name!=NULL);
+
+		// Read header.
+		// Note: files without a header are from before versioning was introduced and consist of raw uncompressed per-tile records followed by objects.
+		FileHeader header;
+		if (size<sizeof(header) || !readAt(fd, offset, data, 0, &header, sizeof(header)) || memcmp(header.magic, fileMagic, sizeof(fileMagic))!=0) {
+			memcpy(header.magic, fileMagic, sizeof(fileMagic));
+			header.version=0;
+			header.codec=MapCodec::None;
+			header.filter=MapCodec::FilterNone;
+			header.tileDataSize=sizeof(FileTile)*tilesSize*tilesSize;
+			header.encoding=EncodingFull;
+			header.tileDataOffset=0;
+			header.tileDataStoredSize=header.tileDataSize;
+		}
+
+		if (header.version<3)
+			header.encoding=EncodingFull;
+		if (header.version<4)
+			header.bands=0;
+		if (header.version<5)
+			header.flags=0;
+
+		size_t expectedTileDataSize=0;
+		if (header.version<=1)
+			expectedTileDataSize=sizeof(FileTile)*tilesSize*tilesSize;
+		else if (header.flags & FileFlagUniform)
+			expectedTileDataSize=(header.codec==MapCodec::None && header.bands==0 ? sizeof(FileTile) : 0);
+		else if (header.encoding<EncodingNB && header.bands==0)
+			expectedTileDataSize=getEncodedSize((Encoding)header.encoding, tilesSize*tilesSize);
+		else if (header.encoding<EncodingNB && header.bands==bandsCount)
+			expectedTileDataSize=bandsCount*getEncodedSize((Encoding)header.encoding, bandTileCount);
+		if (header.version>fileVersion || header.tileDataSize!=expectedTileDataSize || header.codec>=MapCodec::TypeNB || header.filter>=MapCodec::FilterNB || header.tileDataOffset+header.tileDataStoredSize>size) {
+			fprintf(stderr,"error: region file '%s' has unsupported format (version %u)\n", name, header.version);
+			return false;
+		}
+
+		if (!MapCodec::isAvailable((MapCodec::Type)header.codec)) {
+			fprintf(stderr,"error: region file '%s' uses codec '%s' which is not available in this build\n", name, MapCodec::typeToString((MapCodec::Type)header.codec));
+			return false;
+		}
+
+		// Read tile data.
+		// Note: files from older versions are converted to the current layout in memory, and only rewritten in the new format when next saved.
+		bool result=true;
+		fileBandsValid=false;
+		isUniform=false;
+		if (header.flags & FileFlagUniform) {
+			// Simply store the single tile (see getIsUniform).
+			FileTile tile;
+			result&=(header.tileDataOffset+sizeof(tile)<=size && readAt(fd, offset, data, header.tileDataOffset, &tile, sizeof(tile)));
+			if (result) {
+				setFileTile(0, &tile);
+				isUniform=true;
+			}
+		} else if (header.bands!=0)
+			result&=readTileDataBands(fd, offset, data, &header, isPack);
+		else if (header.version>=2 && header.encoding==EncodingFull && header.codec==MapCodec::None && (offset+header.tileDataOffset)%sysconf(_SC_PAGESIZE)==0)
+			// Map tile data directly from the file.
+			result&=mapFile(fd, offset+header.tileDataOffset, isPack, readOnly);
+		else
+			result&=readTileData(fd, offset, data, &header);
+
+		// Read object data (which follows the tile data).
+		uint64_t objectsOffset=header.tileDataOffset+header.tileDataStoredSize;
+		if (result && objectsOffset<size) {
+			size_t objectsSize=size-objectsOffset;
+			char *objectsData=(char *)malloc(objectsSize);
+			FILE *objectsFile=NULL;
+			result&=(objectsData!=NULL && readAt(fd, offset, data, objectsOffset, objectsData, objectsSize));
+			result&=(result && (objectsFile=fmemopen(objectsData, objectsSize, "r"))!=NULL);
+
+			MapObject mapObject;
+			while(result && mapObject.load(objectsFile)) {
+				MapObject *newObject=new MapObject(mapObject);
+
+				if (!addObject(newObject)) {
+					delete newObject;
+					result=false;
+				}
+			}
+
+			if (objectsFile!=NULL)
+				fclose(objectsFile);
+			free(objectsData);
+		}
+
+		// Adding objects marks the region dirty but there is nothing new to save.
+		// Note: modifications can only be saved via the log once there is a file to apply them to.
+		isDirty=false;
+		dirtyBands=0;
+		if (result)
+			clearLog();
+
+		return result;
+	}
+
+	bool MapRegion::writeFile(FILE *file, const FileFormat &format, FileHeader *header) {
+		assert(file!=NULL);
+		assert(header!=NULL);
+
+		bool result=true;
+
+		// Prepare header.
+		// Data which can be mapped when loaded (uncompressed and in the in-memory layout) is placed at a page boundary as a single block.
+		// Otherwise tile data is split into bands so that they can later be rewritten individually.
+		bool mappable=(format.codec==MapCodec::None && format.encoding==EncodingFull);
+
+		// Regions where every tile is identical only need to store a single tile (regardless of format).
+		if (getIsUniform() || checkIsUniform()) {
+			memcpy(header->magic, fileMagic, sizeof(fileMagic));
+			header->version=fileVersion;
+			header->codec=MapCodec::None;
+			header->filter=MapCodec::FilterNone;
+			header->tileDataSize=sizeof(FileTile);
+			header->encoding=EncodingFull;
+			header->bands=0;
+			header->flags=FileFlagUniform;
+			memset(header->reserved, 0, sizeof(header->reserved));
+			header->tileDataOffset=sizeof(*header);
+			header->tileDataStoredSize=header->tileDataSize;
+
+			FileTile tile=FileTile(); // value-initialized so that padding is written as zero
+			getFileTile(0, &tile);
+
+			result&=(fwrite(header, sizeof(*header), 1, file)==1);
+			result&=(result && fwrite(&tile, sizeof(tile), 1, file)==1);
+			result&=(result && saveObjects(file));
+
+			return result;
+		}
+
+		memcpy(header->magic, fileMagic, sizeof(fileMagic));
+		header->version=fileVersion;
+		header->codec=format.codec;
+		header->filter=(format.codec==MapCodec::None ? MapCodec::FilterNone : MapCodec::FilterWordDelta);
+		header->tileDataSize=(mappable ? tileFileDataSize : bandsCount*getEncodedSize(format.encoding, bandTileCount));
+		header->encoding=format.encoding;
+		header->bands=(mappable ? 0 : bandsCount);
+		header->flags=0;
+		memset(header->reserved, 0, sizeof(header->reserved));
+		header->tileDataOffset=(mappable ? sysconf(_SC_PAGESIZE) : sizeof(*header));
+		header->tileDataStoredSize=header->tileDataSize;
+
+		// Encode and compress each band, and then decide where they go.
+		uint8_t *bandData[bandsCount]={NULL};
+		if (!mappable) {
+			uint64_t bandOffset=header->tileDataOffset+sizeof(fileBands);
+			for(unsigned i=0; i<bandsCount; ++i) {
+				size_t bandSize=0;
+				result&=(result && encodeBand(format, i, &bandData[i], &bandSize));
+
+				fileBands[i].offset=bandOffset;
+				fileBands[i].storedSize=bandSize;
+				fileBands[i].capacity=getBandCapacity(bandSize);
+				bandOffset+=fileBands[i].capacity;
+			}
+
+			header->tileDataStoredSize=bandOffset-header->tileDataOffset;
+			fileBandsTableOffset=header->tileDataOffset;
+			fileObjectsOffset=bandOffset;
+		}
+
+		// Save header, tiles and objects.
+		// Note: padding is written (rather than seeking) as seeking would not extend memory streams.
+		static const uint8_t zeros[4096]={0};
+		auto writePadding=[&](size_t size) {
+			while(size>0 && result) {
+				size_t chunk=std::min(size, sizeof(zeros));
+				result&=(fwrite(zeros, 1, chunk, file)==chunk);
+				size-=chunk;
+			}
+		};
+
+		result&=(result && fwrite(header, sizeof(*header), 1, file)==1);
+		if (mappable) {
+			writePadding(header->tileDataOffset-sizeof(*header));
+			result&=(result && fwrite(tileFileData, 1, tileFileDataSize, file)==tileFileDataSize);
+		} else {
+			result&=(result && fwrite(fileBands, sizeof(fileBands), 1, file)==1);
+			for(unsigned i=0; i<bandsCount && result; ++i) {
+				result&=(fwrite(bandData[i], 1, fileBands[i].storedSize, file)==fileBands[i].storedSize);
+				writePadding(fileBands[i].capacity-fileBands[i].storedSize);
+			}
+		}
+		for(unsigned i=0; i<bandsCount; ++i)
+			free(bandData[i]);
+
+		result&=(result && saveObjects(file));
+
+		return result;
+	}
+
+	bool MapRegion::mapFile(int fd, uint64_t offset, bool isPack, bool readOnly) {
+		// Ensure the file is large enough to contain the tile data.
+		struct stat regionStat;
+		if (fstat(fd, &regionStat)!=0 || (uint64_t)regionStat.st_size<offset+tileFileDataSize)
+			return false;
+
+		// Map file over the existing file data mapping.
+		// Note: private mappings share pages with the page cache (and so with other processes mapping the same file) until written to, at which point the page is copied.
+		void *fileData=mmap(tileFileData, tileFileDataSize, PROT_READ|PROT_WRITE, (readOnly ? MAP_PRIVATE : MAP_SHARED)|MAP_FIXED, fd, offset);
+		if (fileData==MAP_FAILED)
+			return false;
+		assert(fileData==tileFileData);
+
+		tileFileDataIsFile=!readOnly;
+		tileFileDataIsPack=(isPack && !readOnly);
+		tileFileDataIsAnonymous=false;
+		tileFileDataOffset=(readOnly ? 0 : offset);
+		isUniform=false;
+
+		return true;
+	}
+
+	bool MapRegion::unmapFile(void) {
+		assert(tileFileDataIsFile);
+
+		// Copy tile data into a new anonymous mapping and then move that over the file mapping.
+		void *fileData=mmap(NULL, tileFileDataSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (fileData==MAP_FAILED)
+			return false;
+		memcpy(fileData, tileFileData, tileFileDataSize);
+
+		if (mremap(fileData, tileFileDataSize, tileFileDataSize, MREMAP_MAYMOVE|MREMAP_FIXED, tileFileData)==MAP_FAILED) {
+			munmap(fileData, tileFileDataSize);
+			return false;
+		}
+
+		tileFileDataIsFile=false;
+		tileFileDataIsPack=false;
+		tileFileDataIsAnonymous=true;
+		tileFileDataOffset=0;
+
+		return true;
+	}
+
+	bool MapRegion::readTileData(int fd, uint64_t offset, const uint8_t *data, const FileHeader *header) {
+		assert(header!=NULL);
+
+		// Read stored tile data.
+		uint8_t *storedData=(uint8_t *)malloc(header->tileDataStoredSize);
+		if (storedData==NULL)
+			return false;
+
+		if (!readAt(fd, offset, data, header->tileDataOffset, storedData, header->tileDataStoredSize)) {
+			free(storedData);
+			return false;
+		}
+
+		// Decompress and reverse filter.
+		// Per-tile records from older versions and compact encodings are decoded into a temporary buffer and then converted.
+		bool isV1=(header->version<=1);
+		bool isEncoded=(isV1 || header->encoding!=EncodingFull);
+		uint8_t *tileData=(isEncoded ? (uint8_t *)malloc(header->tileDataSize) : (uint8_t *)tileFileData);
+		uint8_t *filteredData=(header->filter!=MapCodec::FilterNone ? (uint8_t *)malloc(header->tileDataSize) : tileData);
+
+		bool result=(tileData!=NULL && filteredData!=NULL);
+		result&=(result && MapCodec::decompress((MapCodec::Type)header->codec, storedData, header->tileDataStoredSize, filteredData, header->tileDataSize));
+		if (result && header->filter!=MapCodec::FilterNone) {
+			if (isV1)
+				MapCodec::filterDecode((MapCodec::Filter)header->filter, filteredData, tileData, sizeof(FileTile), tilesSize*tilesSize);
+			else
+				filterTileData(false, (Encoding)header->encoding, (MapCodec::Filter)header->filter, tilesSize*tilesSize, filteredData, tileData);
+		}
+		if (result && isV1)
+			convertFileDataV1((const FileTile *)tileData);
+		else if (result && isEncoded)
+			decodeTileData((Encoding)header->encoding, 0, tilesSize*tilesSize, tileData);
+
+		if (filteredData!=tileData)
+			free(filteredData);
+		if (isEncoded)
+			free(tileData);
+		free(storedData);
+
+		return result;
+	}
+
+	bool MapRegion::readTileDataBands(int fd, uint64_t offset, const uint8_t *data, const FileHeader *header, bool isPack) {
+		assert(header!=NULL);
+		assert(header->bands==bandsCount);
+
+		// Read and check band table.
+		FileBand bands[bandsCount];
+		if (header->tileDataStoredSize<sizeof(bands) || !readAt(fd, offset, data, header->tileDataOffset, bands, sizeof(bands)))
+			return false;
+
+		for(unsigned i=0; i<bandsCount; ++i)
+			if (bands[i].offset<header->tileDataOffset+sizeof(bands) || bands[i].storedSize>bands[i].capacity || bands[i].offset+bands[i].capacity>header->tileDataOffset+header->tileDataStoredSize)
+				return false;
+
+		// Read, decompress, reverse filter and decode each band in turn.
+		size_t encodedSize=getEncodedSize((Encoding)header->encoding, bandTileCount);
+		uint8_t *storedData=NULL;
+		uint8_t *encodedData=(uint8_t *)malloc(encodedSize);
+		uint8_t *filteredData=(header->filter!=MapCodec::FilterNone ? (uint8_t *)malloc(encodedSize) : encodedData);
+
+		bool result=(encodedData!=NULL && filteredData!=NULL);
+		for(unsigned i=0; i<bandsCount && result; ++i) {
+			uint8_t *newStoredData=(uint8_t *)realloc(storedData, std::max(bands[i].storedSize, (uint32_t)1));
+			if (newStoredData==NULL) {
+				result=false;
+				break;
+			}
+			storedData=newStoredData;
+
+			result&=readAt(fd, offset, data, bands[i].offset, storedData, bands[i].storedSize);
+			result&=(result && MapCodec::decompress((MapCodec::Type)header->codec, storedData, bands[i].storedSize, filteredData, encodedSize));
+			if (!result)
+				break;
+
+			if (header->filter!=MapCodec::FilterNone)
+				filterTileData(false, (Encoding)header->encoding, (MapCodec::Filter)header->filter, bandTileCount, filteredData, encodedData);
+			decodeTileData((Encoding)header->encoding, i*bandTileCount, bandTileCount, encodedData);
+		}
+
+		if (filteredData!=encodedData)
+			free(filteredData);
+		free(encodedData);
+		free(storedData);
+
+		// Remember band layout so that dirty bands can be rewritten in place, as long as they would be filtered in the same way as we do when writing.
+		MapCodec::Filter filter=(header->codec==MapCodec::None ? MapCodec::FilterNone : MapCodec::FilterWordDelta);
+		if (result && header->filter==filter) {
+			memcpy(fileBands, bands, sizeof(bands));
+			fileBandsValid=true;
+			fileBandsIsPack=isPack;
+			fileBandsFormat.codec=(MapCodec::Type)header->codec;
+			fileBandsFormat.encoding=(Encoding)header->encoding;
+			fileBandsTableOffset=header->tileDataOffset;
+			fileObjectsOffset=header->tileDataOffset+header->tileDataStoredSize;
+		}
+
+		return result;
+	}
+
+	bool MapRegion::patchFile(int fd, MapPack *pack, unsigned regionX, unsigned regionY, const FileFormat &format, uint32_t bands) {
+		assert(fileBandsValid);
+
+		// If every band is dirty then writing the region afresh costs about the same, and also resets each band's spare capacity.
+		if (bands==(1u<<bandsCount)-1)
+			return false;
+
+		// Encode dirty bands and objects first so that nothing is written unless it all fits.
+		uint8_t *bandData[bandsCount]={NULL};
+		size_t bandSizes[bandsCount]={0};
+		bool result=true;
+		for(unsigned i=0; i<bandsCount && result; ++i)
+			if (bands & (1u<<i))
+				result&=(encodeBand(format, i, &bandData[i], &bandSizes[i]) && bandSizes[i]<=fileBands[i].capacity);
+
+		char *objectsData=NULL;
+		size_t objectsSize=0;
+		FILE *objectsFile=open_memstream(&objectsData, &objectsSize);
+		if (objectsFile!=NULL) {
+			result&=saveObjects(objectsFile);
+			fclose(objectsFile);
+		} else
+			result=false;
+
+		// Find region file within pack.
+		uint64_t base=0;
+		if (result && pack!=NULL) {
+			MapPack::Extent extent;
+			result&=(pack->getExtent(regionX, regionY, &extent) && fileObjectsOffset+objectsSize<=extent.capacity);
+			base=extent.offset;
+		}
+
+		// Write bands, then the updated band table and finally objects (which are always last in the file).
+		FileBand newBands[bandsCount];
+		memcpy(newBands, fileBands, sizeof(newBands));
+		for(unsigned i=0; i<bandsCount && result; ++i)
+			if (bands & (1u<<i)) {
+				result&=writeAt(fd, pack, regionX, regionY, base+fileBands[i].offset, bandData[i], bandSizes[i], false);
+				newBands[i].storedSize=bandSizes[i];
+			}
+		result&=(result && writeAt(fd, pack, regionX, regionY, base+fileBandsTableOffset, newBands, sizeof(newBands), false));
+		result&=(result && writeAt(fd, pack, regionX, regionY, base+fileObjectsOffset, objectsData, objectsSize, true));
+
+		for(unsigned i=0; i<bandsCount; ++i)
+			free(bandData[i]);
+		free(objectsData);
+
+		// If anything went wrong the file may now be inconsistent, so the caller must write it afresh.
 		if (result)
-			isDirty=false;
+			memcpy(fileBands, newBands, sizeof(fileBands));
+		else
+			fileBandsValid=false;
 
 		return result;
 	}
 
+	bool MapRegion::writeAt(int fd, MapPack *pack, unsigned regionX, unsigned regionY, uint64_t offset, const void *data, size_t size, bool isEnd) {
+		if (pack!=NULL)
+			return pack->writeInPlace(regionX, regionY, offset, (const uint8_t *)data, size, isEnd);
+
+		if (size>0 && pwrite(fd, data, size, offset)!=(ssize_t)size)
+			return false;
+
+		return (!isEnd || ftruncate(fd, offset+size)==0);
+	}
+
+	bool MapRegion::readAt(int fd, uint64_t offset, const uint8_t *data, uint64_t pos, void *dst, size_t size) {
+		// Note: callers have already checked that pos+size is within the region's size.
+		if (data!=NULL) {
+			memcpy(dst, data+pos, size);
+			return true;
+		}
+
+		return (pread(fd, dst, size, offset+pos)==(ssize_t)size);
+	}
+
+	bool MapRegion::encodeBand(const FileFormat &format, unsigned band, uint8_t **data, size_t *size) const {
+		assert(band<bandsCount);
+		assert(data!=NULL);
+		assert(size!=NULL);
+
+		size_t encodedSize=getEncodedSize(format.encoding, bandTileCount);
+		size_t compressedCapacity=MapCodec::compressBound(format.codec, encodedSize);
+		uint8_t *encodedData=(uint8_t *)malloc(encodedSize);
+		uint8_t *filteredData=(uint8_t *)malloc(encodedSize);
+		uint8_t *compressedData=(uint8_t *)malloc(compressedCapacity);
+
+		bool result=(encodedData!=NULL && filteredData!=NULL && compressedData!=NULL);
+		if (result) {
+			MapCodec::Filter filter=(format.codec==MapCodec::None ? MapCodec::FilterNone : MapCodec::FilterWordDelta);
+			encodeTileData(format.encoding, band*bandTileCount, bandTileCount, encodedData);
+			filterTileData(true, format.encoding, filter, bandTileCount, encodedData, filteredData);
+			result&=MapCodec::compress(format.codec, filteredData, encodedSize, compressedData, compressedCapacity, size);
+		}
+
+		free(encodedData);
+		free(filteredData);
+
+		if (!result) {
+			free(compressedData);
+			return false;
+		}
+
+		*data=compressedData;
+
+		return true;
+	}
+
+	const char *MapRegion::encodingToString(Encoding encoding) {
+		switch(encoding) {
+			case EncodingFull: return "full"; break;
+			case EncodingFloat: return "float"; break;
+			case EncodingQuantized: return "quantized"; break;
+			case EncodingNB: break;
+		}
+
+		return "unknown";
+	}
+
+	bool MapRegion::encodingFromString(const char *str, Encoding *encoding) {
+		assert(str!=NULL);
+		assert(encoding!=NULL);
+
+		for(int i=0; i<EncodingNB; ++i)
+			if (strcmp(str, encodingToString((Encoding)i))==0) {
+				*encoding=(Encoding)i;
+				return true;
+			}
+
+		return false;
+	}
+
+	unsigned MapRegion::getFilePlanes(Encoding encoding, size_t tileCount, FilePlane planes[filePlanesMax]) {
+		assert(tileCount%4==0);
+
+		// Build list of planes in the order they appear.
+		// Planes of small fields are treated as 8 byte records containing several tiles.
+		// Note: all plane sizes are multiples of 8 so there is no padding between them.
+		unsigned count=0;
+		size_t offset=0;
+		auto addPlane=[&](size_t size, size_t recordSize) {
+			assert(count<filePlanesMax);
+			assert(size%recordSize==0);
+			planes[count].offset=offset;
+			planes[count].size=size;
+			planes[count].recordSize=recordSize;
+			offset+=size;
+			++count;
+		};
+
+		switch(encoding) {
+			case EncodingFull:
+				addPlane(tileCount*sizeof(MapTile::FileData::layers[0]), sizeof(MapTile::FileData::layers[0]));
+				addPlane(tileCount*sizeof(MapTile::FileData::height[0]), 8);
+				addPlane(tileCount*sizeof(MapTile::FileData::moisture[0]), 8);
+				addPlane(tileCount*sizeof(MapTile::FileData::temperature[0]), 8);
+				addPlane(tileCount*sizeof(MapTile::FileData::bitset[0]), 8);
+				addPlane(tileCount*sizeof(MapTile::FileData::scratch[0]), 8);
+				addPlane(tileCount*sizeof(MapTile::FileData::landmassId[0]), 8);
+				assert(tileCount!=tilesSize*tilesSize || offset==tileFileDataSize);
+			break;
+			case EncodingFloat:
+			case EncodingQuantized: {
+				size_t valueSize=(encoding==EncodingFloat ? sizeof(float) : sizeof(uint16_t));
+				if (encoding==EncodingQuantized)
+					addPlane(6*sizeof(double), 8); // min/max pairs for height, moisture and temperature
+				addPlane(tileCount*MapTile::layersMax*sizeof(MapTexture::Id), MapTile::layersMax*sizeof(MapTexture::Id)); // texture ids
+				addPlane(tileCount*MapTile::layersMax*sizeof(uint64_t), MapTile::layersMax*sizeof(uint64_t)); // hitmasks
+				addPlane(tileCount*valueSize, 8); // height
+				addPlane(tileCount*valueSize, 8); // moisture
+				addPlane(tileCount*valueSize, 8); // temperature
+				addPlane(tileCount*sizeof(uint64_t), 8); // bitset
+				addPlane(tileCount*sizeof(uint32_t), 8); // scratch
+				addPlane(tileCount*sizeof(uint16_t), 8); // landmassId
+			} break;
+			case EncodingNB:
+				assert(false);
+			break;
+		}
+
+		return count;
+	}
+
+	size_t MapRegion::getEncodedSize(Encoding encoding, size_t tileCount) {
+		FilePlane planes[filePlanesMax];
+		unsigned count=getFilePlanes(encoding, tileCount, planes);
+		return planes[count-1].offset+planes[count-1].size;
+	}
+
+	uint32_t MapRegion::getBandCapacity(size_t storedSize) {
+		// Leave an extra eighth so that a band which compresses slightly worse after an edit can usually still be rewritten in place.
+		return ((storedSize+storedSize/8+511)/512)*512;
+	}
+
+	void MapRegion::filterTileData(bool encode, Encoding encoding, MapCodec::Filter filter, size_t tileCount, const uint8_t *src, uint8_t *dst) {
+		assert(src!=NULL);
+		assert(dst!=NULL);
+
+		// Filter each plane separately so that (for example) heights are only compared with other heights.
+		FilePlane planes[filePlanesMax];
+		unsigned count=getFilePlanes(encoding, tileCount, planes);
+		for(unsigned i=0; i<count; ++i) {
+			if (encode)
+				MapCodec::filterEncode(filter, src+planes[i].offset, dst+planes[i].offset, planes[i].recordSize, planes[i].size/planes[i].recordSize);
+			else
+				MapCodec::filterDecode(filter, src+planes[i].offset, dst+planes[i].offset, planes[i].recordSize, planes[i].size/planes[i].recordSize);
+		}
+	}
+
+	void MapRegion::encodeTileData(Encoding encoding, size_t firstTile, size_t tileCount, uint8_t *dst) const {
+		assert(encoding<EncodingNB);
+		assert(firstTile+tileCount<=tilesSize*tilesSize);
+		assert(dst!=NULL);
+
+		FilePlane planes[filePlanesMax];
+		getFilePlanes(encoding, tileCount, planes);
+		const FilePlane *plane=planes;
+		const MapTile::FileData *src=tileFileData;
+
+		// Full encoding is simply the given range of each field.
+		if (encoding==EncodingFull) {
+			memcpy(dst+(plane++)->offset, src->layers+firstTile, tileCount*sizeof(src->layers[0]));
+			memcpy(dst+(plane++)->offset, src->height+firstTile, tileCount*sizeof(src->height[0]));
+			memcpy(dst+(plane++)->offset, src->moisture+firstTile, tileCount*sizeof(src->moisture[0]));
+			memcpy(dst+(plane++)->offset, src->temperature+firstTile, tileCount*sizeof(src->temperature[0]));
+			memcpy(dst+(plane++)->offset, src->bitset+firstTile, tileCount*sizeof(src->bitset[0]));
+			memcpy(dst+(plane++)->offset, src->scratch+firstTile, tileCount*sizeof(src->scratch[0]));
+			memcpy(dst+(plane++)->offset, src->landmassId+firstTile, tileCount*sizeof(src->landmassId[0]));
+			return;
+		}
+
+		// Calculate ranges for quantization.
+		const double *valueArrays[3]={src->height+firstTile, src->moisture+firstTile, src->temperature+firstTile};
+		double ranges[3][2];
+		if (encoding==EncodingQuantized) {
+			for(unsigned j=0; j<3; ++j) {
+				ranges[j][0]=ranges[j][1]=valueArrays[j][0];
+				for(size_t i=1; i<tileCount; ++i) {
+					ranges[j][0]=std::min(ranges[j][0], valueArrays[j][i]);
+					ranges[j][1]=std::max(ranges[j][1], valueArrays[j][i]);
+				}
+			}
+			memcpy(dst+(plane++)->offset, ranges, sizeof(ranges));
+		}
+
+		// Layers.
+		MapTexture::Id *textureIds=(MapTexture::Id *)(dst+(plane++)->offset);
+		uint64_t *hitmasks=(uint64_t *)(dst+(plane++)->offset);
+		for(size_t i=0; i<tileCount; ++i)
+			for(unsigned z=0; z<MapTile::layersMax; ++z) {
+				textureIds[i*MapTile::layersMax+z]=src->layers[firstTile+i][z].textureId;
+				hitmasks[i*MapTile::layersMax+z]=src->layers[firstTile+i][z].hitmask.getBitset();
+			}
+
+		// Height, moisture and temperature.
+		for(unsigned j=0; j<3; ++j) {
+			uint8_t *values=dst+(plane++)->offset;
+			if (encoding==EncodingFloat) {
+				for(size_t i=0; i<tileCount; ++i)
+					((float *)values)[i]=valueArrays[j][i];
+			} else {
+				double scale=(ranges[j][1]>ranges[j][0] ? 65535.0/(ranges[j][1]-ranges[j][0]) : 0.0);
+				for(size_t i=0; i<tileCount; ++i)
+					((uint16_t *)values)[i]=lround((valueArrays[j][i]-ranges[j][0])*scale);
+			}
+		}
+
+		// Remaining fields are stored as-is.
+		memcpy(dst+(plane++)->offset, src->bitset+firstTile, tileCount*sizeof(src->bitset[0]));
+		memcpy(dst+(plane++)->offset, src->scratch+firstTile, tileCount*sizeof(src->scratch[0]));
+		memcpy(dst+(plane++)->offset, src->landmassId+firstTile, tileCount*sizeof(src->landmassId[0]));
+	}
+
+	void MapRegion::decodeTileData(Encoding encoding, size_t firstTile, size_t tileCount, const uint8_t *src) {
+		assert(encoding<EncodingNB);
+		assert(firstTile+tileCount<=tilesSize*tilesSize);
+		assert(src!=NULL);
+
+		FilePlane planes[filePlanesMax];
+		getFilePlanes(encoding, tileCount, planes);
+		const FilePlane *plane=planes;
+		MapTile::FileData *dst=tileFileData;
+
+		if (encoding==EncodingFull) {
+			memcpy(dst->layers+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->layers[0]));
+			memcpy(dst->height+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->height[0]));
+			memcpy(dst->moisture+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->moisture[0]));
+			memcpy(dst->temperature+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->temperature[0]));
+			memcpy(dst->bitset+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->bitset[0]));
+			memcpy(dst->scratch+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->scratch[0]));
+			memcpy(dst->landmassId+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->landmassId[0]));
+			return;
+		}
+
+		double ranges[3][2];
+		if (encoding==EncodingQuantized)
+			memcpy(ranges, src+(plane++)->offset, sizeof(ranges));
+
+		// Layers.
+		const MapTexture::Id *textureIds=(const MapTexture::Id *)(src+(plane++)->offset);
+		const uint64_t *hitmasks=(const uint64_t *)(src+(plane++)->offset);
+		for(size_t i=0; i<tileCount; ++i)
+			for(unsigned z=0; z<MapTile::layersMax; ++z) {
+				dst->layers[firstTile+i][z].textureId=textureIds[i*MapTile::layersMax+z];
+				dst->layers[firstTile+i][z].hitmask=HitMask(hitmasks[i*MapTile::layersMax+z]);
+			}
+
+		// Height, moisture and temperature.
+		double *valueArrays[3]={dst->height+firstTile, dst->moisture+firstTile, dst->temperature+firstTile};
+		for(unsigned j=0; j<3; ++j) {
+			const uint8_t *values=src+(plane++)->offset;
+			if (encoding==EncodingFloat) {
+				for(size_t i=0; i<tileCount; ++i)
+					valueArrays[j][i]=((const float *)values)[i];
+			} else {
+				double scale=(ranges[j][1]-ranges[j][0])/65535.0;
+				for(size_t i=0; i<tileCount; ++i)
+					valueArrays[j][i]=ranges[j][0]+((const uint16_t *)values)[i]*scale;
+			}
+		}
+
+		// Remaining fields.
+		memcpy(dst->bitset+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->bitset[0]));
+		memcpy(dst->scratch+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->scratch[0]));
+		memcpy(dst->landmassId+firstTile, src+(plane++)->offset, tileCount*sizeof(dst->landmassId[0]));
+	}
+
+	void MapRegion::convertFileDataV1(const FileTile *src) {
+		assert(src!=NULL);
+
+		for(unsigned i=0; i<tilesSize*tilesSize; ++i)
+			setFileTile(i, &src[i]);
+	}
+
+	void MapRegion::getFileTile(unsigned index, FileTile *dst) const {
+		assert(index<tilesSize*tilesSize);
+		assert(dst!=NULL);
+
+		for(unsigned z=0; z<MapTile::layersMax; ++z)
+			dst->layers[z]=tileFileData->layers[index][z];
+		dst->height=tileFileData->height[index];
+		dst->moisture=tileFileData->moisture[index];
+		dst->temperature=tileFileData->temperature[index];
+		dst->bitset=tileFileData->bitset[index];
+		dst->scratchInt=tileFileData->scratch[index].scratchInt;
+		dst->landmassId=tileFileData->landmassId[index];
+	}
+
+	void MapRegion::setFileTile(unsigned index, const FileTile *src) {
+		assert(index<tilesSize*tilesSize);
+		assert(src!=NULL);
+
+		for(unsigned z=0; z<MapTile::layersMax; ++z)
+			tileFileData->layers[index][z]=src->layers[z];
+		tileFileData->height[index]=src->height;
+		tileFileData->moisture[index]=src->moisture;
+		tileFileData->temperature[index]=src->temperature;
+		tileFileData->bitset[index]=src->bitset;
+		tileFileData->scratch[index].scratchInt=src->scratchInt;
+		tileFileData->landmassId[index]=src->landmassId;
+	}
+
 	bool MapRegion::saveObjects(FILE *regionFile) {
 		assert(regionFile!=NULL);
 
@@ -94,6 +1279,76 @@ namespace Engine {
 		return true;
 	}
 
+	void MapRegion::clearLog(void) {
+		for(unsigned i=0; i<tilesSize*tilesSize/64; ++i)
+			logTileBits[i].store(0, std::memory_order_relaxed);
+		logTileCount=0;
+		logObjects=false;
+		logAll=false;
+	}
+
+	void MapRegion::setSaved(uint64_t version, uint32_t bands) {
+		// Tiles are marked dirty before being written, so any marked during the save may have been saved as they were before (and their marks taken with them).
+		// In which case save them again next time, in full as the log only holds tiles marked since.
+		// Note: setDirty and friends set isDirty after updating writeVersion (and logObjects), while here it is cleared before checking them, so that a concurrent modification can never be lost.
+		isDirty=false;
+		if (writeVersion.load()!=version || writersActive.load()>0) {
+			dirtyBands.fetch_or(bands);
+			logAll=true;
+			isDirty=true;
+		} else if (logObjects.load())
+			isDirty=true;
+	}
+
+	bool MapRegion::appendLogTiles(MapLog *log, unsigned regionX, unsigned regionY, const std::vector<unsigned> &indices) const {
+		assert(log!=NULL);
+
+		// Uniform regions only hold tile 0 (which applies to every tile).
+		bool uniform=getIsUniform();
+
+		std::vector<LogTile> tiles(indices.size()); // value-initialized, so padding is logged as zero
+		for(size_t i=0; i<indices.size(); ++i) {
+			assert(indices[i]<tilesSize*tilesSize);
+			tiles[i].index=indices[i];
+			getFileTile(uniform ? 0 : indices[i], &tiles[i].tile);
+		}
+
+		return log->append(regionX, regionY, MapLog::RecordTiles, (const uint8_t *)tiles.data(), tiles.size()*sizeof(LogTile));
+	}
+
+	bool MapRegion::appendLogObjects(MapLog *log, unsigned regionX, unsigned regionY) {
+		assert(log!=NULL);
+
+		char *objectsData=NULL;
+		size_t objectsSize=0;
+		FILE *objectsFile=open_memstream(&objectsData, &objectsSize);
+		if (objectsFile==NULL)
+			return false;
+
+		bool result=saveObjects(objectsFile);
+		fclose(objectsFile);
+
+		result&=(result && log->append(regionX, regionY, MapLog::RecordObjects, (const uint8_t *)objectsData, objectsSize));
+		free(objectsData);
+
+		return result;
+	}
+
+	MapTile::FileData *MapRegion::getTileFileData(void) {
+		expandUniform();
+		return tileFileData;
+	}
+
+	const MapTile::FileData *MapRegion::getTileFileData(void) const {
+		expandUniform();
+		return tileFileData;
+	}
+
+	size_t MapRegion::getMemoryUsageEstimate(void) {
+		// Note: this excludes tile instances which are created later as needed.
+		return sizeof(MapRegion)+tileFileDataSize;
+	}
+
 	MapTile *MapRegion::getTileAtCoordVec(const CoordVec &vec) {
 		CoordComponent tileX=vec.x/CoordsPerTile;
 		CoordComponent tileY=vec.y/CoordsPerTile;
@@ -120,24 +1375,139 @@ namespace Engine {
 		assert(offsetX>=0 && offsetX<tilesSize*CoordsPerTile);
 		assert(offsetY>=0 && offsetY<tilesSize*CoordsPerTile);
 
-		return &tileInstances[offsetY][offsetX];
+		expandUniform();
+		return &getTileInstances(offsetY/bandRows)[(offsetY%bandRows)*tilesSize+offsetX];
 	}
 
 	const MapTile *MapRegion::getTileAtOffset(unsigned offsetX, unsigned offsetY) const  {
 		assert(offsetX>=0 && offsetX<tilesSize*CoordsPerTile);
 		assert(offsetY>=0 && offsetY<tilesSize*CoordsPerTile);
 
-		return &tileInstances[offsetY][offsetX];
+		expandUniform();
+		return &getTileInstances(offsetY/bandRows)[(offsetY%bandRows)*tilesSize+offsetX];
 	}
 
 	bool MapRegion::getIsDirty(void) const {
 		return isDirty;
 	}
 
+	bool MapRegion::getIsUniform(void) const {
+		return isUniform.load(std::memory_order_acquire);
+	}
+
+	const MapTile *MapRegion::getUniformTile(void) const {
+		assert(getIsUniform());
+		return &uniformTile;
+	}
+
+	size_t MapRegion::getMemoryUsage(void) const {
+		size_t usage=sizeof(MapRegion)+tileFileDataSize+objects.capacity()*sizeof(MapObject *)+objects.size()*sizeof(MapObject);
+
+		for(unsigned i=0; i<bandsCount; ++i)
+			if (tileInstances[i].load(std::memory_order_relaxed)!=NULL)
+				usage+=bandTileCount*sizeof(MapTile);
+
+		tileObjectsLock.lock();
+		usage+=tileObjects.size()*(sizeof(unsigned)+sizeof(TileObjects)+2*sizeof(void *)); // rough allowance for hash table nodes
+		tileObjectsLock.unlock();
+
+		// Include latest snapshot, as we keep it alive.
+		usage+=getSnapshotMemoryUsage();
+
+		return usage;
+	}
+
+	size_t MapRegion::getSnapshotMemoryUsage(void) const {
+		return snapshotBytes.load(std::memory_order_relaxed);
+	}
+
+	uint64_t MapRegion::getVersion(void) const {
+		return writeVersion.load(std::memory_order_acquire);
+	}
+
 	void MapRegion::setDirty(void) {
+		dirtyBands=(1u<<bandsCount)-1;
+		logAll=true;
+		writeVersion.fetch_add(1);
 		isDirty=true;
 	}
 
+	void MapRegion::setDirtyAtOffset(unsigned offsetX, unsigned offsetY) {
+		assert(offsetX<tilesSize);
+		assert(offsetY<tilesSize);
+
+		dirtyBands.fetch_or(1u<<(offsetY/bandRows));
+
+		// Track the tile itself for the log (unless the whole region needs saving anyway).
+		// Note: the bit is checked before setting it as the same tiles tend to be marked over and over.
+		if (!logAll.load(std::memory_order_relaxed)) {
+			unsigned index=offsetY*tilesSize+offsetX;
+			uint64_t mask=((uint64_t)1)<<(index%64);
+			std::atomic<uint64_t> *bits=&logTileBits[index/64];
+			if (!(bits->load(std::memory_order_relaxed) & mask) && !(bits->fetch_or(mask) & mask))
+				logTileCount.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		writeVersion.fetch_add(1);
+		isDirty=true; // after the above, see setSaved
+	}
+
+	void MapRegion::beginWrite(void) {
+		// If this is the only writer and a reader is still using a snapshot which is out of date, take a new one before anything changes.
+		// This way readers arriving while we write get data which is as recent as possible (rather than waiting or getting an even older copy).
+		if (writersActive.fetch_add(1)==0) {
+			std::lock_guard<std::mutex> guard(snapshotLock);
+			uint64_t version=writeVersion.load();
+			if (snapshot!=NULL && snapshot->version!=version && snapshot->refCount.load()>1) {
+				Snapshot *newSnapshot=createSnapshot(version, 1);
+				if (newSnapshot!=NULL)
+					setSnapshot(newSnapshot);
+			}
+		}
+
+		// Ensure snapshots being taken see writersActive change before they can see any of our modifications.
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void MapRegion::endWrite(void) {
+		assert(writersActive.load()>0);
+
+		writersActive.fetch_sub(1);
+	}
+
+	const MapRegion::Snapshot *MapRegion::getSnapshot(void) const {
+		std::unique_lock<std::mutex> guard(snapshotLock);
+
+		// Loop until we have a snapshot (usually just once).
+		while(1) {
+			// Latest snapshot still up to date?
+			uint64_t version=writeVersion.load();
+			if (snapshot!=NULL && snapshot->version==version)
+				break;
+
+			// Take a new snapshot, unless writes are in progress.
+			if (writersActive.load()==0) {
+				Snapshot *newSnapshot=createSnapshot(version, 0);
+				if (newSnapshot!=NULL) {
+					setSnapshot(newSnapshot);
+					break;
+				}
+			}
+
+			// Otherwise use the latest snapshot even if it is out of date, or if there is none then wait for the writes to finish.
+			// Note: the lock is released while waiting as beginWrite may need it.
+			if (snapshot!=NULL)
+				break;
+
+			guard.unlock();
+			std::this_thread::yield();
+			guard.lock();
+		}
+
+		snapshot->refCount.fetch_add(1);
+		return snapshot;
+	}
+
 	bool MapRegion::addObject(MapObject *object) {
 		assert(object!=NULL);
 
@@ -179,7 +1549,8 @@ namespace Engine {
 				getTileAtCoordVec(vec)->addObject(object);
 
 		// Mark region dirty.
-		setDirty();
+		// Note: objects are saved separately from tile data so no bands need rewriting.
+		isDirty=true;
 
 		return true;
 	}
@@ -193,7 +1564,9 @@ namespace Engine {
 		objects.push_back(object);
 
 		// Mark region dirty.
-		setDirty();
+		// Note: objects are saved separately from tile data so no bands need rewriting.
+		logObjects=true;
+		isDirty=true;
 	}
 
 	void MapRegion::disownObject(MapObject *object) {
@@ -209,6 +1582,243 @@ namespace Engine {
 		}
 
 		// Mark region dirty.
-		setDirty();
+		// Note: objects are saved separately from tile data so no bands need rewriting.
+		logObjects=true;
+		isDirty=true;
+	}
+
+	const MapObject *MapRegion::getTileObject(unsigned tileIndex, unsigned n) const {
+		assert(tileIndex<tilesSize*tilesSize);
+
+		std::lock_guard<std::mutex> guard(tileObjectsLock);
+		auto iter=tileObjects.find(tileIndex);
+		assert(iter!=tileObjects.end() && n<iter->second.count);
+
+		return iter->second.objects[n];
+	}
+
+	unsigned MapRegion::getTileObjectCount(unsigned tileIndex) const {
+		assert(tileIndex<tilesSize*tilesSize);
+
+		std::lock_guard<std::mutex> guard(tileObjectsLock);
+		auto iter=tileObjects.find(tileIndex);
+
+		return (iter!=tileObjects.end() ? iter->second.count : 0);
+	}
+
+	bool MapRegion::addTileObject(unsigned tileIndex, MapObject *object) {
+		assert(tileIndex<tilesSize*tilesSize);
+		assert(object!=NULL);
+
+		std::lock_guard<std::mutex> guard(tileObjectsLock);
+		auto iter=tileObjects.try_emplace(tileIndex, TileObjects{.count=0}).first;
+
+		// Already full?
+		TileObjects *entry=&iter->second;
+		if (entry->count>=MapTile::objectsMax)
+			return false;
+
+		// Add object.
+		entry->objects[entry->count++]=object;
+
+		return true;
+	}
+
+	void MapRegion::removeTileObject(unsigned tileIndex, MapObject *object) {
+		assert(tileIndex<tilesSize*tilesSize);
+		assert(object!=NULL);
+
+		std::lock_guard<std::mutex> guard(tileObjectsLock);
+		auto iter=tileObjects.find(tileIndex);
+		assert(iter!=tileObjects.end());
+		if (iter==tileObjects.end())
+			return;
+
+		// Search for the object.
+		TileObjects *entry=&iter->second;
+		for(unsigned i=0; i<entry->count; ++i)
+			if (entry->objects[i]==object) {
+				// Remove this object by overwriting it with the one at the end of the array, and drop the entry altogether once empty.
+				entry->objects[i]=entry->objects[--entry->count];
+				if (entry->count==0)
+					tileObjects.erase(iter);
+				return;
+			}
+
+		// Object not found.
+		assert(false);
+	}
+
+	MapTile *MapRegion::getTileInstances(unsigned band) const {
+		assert(band<bandsCount);
+
+		MapTile *tiles=tileInstances[band].load(std::memory_order_acquire);
+		if (tiles!=NULL)
+			return tiles;
+
+		// Create instances for this band.
+		// Note: tileFileData never moves (remapping is done in place) so instances remain valid for the region's lifetime.
+		MapTile *newTiles=(pool!=NULL ? pool->takeTiles() : new MapTile[bandTileCount]);
+		for(unsigned i=0; i<bandTileCount; ++i)
+			newTiles[i].setFileData(const_cast<MapRegion *>(this), tileFileData, band*bandTileCount+i);
+
+		// Publish them, unless another thread got there first.
+		if (tileInstances[band].compare_exchange_strong(tiles, newTiles, std::memory_order_acq_rel))
+			return newTiles;
+
+		if (pool!=NULL)
+			pool->giveTiles(newTiles);
+		else
+			delete[] newTiles;
+
+		return tiles;
+	}
+
+	void MapRegion::expandUniform(void) const {
+		if (!isUniform.load(std::memory_order_acquire))
+			return;
+
+		std::lock_guard<std::mutex> guard(uniformLock);
+		if (!isUniform.load(std::memory_order_relaxed))
+			return;
+
+		// Copy tile 0 over every other tile, one field at a time.
+		// Note: if other tiles are still zero (as a fresh anonymous mapping has not been written to) and tile 0 is also zero there is nothing to do, and avoiding writes keeps those pages unallocated.
+		FileTile tile=FileTile(), zeroTile=FileTile(); // value-initialized so that padding compares equal
+		getFileTile(0, &tile);
+		if (!isUniformRestZero || memcmp(&tile, &zeroTile, sizeof(tile))!=0) {
+			MapTile::FileData *data=tileFileData;
+			const size_t tileCount=tilesSize*tilesSize;
+			for(size_t i=1; i<tileCount; ++i)
+				std::copy(data->layers[0], data->layers[0]+MapTile::layersMax, data->layers[i]);
+			std::fill(data->height+1, data->height+tileCount, data->height[0]);
+			std::fill(data->moisture+1, data->moisture+tileCount, data->moisture[0]);
+			std::fill(data->temperature+1, data->temperature+tileCount, data->temperature[0]);
+			std::fill(data->bitset+1, data->bitset+tileCount, data->bitset[0]);
+			std::fill(data->scratch+1, data->scratch+tileCount, data->scratch[0]);
+			std::fill(data->landmassId+1, data->landmassId+tileCount, data->landmassId[0]);
+		}
+
+		isUniform.store(false, std::memory_order_release);
+	}
+
+	MapRegion::Snapshot *MapRegion::createSnapshot(uint64_t version, unsigned writersAllowed) const {
+		Snapshot *newSnapshot=new Snapshot(regionX, regionY, version);
+
+		// Copy tile data (holding uniformLock so that the region is not expanded midway through).
+		// Uniform regions only need their single tile copying.
+		uniformLock.lock();
+		const MapTile::FileData *src=tileFileData;
+		MapTile::FileData *dst=newSnapshot->tileFileData;
+		newSnapshot->isUniform=isUniform.load(std::memory_order_relaxed);
+		if (newSnapshot->isUniform) {
+			std::copy(src->layers[0], src->layers[0]+MapTile::layersMax, dst->layers[0]);
+			dst->height[0]=src->height[0];
+			dst->moisture[0]=src->moisture[0];
+			dst->temperature[0]=src->temperature[0];
+			dst->bitset[0]=src->bitset[0];
+			dst->scratch[0]=src->scratch[0];
+			dst->landmassId[0]=src->landmassId[0];
+		} else
+			*dst=*src;
+		uniformLock.unlock();
+
+		// If anything started writing while we were copying then the copy may be torn, so discard it.
+		// Note: writers either call beginWrite before modifying anything (see Map::WriteScope), or mark the region dirty (incrementing writeVersion) only once done.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (writersActive.load()>writersAllowed || writeVersion.load()!=version) {
+			newSnapshot->release();
+			return NULL;
+		}
+
+		return newSnapshot;
+	}
+
+	void MapRegion::setSnapshot(Snapshot *newSnapshot) const {
+		if (snapshot!=NULL)
+			snapshot->release();
+		snapshot=newSnapshot;
+
+		// Uniform snapshots only touch a few pages so are counted as free.
+		snapshotBytes.store(snapshot!=NULL ? sizeof(Snapshot)+(snapshot->isUniform ? 0 : tileFileDataSize) : 0, std::memory_order_relaxed);
+	}
+
+	MapRegion::Snapshot::Snapshot(unsigned regionX, unsigned regionY, uint64_t version): regionX(regionX), regionY(regionY), version(version) {
+		refCount=1;
+		isUniform=false;
+
+		void *fileData=mmap(NULL, tileFileDataSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (fileData==MAP_FAILED)
+			throw std::bad_alloc();
+		tileFileData=(MapTile::FileData *)fileData;
+
+		uniformTile.setFileData(NULL, tileFileData, 0);
+
+		for(unsigned i=0; i<bandsCount; ++i)
+			tileInstances[i]=NULL;
+	}
+
+	MapRegion::Snapshot::~Snapshot() {
+		for(unsigned i=0; i<bandsCount; ++i)
+			delete[] tileInstances[i].load();
+
+		munmap(tileFileData, tileFileDataSize);
+	}
+
+	void MapRegion::Snapshot::release(void) const {
+		if (refCount.fetch_sub(1, std::memory_order_acq_rel)==1)
+			delete this;
+	}
+
+	uint64_t MapRegion::Snapshot::getVersion(void) const {
+		return version;
+	}
+
+	bool MapRegion::Snapshot::getIsUniform(void) const {
+		return isUniform;
+	}
+
+	const MapTile::FileData *MapRegion::Snapshot::getTileFileData(void) const {
+		return tileFileData;
+	}
+
+	const MapTile *MapRegion::Snapshot::getTileAtOffset(unsigned offsetX, unsigned offsetY) const {
+		assert(offsetX<tilesSize);
+		assert(offsetY<tilesSize);
+
+		if (isUniform)
+			return &uniformTile;
+
+		// Create tile instances for this band if needed (see MapRegion::getTileInstances).
+		unsigned band=offsetY/bandRows;
+		MapTile *tiles=tileInstances[band].load(std::memory_order_acquire);
+		if (tiles==NULL) {
+			MapTile *newTiles=new MapTile[bandTileCount];
+			for(unsigned i=0; i<bandTileCount; ++i)
+				newTiles[i].setFileData(NULL, tileFileData, band*bandTileCount+i);
+
+			if (tileInstances[band].compare_exchange_strong(tiles, newTiles, std::memory_order_acq_rel))
+				tiles=newTiles;
+			else
+				delete[] newTiles;
+		}
+
+		return &tiles[(offsetY%bandRows)*tilesSize+offsetX];
+	}
+
+	bool MapRegion::checkIsUniform(void) const {
+		// Each field is uniform if its array equals itself shifted along by one tile.
+		const MapTile::FileData *data=tileFileData;
+		auto isFieldUniform=[](const void *field, size_t fieldSize, size_t elementSize) {
+			return (memcmp(field, (const uint8_t *)field+elementSize, fieldSize-elementSize)==0);
+		};
+
+		return isFieldUniform(data->height, sizeof(data->height), sizeof(data->height[0])) &&
+		       isFieldUniform(data->moisture, sizeof(data->moisture), sizeof(data->moisture[0])) &&
+		       isFieldUniform(data->temperature, sizeof(data->temperature), sizeof(data->temperature[0])) &&
+		       isFieldUniform(data->bitset, sizeof(data->bitset), sizeof(data->bitset[0])) &&
+		       isFieldUniform(data->scratch, sizeof(data->scratch), sizeof(data->scratch[0])) &&
+		       isFieldUniform(data->landmassId, sizeof(data->landmassId), sizeof(data->landmassId[0])) &&
+		       isFieldUniform(data->layers, sizeof(data->layers), sizeof(data->layers[0]));
 	}
 };
@@ -1,8 +1,14 @@
 #ifndef ENGINE_GRAPHICS_MAPREGION_H
 #define ENGINE_GRAPHICS_MAPREGION_H
 
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
+#include "mapcodec.h"
+#include "maplog.h"
+#include "mappack.h"
 #include "maptile.h"
 #include "../physics/coord.h"
 
@@ -14,12 +20,102 @@ namespace Engine {
 		class MapRegion {
 		public:
 			static const unsigned tilesSize=256; // numbers of tiles per side, with total number of tiles equal to tilesSize squared
+			static const size_t tileFileDataSize=sizeof(MapTile::FileData); // size of the uncompressed tile data (a multiple of the page size)
+			static_assert(MapTile::FileData::tileCount==tilesSize*tilesSize);
 
-			MapRegion(unsigned regionX, unsigned regionY);
+			static const unsigned bandRows=16; // rows per band, each dirtied and stored separately
+			static const unsigned bandsCount=tilesSize/bandRows;
+			static const unsigned bandTileCount=bandRows*tilesSize;
+
+			static const unsigned logTilesMax=4096; // most modified tiles which can still be saved via the log
+
+			// How tile data is encoded within region files (before any compression).
+			enum Encoding {
+				EncodingFull, // exactly as in memory (mappable if uncompressed)
+				EncodingFloat, // 32 bit floats, and layers packed
+				EncodingQuantized, // 16 bit values scaled to the band's range
+				EncodingNB,
+			};
+
+			struct FileFormat {
+				MapCodec::Type codec=MapCodec::None;
+				Encoding encoding=EncodingFull;
+			};
+
+			// Immutable copy of a region's tile data (without objects), see getSnapshot.
+			class Snapshot {
+			public:
+				const unsigned regionX, regionY;
+
+				void release(void) const; // Drops the reference returned by getSnapshot.
+
+				uint64_t getVersion(void) const; // See MapRegion::getVersion.
+				bool getIsUniform(void) const; // If true then only index 0 of each field is valid.
+				const MapTile::FileData *getTileFileData(void) const;
+				const MapTile *getTileAtOffset(unsigned offsetX, unsigned offsetY) const;
+			private:
+				friend class MapRegion;
+
+				Snapshot(unsigned regionX, unsigned regionY, uint64_t version);
+				~Snapshot();
+
+				mutable std::atomic<unsigned> refCount; // owning region plus one per reader
+				uint64_t version;
+				bool isUniform;
+				MapTile::FileData *tileFileData; // anonymous mapping
+				MapTile uniformTile; // view of index 0 of tileFileData
+				mutable std::atomic<MapTile *> tileInstances[bandsCount]; // as for MapRegion, created on first use
+			};
+
+			// Memory of unloaded regions kept for reuse by the next regions loaded. Thread safe.
+			class BufferPool {
+			public:
+				BufferPool(size_t maxBytes, bool hugePages); // maxBytes bounds the memory held for reuse.
+				~BufferPool();
+
+				MapTile::FileData *takeFileData(bool *isRecycled); // Returns NULL on failure. Recycled mappings are not zeroed.
+				void giveFileData(MapTile::FileData *fileData); // Keeps the mapping for reuse, unless the pool is full.
+				MapTile *takeTiles(void); // Returns bandTileCount tile instances for the caller to point at its data.
+				void giveTiles(MapTile *tiles);
+
+				size_t getBytes(void) const; // Memory currently held for reuse.
+
+				static MapTile::FileData *allocFileData(bool hugePages); // Returns a new zeroed mapping, or NULL on failure.
+			private:
+				const size_t maxBytes;
+				const bool hugePages;
+
+				mutable std::mutex lock; // protects the below
+				std::vector<MapTile::FileData *> fileDatas;
+				std::vector<MapTile *> tiles;
+				size_t bytes;
+			};
+
+			MapRegion(unsigned regionX, unsigned regionY, BufferPool *pool=NULL); // If pool is given then memory is taken from and returned to it.
 			~MapRegion();
 
-			bool load(const char *regionsDirPath);
-			bool save(const char *regionsDirPath, unsigned regionX, unsigned regionY);
+			bool load(const char *regionPath, bool readOnly, const uint8_t *data=NULL, uint64_t dataSize=0); // data, if given, holds the whole file.
+			bool load(MapPack *pack, unsigned regionX, unsigned regionY, const uint8_t *data=NULL, uint64_t dataSize=0); // As above but from a pack (false if missing).
+			bool save(const char *regionsDirPath, unsigned regionX, unsigned regionY, const FileFormat &format);
+			bool save(MapPack *pack, unsigned regionX, unsigned regionY, const FileFormat &format);
+			// Note: these rewrite just the dirty bands in place where possible.
+
+			// Appends just the modified tiles to the log, returning false if the region must be saved in full.
+			bool save(MapLog *log, unsigned regionX, unsigned regionY);
+			bool loadLog(MapLog *log, unsigned regionX, unsigned regionY); // Applies the region's log records on top of its file.
+			bool saveLogLatest(MapLog *log, unsigned regionX, unsigned regionY); // Needed before saving in full while the region has log records.
+
+			static const char *encodingToString(Encoding encoding);
+			static bool encodingFromString(const char *str, Encoding *encoding); // accepts 'full', 'float' and 'quantized'
+
+			static size_t getMemoryUsageEstimate(void); // Typical memory used by a freshly loaded region.
+
+			// Writers bracket batches of modifications with these, so that snapshots fall between batches.
+			void beginWrite(void);
+			void endWrite(void);
+
+			// Returns a consistent copy-on-write snapshot, which the caller must release.
+			const Snapshot *getSnapshot(void) const;
 
 			static unsigned coordXToRegionXBase(CoordComponent x);
 			static unsigned coordXToRegionXOffset(CoordComponent x);
@@ -28,25 +124,164 @@ namespace Engine {
 			const MapTile *getTileAtCoordVec(const CoordVec &vec) const ;
 			MapTile *getTileAtOffset(unsigned offsetX, unsigned offsetY);
 			const MapTile *getTileAtOffset(unsigned offsetX, unsigned offsetY) const ;
+			MapTile::FileData *getTileFileData(void); // For bulk access. Callers modifying data must also call setDirty.
+			const MapTile::FileData *getTileFileData(void) const;
+			// Note: the above expand uniform regions.
 
 			bool getIsDirty(void) const;
+			uint64_t getVersion(void) const; // Changes whenever tile data may have been modified.
+			bool getIsUniform(void) const; // True if only a single tile is stored, as every tile is identical.
+			const MapTile *getUniformTile(void) const; // Tile data shared by every tile of a uniform region (without objects).
+			size_t getMemoryUsage(void) const; // Approximate bytes used, including objects.
+			size_t getSnapshotMemoryUsage(void) const; // Share of the above used by the latest snapshot (which changes as snapshots are taken).
 
-			void setDirty(void);
+			void setDirty(void); // Marks the whole region as needing saving.
+			void setDirtyAtOffset(unsigned offsetX, unsigned offsetY); // Marks just the tile's band (and objects) as needing saving.
 
 			bool addObject(MapObject *object);
 			void ownObject(MapObject *object);
 			void disownObject(MapObject *object);
 
+			// Objects overlapping each tile, with tileIndex=y*tilesSize+x.
+			const MapObject *getTileObject(unsigned tileIndex, unsigned n) const;
+			unsigned getTileObjectCount(unsigned tileIndex) const;
+			bool addTileObject(unsigned tileIndex, MapObject *object); // Returns false if the tile is full.
+			void removeTileObject(unsigned tileIndex, MapObject *object);
+
 			const unsigned regionX, regionY;
 
 			std::vector<MapObject *> objects;
 		private:
-			bool isDirty;
+			// Region files begin with this header, followed by tile data and then objects.
+			struct FileHeader {
+				char magic[4]; // see fileMagic
+				uint16_t version;
+				uint8_t codec; // MapCodec::Type
+				uint8_t filter; // MapCodec::Filter applied before compression
+				uint32_t tileDataSize; // once decompressed
+				uint8_t encoding; // Encoding (always EncodingFull before version 3)
+				uint8_t bands; // If non-zero then a FileBand table and that many bands (never before version 4).
+				uint8_t flags; // FileFlag (always 0 before version 5)
+				uint8_t reserved[1];
+				uint64_t tileDataOffset; // page aligned if uncompressed
+				uint64_t tileDataStoredSize; // size within the file
+			};
+
+			// Entry in band table (see FileHeader::bands).
+			struct FileBand {
+				uint64_t offset; // from start of region file
+				uint32_t storedSize;
+				uint32_t capacity; // space reserved, to allow rewriting in place
+			};
+
+			enum FileFlag {
+				FileFlagUniform=1, // tile data is a single FileTile which applies to every tile
+			};
+
+			// A single tile's data as one record (as stored up to version 1, and by uniform regions).
+			struct FileTile {
+				MapTile::Layer layers[MapTile::layersMax];
+				double height, moisture, temperature;
+				uint64_t bitset;
+				uint16_t landmassId;
+				union {
+					uint32_t scratchInt;
+					float scratchFloat;
+				};
+			};
+
+			// Log records of tile data consist of a series of these.
+			struct LogTile {
+				uint32_t index; // y*tilesSize+x
+				uint32_t padding;
+				FileTile tile;
+			};
+
+			static const char fileMagic[4];
+			static const uint16_t fileVersion=5;
+
+			// Block of encoded tile data made up of fixed size records, filtered separately.
+			struct FilePlane {
+				size_t offset, size, recordSize;
+			};
+			static const unsigned filePlanesMax=16;
+
+			std::atomic<bool> isDirty;
+			std::atomic<uint32_t> dirtyBands; // bit per band modified since last saved
 
-			MapTile tileInstances[tilesSize][tilesSize]; // [y][x]
-			MapTile::FileData tileFileData[tilesSize][tilesSize]; // [y][x]
+			// Modifications since last saved, for the log.
+			std::atomic<uint64_t> logTileBits[tilesSize*tilesSize/64]; // bit per tile, set by setDirtyAtOffset
+			std::atomic<unsigned> logTileCount; // bits set in logTileBits
+			std::atomic<bool> logObjects; // set if objects have been added or removed
+			std::atomic<bool> logAll; // set if the region must be saved in full
+
+			// Band layout of the region's file, for rewriting bands in place.
+			FileBand fileBands[bandsCount];
+			bool fileBandsValid;
+			bool fileBandsIsPack; // bands are in a pack file
+			FileFormat fileBandsFormat;
+			uint64_t fileBandsTableOffset; // from start of region file
+			uint64_t fileObjectsOffset; // from start of region file
+
+			// Objects overlapping each tile, for tiles which have any.
+			struct TileObjects {
+				MapObject *objects[MapTile::objectsMax];
+				unsigned count;
+			};
+			mutable std::mutex tileObjectsLock; // protects tileObjects
+			std::unordered_map<unsigned, TileObjects> tileObjects; // keyed by tile index
+
+			mutable std::atomic<bool> isUniform; // if true then only index 0 of each field is valid
+			bool isUniformRestZero; // if true then every other tile is known to be zero
+			mutable std::mutex uniformLock; // held while expanding
+			MapTile uniformTile; // view of index 0 of tileFileData
+
+			std::atomic<unsigned> writersActive; // writers between beginWrite and endWrite
+			std::atomic<uint64_t> writeVersion; // see getVersion
+			mutable std::mutex snapshotLock; // protects snapshot, and held while taking one
+			mutable Snapshot *snapshot; // latest snapshot (holding a reference), or NULL
+			mutable std::atomic<size_t> snapshotBytes; // memory used by snapshot, readable without snapshotLock
+
+			mutable std::atomic<MapTile *> tileInstances[bandsCount]; // bandTileCount tiles per band, created on first use
+			MapTile::FileData *tileFileData; // anonymous or file mapping
+			bool tileFileDataIsFile; // shared mapping of the region (or pack) file
+			bool tileFileDataIsPack; // the file is a pack file
+			bool tileFileDataIsAnonymous; // anonymous mapping (which can be returned to pool)
+			BufferPool *pool; // or NULL
+			uint64_t tileFileDataOffset; // offset of the mapping within the file
+
+			MapTile *getTileInstances(unsigned band) const; // Creates them if needed.
+			void expandUniform(void) const; // Copies a uniform region's single tile to every tile.
+			bool checkIsUniform(void) const; // True if every tile is identical.
+			Snapshot *createSnapshot(uint64_t version, unsigned writersAllowed) const; // Returns NULL if modified during copying. Requires snapshotLock is held.
+			void setSnapshot(Snapshot *newSnapshot) const; // Replaces latest snapshot. Requires snapshotLock is held.
+
+			bool loadFd(int fd, uint64_t offset, uint64_t size, const uint8_t *data, const char *name, bool isPack, bool readOnly); // Reads region data at offset in fd (or from data, if given).
+			bool writeFile(FILE *file, const FileFormat &format, FileHeader *header); // Writes header, tile data and objects. Also fills in fileBands.
+			bool mapFile(int fd, uint64_t offset, bool isPack, bool readOnly); // Replaces tileFileData with a mapping of the file (private if readOnly).
+			bool unmapFile(void); // Replaces a file mapping with an anonymous copy.
+			bool readTileData(int fd, uint64_t offset, const uint8_t *data, const FileHeader *header); // Reads, decompresses and converts tile data.
+			bool readTileDataBands(int fd, uint64_t offset, const uint8_t *data, const FileHeader *header, bool isPack); // As readTileData but for banded data, recording the layout.
+			static bool readAt(int fd, uint64_t offset, const uint8_t *data, uint64_t pos, void *dst, size_t size); // Reads from fd, or copies from data if given.
+			bool patchFile(int fd, MapPack *pack, unsigned regionX, unsigned regionY, const FileFormat &format, uint32_t bands); // Rewrites the given bands in place, returning false if they no longer fit.
+			bool writeAt(int fd, MapPack *pack, unsigned regionX, unsigned regionY, uint64_t offset, const void *data, size_t size, bool isEnd); // Writes to fd or the region's pack extent. If isEnd then truncates after.
+			bool encodeBand(const FileFormat &format, unsigned band, uint8_t **data, size_t *size) const; // Encodes a band into a newly allocated buffer.
+			static unsigned getFilePlanes(Encoding encoding, size_t tileCount, FilePlane planes[filePlanesMax]); // Returns number of planes.
+			static size_t getEncodedSize(Encoding encoding, size_t tileCount);
+			static uint32_t getBandCapacity(size_t storedSize); // Space to reserve for a band, allowing growth.
+			static void filterTileData(bool encode, Encoding encoding, MapCodec::Filter filter, size_t tileCount, const uint8_t *src, uint8_t *dst); // Applies (or reverses) filter to each plane separately.
+			void encodeTileData(Encoding encoding, size_t firstTile, size_t tileCount, uint8_t *dst) const; // dst must have space for getEncodedSize bytes.
+			void decodeTileData(Encoding encoding, size_t firstTile, size_t tileCount, const uint8_t *src);
+			void convertFileDataV1(const FileTile *src); // Converts per-tile records into tileFileData.
+			void getFileTile(unsigned index, FileTile *dst) const;
+			void setFileTile(unsigned index, const FileTile *src);
 
 			bool saveObjects(FILE *regionFile);
+
+			void clearLog(void); // Forgets modifications tracked for the log.
+			void setSaved(uint64_t version, uint32_t bands); // Clears isDirty unless modified since version.
+			bool appendLogTiles(MapLog *log, unsigned regionX, unsigned regionY, const std::vector<unsigned> &indices) const; // Appends the current data of the given tiles.
+			bool appendLogObjects(MapLog *log, unsigned regionX, unsigned regionY); // Appends every object.
 		};
 	};
 };
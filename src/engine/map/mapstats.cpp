@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapstats.h"
+
+namespace Engine {
+	namespace Map {
+		const char MapStats::fileMagic[4]={'6', '4', 'G', 'S'};
+
+		MapStats::MapStats(unsigned regionsSize): regionsSize(regionsSize) {
+			fd=-1;
+			readOnly=false;
+		}
+
+		MapStats::~MapStats() {
+			close();
+		}
+
+		bool MapStats::open(const char *path, bool gReadOnly) {
+			assert(path!=NULL);
+			assert(fd==-1);
+
+			readOnly=gReadOnly;
+
+			// Open file, creating it if needed.
+			fd=::open(path, (readOnly ? O_RDONLY : O_RDWR|O_CREAT), S_IRUSR|S_IWUSR);
+			if (fd==-1)
+				return readOnly; // read only maps may simply not have a stats file
+
+			struct stat statsStat;
+			if (fstat(fd, &statsStat)!=0) {
+				close();
+				return false;
+			}
+
+			if (statsStat.st_size==0) {
+				if (readOnly) {
+					close();
+					return true;
+				}
+
+				// Write new header, with space for every entry (which is left sparse until written).
+				FileHeader header;
+				memcpy(header.magic, fileMagic, sizeof(fileMagic));
+				header.version=fileVersion;
+				header.regionsSize=regionsSize;
+				header.padding=0;
+
+				if (ftruncate(fd, getEntryOffset(0, regionsSize))!=0 || pwrite(fd, &header, sizeof(header), 0)!=sizeof(header)) {
+					close();
+					return false;
+				}
+			} else {
+				// Read and check header.
+				FileHeader header;
+				if (pread(fd, &header, sizeof(header), 0)!=sizeof(header) || memcmp(header.magic, fileMagic, sizeof(fileMagic))!=0 || header.version>fileVersion || header.regionsSize<regionsSize) {
+					fprintf(stderr,"error: '%s' is not a region stats file (or has an unsupported format)\n", path);
+					close();
+					return false;
+				}
+				regionsSize=header.regionsSize;
+			}
+
+			return true;
+		}
+
+		void MapStats::close(void) {
+			if (fd!=-1)
+				::close(fd);
+			fd=-1;
+		}
+
+		bool MapStats::get(unsigned regionX, unsigned regionY, Entry *entry) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+			assert(entry!=NULL);
+
+			if (fd==-1)
+				return false;
+
+			return (pread(fd, entry, sizeof(Entry), getEntryOffset(regionX, regionY))==sizeof(Entry) && (entry->flags & FlagValid));
+		}
+
+		bool MapStats::set(unsigned regionX, unsigned regionY, const Entry &entry) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+			assert(entry.flags & FlagValid);
+
+			if (fd==-1 || readOnly)
+				return false;
+
+			return (pwrite(fd, &entry, sizeof(Entry), getEntryOffset(regionX, regionY))==sizeof(Entry));
+		}
+
+		void MapStats::remove(unsigned regionX, unsigned regionY) {
+			assert(regionX<regionsSize && regionY<regionsSize);
+
+			if (fd==-1 || readOnly)
+				return;
+
+			Entry entry;
+			memset(&entry, 0, sizeof(entry));
+			pwrite(fd, &entry, sizeof(Entry), getEntryOffset(regionX, regionY)); // TODO: Check return.
+		}
+
+		void MapStats::compute(const MapRegion *region, double seaLevel, Entry *entry) {
+			assert(region!=NULL);
+			assert(entry!=NULL);
+
+			entry->seaLevel=seaLevel;
+			entry->flags=FlagValid;
+			entry->padding=0;
+
+			// Uniform regions (e.g. open ocean) only need their single tile considering.
+			if (region->getIsUniform()) {
+				const MapTile *tile=region->getUniformTile();
+				entry->heightMin=entry->heightMax=tile->getHeight();
+				entry->heightSum=tile->getHeight()*MapTile::FileData::tileCount;
+				entry->temperatureMin=entry->temperatureMax=tile->getTemperature();
+				entry->temperatureSum=tile->getTemperature()*MapTile::FileData::tileCount;
+				entry->moistureMin=entry->moistureMax=tile->getMoisture();
+				entry->moistureSum=tile->getMoisture()*MapTile::FileData::tileCount;
+				entry->bitsetOr=tile->getBitset();
+				entry->landCount=(tile->getHeight()>seaLevel ? MapTile::FileData::tileCount : 0);
+				return;
+			}
+
+			// Note: each field is scanned separately as they are stored in separate planes.
+			const MapTile::FileData *fileData=region->getTileFileData();
+
+			double heightMin=DBL_MAX, heightMax=-DBL_MAX, heightSum=0.0;
+			unsigned landCount=0;
+			for(unsigned i=0; i<MapTile::FileData::tileCount; ++i) {
+				double height=fileData->height[i];
+				heightMin=std::min(heightMin, height);
+				heightMax=std::max(heightMax, height);
+				heightSum+=height;
+				landCount+=(height>seaLevel);
+			}
+			entry->heightMin=heightMin;
+			entry->heightMax=heightMax;
+			entry->heightSum=heightSum;
+			entry->landCount=landCount;
+
+			double temperatureMin=DBL_MAX, temperatureMax=-DBL_MAX, temperatureSum=0.0;
+			for(unsigned i=0; i<MapTile::FileData::tileCount; ++i) {
+				temperatureMin=std::min(temperatureMin, fileData->temperature[i]);
+				temperatureMax=std::max(temperatureMax, fileData->temperature[i]);
+				temperatureSum+=fileData->temperature[i];
+			}
+			entry->temperatureMin=temperatureMin;
+			entry->temperatureMax=temperatureMax;
+			entry->temperatureSum=temperatureSum;
+
+			double moistureMin=DBL_MAX, moistureMax=-DBL_MAX, moistureSum=0.0;
+			for(unsigned i=0; i<MapTile::FileData::tileCount; ++i) {
+				moistureMin=std::min(moistureMin, fileData->moisture[i]);
+				moistureMax=std::max(moistureMax, fileData->moisture[i]);
+				moistureSum+=fileData->moisture[i];
+			}
+			entry->moistureMin=moistureMin;
+			entry->moistureMax=moistureMax;
+			entry->moistureSum=moistureSum;
+
+			uint64_t bitsetOr=0;
+			for(unsigned i=0; i<MapTile::FileData::tileCount; ++i)
+				bitsetOr|=fileData->bitset[i];
+			entry->bitsetOr=bitsetOr;
+		}
+
+		void MapStats::combineInit(Entry *total) {
+			assert(total!=NULL);
+
+			total->heightMin=total->temperatureMin=total->moistureMin=DBL_MAX;
+			total->heightMax=total->temperatureMax=total->moistureMax=-DBL_MAX;
+			total->heightSum=total->temperatureSum=total->moistureSum=0.0;
+			total->seaLevel=0.0;
+			total->bitsetOr=0;
+			total->landCount=0;
+			total->flags=0;
+			total->padding=0;
+		}
+
+		void MapStats::combine(Entry *total, const Entry &entry) {
+			assert(total!=NULL);
+			assert(entry.flags & FlagValid);
+
+			total->heightMin=std::min(total->heightMin, entry.heightMin);
+			total->heightMax=std::max(total->heightMax, entry.heightMax);
+			total->heightSum+=entry.heightSum;
+			total->temperatureMin=std::min(total->temperatureMin, entry.temperatureMin);
+			total->temperatureMax=std::max(total->temperatureMax, entry.temperatureMax);
+			total->temperatureSum+=entry.temperatureSum;
+			total->moistureMin=std::min(total->moistureMin, entry.moistureMin);
+			total->moistureMax=std::max(total->moistureMax, entry.moistureMax);
+			total->moistureSum+=entry.moistureSum;
+			total->seaLevel=entry.seaLevel;
+			total->bitsetOr|=entry.bitsetOr;
+			total->landCount+=entry.landCount;
+			total->flags|=FlagValid;
+		}
+
+		uint64_t MapStats::getEntryOffset(unsigned regionX, unsigned regionY) const {
+			return sizeof(FileHeader)+((uint64_t)regionY*regionsSize+regionX)*sizeof(Entry);
+		}
+	};
+};
@@ -0,0 +1,63 @@
+#ifndef ENGINE_GRAPHICS_MAPSTATS_H
+#define ENGINE_GRAPHICS_MAPSTATS_H
+
+#include <cstdint>
+
+#include "mapregion.h"
+
+namespace Engine {
+	namespace Map {
+		// Per region summary statistics (ranges of each field and so on), so that map wide statistics can be found without reading every tile, and scans can skip regions which cannot contain what they are looking for.
+		// Entries for all regions are kept in a single file (alongside the regions), with each entry rewritten whenever its region is saved (see Map::regionSave).
+		class MapStats {
+		public:
+			struct Entry {
+				double heightMin, heightMax, heightSum;
+				double temperatureMin, temperatureMax, temperatureSum;
+				double moistureMin, moistureMax, moistureSum;
+				double seaLevel; // sea level used to compute landCount
+				uint64_t bitsetOr; // union of every tile's bitset
+				uint64_t landCount; // number of tiles with height above seaLevel
+				uint32_t flags; // see Flag enum
+				uint32_t padding;
+			};
+
+			enum Flag {
+				FlagValid=1, // entry has been computed (entries for regions which have never been saved are all zero)
+			};
+
+			MapStats(unsigned regionsSize); // regionsSize is the number of regions per side which the file needs to cover
+			~MapStats();
+
+			bool open(const char *path, bool readOnly); // Opens the stats file, creating it if needed (unless readOnly is true, in which case a missing file simply has no entries).
+			void close(void);
+
+			bool get(unsigned regionX, unsigned regionY, Entry *entry); // Returns false if there is no valid entry for the given region.
+			bool set(unsigned regionX, unsigned regionY, const Entry &entry);
+			void remove(unsigned regionX, unsigned regionY); // Clears the region's entry (e.g. once it no longer matches the region).
+
+			static void compute(const MapRegion *region, double seaLevel, Entry *entry);
+			static void combineInit(Entry *total); // Sets total up to be passed to combine, with ranges empty and sums zero.
+			static void combine(Entry *total, const Entry &entry); // Adds entry into total (e.g. to find the statistics for several regions at once).
+		private:
+			struct FileHeader {
+				char magic[4]; // see fileMagic
+				uint32_t version;
+				uint32_t regionsSize;
+				uint32_t padding;
+			};
+
+			static const char fileMagic[4];
+			static const uint32_t fileVersion=1;
+
+			unsigned regionsSize; // entry stride, from the file header once open (and so possibly larger than requested)
+
+			int fd;
+			bool readOnly;
+
+			uint64_t getEntryOffset(unsigned regionX, unsigned regionY) const;
+		};
+	};
+};
+
+#endif
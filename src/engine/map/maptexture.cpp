@@ -36,9 +36,14 @@ namespace Engine {
 			assert(texturesDirPath!=NULL);
 
 			// Copy image file.
-			const char *extension="png"; // TODO: Avoid hardcoding this.
+			char fileName[1024];
+			getFileName(fileName);
 			char outPath[4096]; // TODO: This better.
-			sprintf(outPath, "%s/%us%ur%ug%ub%u.%s", texturesDirPath, getId(), getScale(), getMapColourR(), getMapColourG(), getMapColourB(), extension);
+			sprintf(outPath, "%s/%s", texturesDirPath, fileName);
+
+			// Texture loaded from this directory in the first place? (in which case there is nothing to copy)
+			if (strcmp(getImagePath(), outPath)==0)
+				return true;
 
 			int inFd=open(getImagePath(), O_RDONLY); // TODO: Check return.
 			int outFd=open(outPath, O_WRONLY|O_CREAT, 0777); // TODO: Check return.
@@ -75,6 +80,11 @@ namespace Engine {
 			return result;
 		}
 
+		void MapTexture::getFileName(char fileName[1024]) const {
+			const char *extension="png"; // TODO: Avoid hardcoding this.
+			sprintf(fileName, "%us%ur%ug%ub%u.%s", getId(), getScale(), getMapColourR(), getMapColourG(), getMapColourB(), extension);
+		}
+
 		unsigned MapTexture::getId(void) const {
 			return id;
 		}
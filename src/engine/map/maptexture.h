@@ -13,7 +13,9 @@ namespace Engine {
 			MapTexture(unsigned id, const char *path, unsigned scale, uint8_t mapColourR, uint8_t mapColourG, uint8_t mapColourB);
 			~MapTexture();
 
-			bool save(const char *texturesDirPath) const;
+			bool save(const char *texturesDirPath) const; // Copies the image into the given directory (unless it is already there), named as per getFileName.
+
+			void getFileName(char fileName[1024]) const; // Name used for the image file within a map's textures directory. TODO: improve hardcoded size
 
 			unsigned getId(void) const;
 			const char *getImagePath(void) const;
@@ -2,6 +2,7 @@
 #include <cstdlib>
 #include <cstdio>
 
+#include "mapregion.h"
 #include "maptexture.h"
 #include "maptile.h"
 
@@ -11,80 +12,94 @@ using namespace Engine::Map;
 namespace Engine {
 	namespace Map {
 		MapTile::MapTile() {
+			region=NULL;
 			fileData=NULL;
-			objectsNext=0;
+			fileDataIndex=0;
 		}
 
 		MapTile::~MapTile() {
 		}
 
-		void MapTile::setFileData(FileData *gFileData) {
+		void MapTile::setFileData(MapRegion *gRegion, FileData *gFileData, unsigned gFileDataIndex) {
 			assert(fileData==NULL);
 			assert(gFileData!=NULL);
+			assert(gFileDataIndex<FileData::tileCount);
 
+			region=gRegion;
 			fileData=gFileData;
+			fileDataIndex=gFileDataIndex;
+		}
+
+		void MapTile::clearFileData(void) {
+			region=NULL;
+			fileData=NULL;
+			fileDataIndex=0;
 		}
 
 		const MapTile::Layer *MapTile::getLayer(unsigned z) const {
 			assert(fileData!=NULL);
 			assert(z<layersMax);
 
-			return &fileData->layers[z];
+			return &fileData->layers[fileDataIndex][z];
 		}
 
 		MapTile::Layer *MapTile::getLayer(unsigned z) {
 			assert(fileData!=NULL);
 			assert(z<layersMax);
 
-			return &fileData->layers[z];
+			return &fileData->layers[fileDataIndex][z];
 		}
 
 		const MapTile::Layer *MapTile::getLayers(void) const {
 			assert(fileData!=NULL);
 
-			return fileData->layers;
+			return fileData->layers[fileDataIndex];
 		}
 
 		const MapObject *MapTile::getObject(unsigned n) const {
 			assert(n<getObjectCount());
-			return objects[n];
+			return region->getTileObject(fileDataIndex, n);
 		}
 
 		unsigned MapTile::getObjectCount(void) const {
-			return objectsNext;
+			// Tiles without a region (such as those within a region snapshot) have no objects.
+			if (region==NULL)
+				return 0;
+
+			return region->getTileObjectCount(fileDataIndex);
 		}
 
 		double MapTile::getHeight(void) const {
-			return fileData->height;
+			return fileData->height[fileDataIndex];
 		}
 
 		double MapTile::getMoisture(void) const {
-			return fileData->moisture;
+			return fileData->moisture[fileDataIndex];
 		}
 
 		double MapTile::getTemperature(void) const {
-			return fileData->temperature;
+			return fileData->temperature[fileDataIndex];
 		}
 
 		uint64_t MapTile::getBitset(void) const {
-			return fileData->bitset;
+			return fileData->bitset[fileDataIndex];
 		}
 
 		bool MapTile::getBitsetN(unsigned n) const {
 			assert(n<64);
-			return (fileData->bitset>>n)&1;
+			return (fileData->bitset[fileDataIndex]>>n)&1;
 		}
 
 		uint16_t MapTile::getLandmassId(void) const {
-			return fileData->landmassId;
+			return fileData->landmassId[fileDataIndex];
 		}
 
 		uint32_t MapTile::getScratchInt(void) const {
-			return fileData->scratchInt;
+			return fileData->scratch[fileDataIndex].scratchInt;
 		}
 
 		float MapTile::getScratchFloat(void) const {
-			return fileData->scratchFloat;
+			return fileData->scratch[fileDataIndex].scratchFloat;
 		}
 
 		Physics::HitMask MapTile::getHitMask(const CoordVec &tilePos) const {
@@ -106,77 +121,60 @@ namespace Engine {
 			assert(fileData!=NULL);
 			assert(z<layersMax);
 
-			fileData->layers[z]=layer;
+			fileData->layers[fileDataIndex][z]=layer;
 		}
 
 		void MapTile::setHeight(double height) {
-			fileData->height=height;
+			fileData->height[fileDataIndex]=height;
 		}
 
 		void MapTile::setMoisture(double moisture) {
-			fileData->moisture=moisture;
+			fileData->moisture[fileDataIndex]=moisture;
 		}
 
 		void MapTile::setTemperature(double temperature) {
-			fileData->temperature=temperature;
+			fileData->temperature[fileDataIndex]=temperature;
 		}
 
 		void MapTile::setBitset(uint64_t bitset) {
-			fileData->bitset=bitset;
+			fileData->bitset[fileDataIndex]=bitset;
 		}
 
 		void MapTile::setBitsetN(unsigned n, bool value) {
 			assert(n<64);
 
 			if (value)
-				fileData->bitset|=(((uint64_t)1)<<n);
+				fileData->bitset[fileDataIndex]|=(((uint64_t)1)<<n);
 			else
-				fileData->bitset&=~(((uint64_t)1)<<n);
+				fileData->bitset[fileDataIndex]&=~(((uint64_t)1)<<n);
 		}
 
 		void MapTile::setLandmassId(uint16_t landmassId) {
-			fileData->landmassId=landmassId;
+			fileData->landmassId[fileDataIndex]=landmassId;
 		}
 
 		void MapTile::setScratchInt(uint32_t gScratchInt) {
-			fileData->scratchInt=gScratchInt;
+			fileData->scratch[fileDataIndex].scratchInt=gScratchInt;
 		}
 
 		void MapTile::setScratchFloat(float gScratchFloat) {
-			fileData->scratchFloat=gScratchFloat;
+			fileData->scratch[fileDataIndex].scratchFloat=gScratchFloat;
 		}
 
 		bool MapTile::addObject(MapObject *object) {
 			assert(object!=NULL);
 
-			// Already full?
-			if (isObjectsFull())
-				return false;
-
-			// Add object.
-			objects[objectsNext++]=object;
-
-			return true;
+			return region->addTileObject(fileDataIndex, object);
 		}
 
 		void MapTile::removeObject(MapObject *object) {
 			assert(object!=NULL);
 
-			// Search for the object.
-			unsigned i;
-			for(i=0; i<objectsNext; ++i)
-				if (objects[i]==object) {
-					// Remove this object by overwriting it with the one at the end of the array.
-					objects[i]=objects[--objectsNext];
-					return;
-				}
-
-			// Object not found.
-			assert(false);
+			region->removeTileObject(fileDataIndex, object);
 		}
 
 		bool MapTile::isObjectsFull(void) const {
-			return (objectsNext>=objectsMax);
+			return (getObjectCount()>=objectsMax);
 		}
 	};
 };
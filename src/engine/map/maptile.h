@@ -6,7 +6,10 @@
 
 namespace Engine {
 	namespace Map {
+		class MapRegion;
 
+		// Lightweight view of a single tile within a region.
+		// Tile data lives in the region's FileData and objects in the region's sparse per-tile object lists, so instances hold no per-tile state of their own and are only created by MapRegion on demand.
 		class MapTile {
 		public:
 			static const unsigned layersMax=4;
@@ -17,21 +20,28 @@ namespace Engine {
 				Physics::HitMask hitmask;
 			};
 
+			// Tile data for a whole region, stored with one contiguous plane per field (rather than a struct per tile).
+			// This way scans which only need one field (such as height) only touch the memory for that field.
 			struct FileData {
-				Layer layers[layersMax];
-				double height, moisture, temperature;
-				uint64_t bitset;
-				uint16_t landmassId;
+				static const unsigned tileCount=256*256; // must equal MapRegion::tilesSize squared, with tiles indexed as y*MapRegion::tilesSize+x
+
+				Layer layers[tileCount][layersMax];
+				double height[tileCount];
+				double moisture[tileCount];
+				double temperature[tileCount];
+				uint64_t bitset[tileCount];
 				union {
 					uint32_t scratchInt;
 					float scratchFloat;
-				};
+				} scratch[tileCount];
+				uint16_t landmassId[tileCount];
 			};
 
 			MapTile();
 			~MapTile();
 
-			void setFileData(FileData *fileData);
+			void setFileData(MapRegion *region, FileData *fileData, unsigned fileDataIndex); // region may be NULL for read-only copies (in which case the tile has no objects)
+			void clearFileData(void); // Detaches the tile (e.g. so that it can be reused for another region via setFileData).
 
 			Layer *getLayer(unsigned z);
 			const Layer *getLayer(unsigned z) const;
@@ -63,10 +73,9 @@ namespace Engine {
 			void removeObject(MapObject *object);
 			bool isObjectsFull(void) const;
 		private:
+			MapRegion *region;
 			FileData *fileData;
-
-			MapObject *objects[objectsMax];
-			unsigned objectsNext;
+			unsigned fileDataIndex;
 		};
 	};
 };
@@ -22,26 +22,31 @@ namespace Engine {
 		MapTiled::~MapTiled() {
 		};
 
-		bool MapTiled::createMetadata(const class Map *map) {
-			char path[2048]; // TODO: better
+		unsigned MapTiled::getMaxZoom(const class Map *map) {
+			assert(map!=NULL);
 
-			// Create directories for each zoom level
-			for(unsigned zoom=0; zoom<maxZoom; ++zoom) {
-				getZoomPath(map, zoom, path);
-				if (!Util::isDir(path) && !Util::makeDir(path))
-					return false;
+			// Add levels until a single image covers the whole map.
+			unsigned mapSize=std::max(map->getWidth(), map->getHeight());
+			unsigned maxZoom=maxZoomMin;
+			while((imageSize<<(maxZoom-1))<mapSize)
+				++maxZoom;
 
-				// Create directories for each x coordinate
-				unsigned maxX=(1u<<zoom);
-				for(unsigned x=0; x<maxX; ++x) {
-					getZoomXPath(map, zoom, x, path);
-					if (!Util::isDir(path) && !Util::makeDir(path))
-						return false;
-				}
-			}
+			return maxZoom;
+		}
 
-			// Create blank image (can be used if an image has not yet been generated)
+		bool MapTiled::createMetadata(const class Map *map) {
+			// Already created? (the transparent image is created last)
+			// Note: the directories for each zoom level are created as images are generated (see createZoomXDir).
 			char imagePath[2048]; // TODO: better
+			getTransparentImagePath(map, imagePath);
+			if (Util::isFile(imagePath))
+				return true;
+
+			const char *mapTiledDirPath=map->getMapTiledDir();
+			if (!Util::makeDir(mapTiledDirPath) && !Util::isDir(mapTiledDirPath))
+				return false;
+
+			// Create blank image (can be used if an image has not yet been generated)
 			getBlankImagePath(map, imagePath);
 			FILE *imageFile=fopen(imagePath, "wb");
 			png_structp pngPtr=png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -106,6 +111,7 @@ namespace Engine {
 		}
 
 		bool MapTiled::generateImage(class Map *map, unsigned zoom, unsigned x, unsigned y, ImageLayerSet imageLayerSet, Util::TimeMs timeoutMs, Util::ProgressFunctor *progressFunctor, void *progressUserData) {
+			const unsigned maxZoom=getMaxZoom(map);
 			assert(zoom<=maxZoom);
 
 			// Compute total number of images we need to generate worst case
@@ -119,6 +125,10 @@ namespace Engine {
 				imagesTotal+=std::pow(4llu, i);
 			imagesTotal*=layerCount;
 
+			// Create directory and blank images if this is the first image generated for this map
+			if (!createMetadata(map))
+				return false;
+
 			// Use recursive helper function
 			Util::TimeMs endTimeMs=(timeoutMs>0 ? Util::getTimeMs()+timeoutMs : 0);
 			unsigned long long int imagesDone=0;
@@ -126,7 +136,7 @@ namespace Engine {
 		}
 
 		bool MapTiled::clearImage(class Map *map, unsigned zoom, unsigned x, unsigned y, ImageLayerSet imageLayerSet) {
-			assert(zoom<=maxZoom);
+			assert(zoom<=getMaxZoom(map));
 
 			return clearImageHelper(map, zoom, x, y, imageLayerSet, false, false);
 		}
@@ -140,20 +150,22 @@ namespace Engine {
 				return false;
 
 			// Loop over zoom levels
-			// TODO: find closed form for this
-			unsigned totalImages=0;
-			for(unsigned zoom=0; zoom<maxZoom; ++zoom) {
-				unsigned perSide=(1u<<zoom);
-				totalImages+=perSide*perSide;
-			}
-			unsigned imagesHandled=0;
+			// Note: only images covering part of the map are considered, as those beyond its edges never change.
+			const unsigned maxZoom=getMaxZoom(map);
+			auto zoomImagesWide=[&](unsigned zoom) { unsigned zoomMapSize=imageSize<<(maxZoom-1-zoom); return (map->getWidth()+zoomMapSize-1)/zoomMapSize; };
+			auto zoomImagesHigh=[&](unsigned zoom) { unsigned zoomMapSize=imageSize<<(maxZoom-1-zoom); return (map->getHeight()+zoomMapSize-1)/zoomMapSize; };
+
+			unsigned long long totalImages=0;
+			for(unsigned zoom=0; zoom<maxZoom; ++zoom)
+				totalImages+=((unsigned long long)zoomImagesWide(zoom))*zoomImagesHigh(zoom);
+			unsigned long long imagesHandled=0;
 
 			for(unsigned zoom=0; zoom<maxZoom; ++zoom) {
 				// Loop over in X direction
-				unsigned maxXY=(1u<<zoom);
-				for(unsigned x=0; x<maxXY; ++x) {
+				unsigned maxX=zoomImagesWide(zoom), maxY=zoomImagesHigh(zoom);
+				for(unsigned x=0; x<maxX; ++x) {
 					// Loop over in Y direction
-					for(unsigned y=0; y<maxXY; ++y) {
+					for(unsigned y=0; y<maxY; ++y) {
 						result&=clearImage(map, zoom, x, y, imageLayerSet);
 						++imagesHandled;
 					}
@@ -177,7 +189,7 @@ namespace Engine {
 
 		bool MapTiled::clearImagesRegion(class Map *map, unsigned regionX, unsigned regionY, ImageLayerSet imageLayerSet) {
 			// Clear MapTiled image which matches this region 1:1 and all those affected by it
-			return clearImageHelper(map, maxZoom, regionX, regionY, imageLayerSet, true, true);
+			return clearImageHelper(map, getMaxZoom(map), regionX, regionY, imageLayerSet, true, true);
 		}
 
 		void MapTiled::getZoomPath(const class Map *map, unsigned zoom, char path[1024]) {
@@ -207,6 +219,7 @@ namespace Engine {
 				return false;
 
 			// Bad zoom value?
+			const unsigned maxZoom=getMaxZoom(map);
 			if (zoom>=maxZoom)
 				return false;
 
@@ -242,6 +255,10 @@ namespace Engine {
 				return true;
 			}
 
+			// Ensure the directory for the new images exists
+			if (!createZoomXDir(map, zoom, x))
+				return false;
+
 			// If we are at the maximum zoom level then this is a 'leaf node' that needs rendering from scratch.
 			// Also choose this path if the area the image covers is beyond the map boundaries as an optimisation taking advantage of a similar special case in MapPngLib::generatePng.
 			unsigned mapSize=imageSize;
@@ -272,6 +289,33 @@ namespace Engine {
 					continue;
 				}
 			} else {
+				// Layers which can be drawn from region summaries are rendered directly rather than from children, as this costs the same regardless of the area covered.
+				// Note: this means children of such layers are not generated.
+				const unsigned zoomMapSize=imageSize<<(maxZoom-1-zoom);
+				for(ImageLayer layer=0; layer<ImageLayerNB; ++layer) {
+					// Check if we even need to generate this layer
+					if (!(imageLayerSet & (1u<<layer)) || !MapPngLib::getLayerHasPyramid(layer))
+						continue;
+
+					// Get path for this image
+					char path[1024];
+					getZoomXYPath(map, zoom, x, y, layer, path);
+
+					// Generate image
+					bool res=MapPngLib::generatePng(map, path, x*zoomMapSize, y*zoomMapSize, zoomMapSize, zoomMapSize, imageSize, imageSize, layer, true);
+					if (!res)
+						return false;
+
+					// Remove it from the set of layers to do, updating imagesDone counter to account for the children we skipped
+					imageLayerSet&=~(1u<<layer);
+					for(unsigned long long int i=0; i<maxZoom-zoom; ++i)
+						*imagesDone+=std::pow(4llu, i);
+
+					// Time limit reached?
+					if (endTimeMs>0 && Util::getTimeMs()>=endTimeMs)
+						return false;
+				}
+
 				// Recurse to generate any needed children so we can then stitch them together
 				const unsigned childZoom=zoom+1;
 				const unsigned childBaseX=x*2;
@@ -324,6 +368,25 @@ namespace Engine {
 			return true;
 		}
 
+		bool MapTiled::createZoomXDir(const class Map *map, unsigned zoom, unsigned x) {
+			char path[1024];
+
+			getZoomXPath(map, zoom, x, path);
+			if (Util::isDir(path))
+				return true;
+
+			// Note: another thread or process could be creating the same directories at the same time, so we check again on failure.
+			getZoomPath(map, zoom, path);
+			if (!Util::makeDir(path) && !Util::isDir(path))
+				return false;
+
+			getZoomXPath(map, zoom, x, path);
+			if (!Util::makeDir(path) && !Util::isDir(path))
+				return false;
+
+			return true;
+		}
+
 		bool MapTiled::clearImageHelper(class Map *map, unsigned zoom, unsigned x, unsigned y, ImageLayerSet imageLayerSet, bool recurseChild, bool recurseParent) {
 			bool result=true;
 
@@ -342,7 +405,7 @@ namespace Engine {
 			}
 
 			// Handle 'child' images if needed
-			if (recurseChild && zoom+1<maxZoom) {
+			if (recurseChild && zoom+1<getMaxZoom(map)) {
 				unsigned cx=x*2;
 				unsigned cy=y*2;
 				unsigned pz=zoom+1;
@@ -11,7 +11,7 @@ namespace Engine {
 		class MapTiled {
 		public:
 			static const unsigned imageSize=256;
-			static const unsigned maxZoom=9; // zoom in range [0,maxZoom-1], equal to 1+log2((Map::regionsSize*MapRegion::tilesSize)/imageSize)
+			static const unsigned maxZoomMin=9; // see getMaxZoom
 
 			typedef unsigned ImageLayer;
 			static const ImageLayer	ImageLayerBase=0;
@@ -39,11 +39,15 @@ namespace Engine {
 			MapTiled();
 			~MapTiled();
 
-			static bool createMetadata(const class Map *map);
+			// Returns the number of zoom levels for the given map, with zoom in range [0,getMaxZoom(map)-1].
+			// Images at the deepest level cover a single region each, and the image at zoom 0 covers the whole map (but never less than the 65536 tiles per side covered with maxZoomMin levels, which older versions always used, so that existing images stay valid).
+			static unsigned getMaxZoom(const class Map *map);
+
+			static bool createMetadata(const class Map *map); // Creates the map's maptiled directory and blank images if they do not exist yet (this is done automatically by generateImage).
 
 			// The conditions following are considered in the order listed.
 			// If the image already exists, nothing is done.
-			// If the zoom level is the max then we generate the image directly with MapPngLib.
+			// If the zoom level is the max, or the layer can be drawn from region summaries (see MapPngLib::getLayerHasPyramid), then we generate the image directly with MapPngLib.
 			// In any of the four child images are missing, we recurse to generate them.
 			// If/once all four children exist, we scale and stitch them to create the desired image.
 			// If timeoutMs is not 0 and has been exceed, once at least one new image has been generated the function will return early, potentially unfinished.
@@ -63,6 +67,8 @@ namespace Engine {
 		private:
 			static bool generateImageHelper(class Map *map, unsigned zoom, unsigned x, unsigned y, ImageLayerSet imageLayerSet, Util::TimeMs endTimeMs, unsigned long long int *imagesDone, unsigned long long int imagesTotal, Util::ProgressFunctor *progressFunctor, void *progressUserData, Util::TimeMs startTimeMs);
 
+			static bool createZoomXDir(const class Map *map, unsigned zoom, unsigned x); // Creates the directory holding images for the given zoom and x coordinate (and its parent) if needed.
+
 			static bool clearImageHelper(class Map *map, unsigned zoom, unsigned x, unsigned y, ImageLayerSet imageLayerSet, bool recurseChild, bool recurseParent);
 		};
 	};
@@ -123,6 +123,54 @@ namespace Engine {
 		return (rmdir(path)==0);
 	}
 
+	size_t Util::getPhysicalMemory(void) {
+		long pageCount=sysconf(_SC_PHYS_PAGES);
+		long pageSize=sysconf(_SC_PAGESIZE);
+		if (pageCount<=0 || pageSize<=0)
+			return 0;
+
+		return ((size_t)pageCount)*((size_t)pageSize);
+	}
+
+	bool Util::parseSize(const char *str, size_t *size) {
+		assert(str!=NULL);
+		assert(size!=NULL);
+
+		char *end;
+		unsigned long long value=strtoull(str, &end, 10);
+		if (end==str)
+			return false;
+
+		switch(*end) {
+			case '\0':
+			break;
+			case 'k': case 'K':
+				value<<=10;
+				++end;
+			break;
+			case 'm': case 'M':
+				value<<=20;
+				++end;
+			break;
+			case 'g': case 'G':
+				value<<=30;
+				++end;
+			break;
+			default:
+				return false;
+			break;
+		}
+
+		// Allow an optional trailing 'B' (e.g. '512MB').
+		if (*end=='b' || *end=='B')
+			++end;
+		if (*end!='\0')
+			return false;
+
+		*size=value;
+		return true;
+	}
+
 	bool Util::isImageWhite(const char *path) {
 		assert(path!=NULL);
 
@@ -29,6 +29,9 @@ namespace Engine {
 		static bool unlinkFile(const char *path);
 		static bool unlinkDir(const char *path);
 
+		static size_t getPhysicalMemory(void); // returns total physical memory in bytes, or 0 if unknown
+		static bool parseSize(const char *str, size_t *size); // parses a byte count such as '4096', '512M' or '2G' (K/M/G suffixes are powers of 1024)
+
 		static bool isImageWhite(const char *path); // returns true if given path represents an image with all pixels white
 
 		static TimeMs getTimeMs(void);
@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include "../engine/map/map.h"
+#include "../engine/util.h"
+
+int main(int argc, char *argv[]) {
+	// Grab arguments.
+	Engine::Map::Map::Options options;
+	int arg=1;
+	while(arg+1<argc && argv[arg][0]=='-') {
+		if (strcmp(argv[arg], "--pack")==0) {
+			options.regionPack=true;
+			++arg;
+			continue;
+		}
+
+		if (strcmp(argv[arg], "--codec")==0)
+			options.regionCodec=argv[arg+1];
+		else if (strcmp(argv[arg], "--encoding")==0)
+			options.regionEncoding=argv[arg+1];
+		else
+			break;
+		arg+=2;
+	}
+
+	if (arg+1!=argc) {
+		printf("Usage: %s [--pack] [--codec none|lz|zstd] [--encoding full|float|quantized] mappath\n", argv[0]);
+		printf("Rewrites every region of the given map using the given codec and encoding (by default those given by the MAP_REGION_CODEC and MAP_REGION_ENCODING environment variables).\n");
+		printf("With --pack the regions are also moved into a single pack file (maps which already have one always use it).\n");
+		return EXIT_FAILURE;
+	}
+
+	const char *mapPath=argv[arg];
+
+	// Load map
+	printf("Loading map at '%s'...\n", mapPath);
+
+	class Map *map;
+	try {
+		map=new class Map(mapPath, false, &options);
+	} catch (std::exception& e) {
+		std::cout << "Could not load map: " << e.what() << '\n';
+		return EXIT_FAILURE;
+	}
+
+	// Rewrite regions
+	const char *progressString="Rewriting regions ";
+	bool success=map->rewriteRegions(&utilProgressFunctorString, (void *)progressString);
+	printf("\n");
+
+	// Tidy up
+	delete map;
+
+	if (!success) {
+		printf("Could not rewrite all regions\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -258,7 +258,7 @@ namespace MapEditor {
 
 		// Generate a needed image (or work towards it by generating a child image)
 		assert(mapTileToGenZoom<zoomLevelMax-zoomExtra);
-		if (!MapTiled::generateImage(map, mapTileToGenZoom, mapTileToGenX, mapTileToGenY, mapTileToGenLayerSet, 100, NULL, NULL))
+		if (!MapTiled::generateImage(map, getMapTiledZoom(mapTileToGenZoom), mapTileToGenX, mapTileToGenY, mapTileToGenLayerSet, 100, NULL, NULL))
 			return;
 
 		// Reset to-gen variables
@@ -585,8 +585,8 @@ namespace MapEditor {
 		// Various parameters
 		const double userKmSizeX=4.0*MapRegion::tilesSize;
 		const double userKmSizeY=4.0*MapRegion::tilesSize;
-		const double userMapSizeX=Engine::Map::Map::regionsSize*MapRegion::tilesSize;
-		const double userMapSizeY=Engine::Map::Map::regionsSize*MapRegion::tilesSize;
+		const double userMapSizeX=MapTiled::imageSize<<(MapTiled::maxZoomMin-1);
+		const double userMapSizeY=MapTiled::imageSize<<(MapTiled::maxZoomMin-1);
 
 		//                                              zoom level = {  0   1   2   3   4   5   6   7   8   9  10    11,    12,     13}
 		// TODO: this will need adjusting after changing MapTiled image size parameters
@@ -612,7 +612,7 @@ namespace MapEditor {
 
 		// Draw grey box to represent maximum possible map extents
 		cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
-		cairo_rectangle(cr, 0, 0, Engine::Map::Map::regionsSize*MapRegion::tilesSize, Engine::Map::Map::regionsSize*MapRegion::tilesSize);
+		cairo_rectangle(cr, 0, 0, userMapSizeX, userMapSizeY);
 		cairo_fill(cr);
 
 		// Calculate extents of what is on screen in user space units.
@@ -1017,6 +1017,9 @@ namespace MapEditor {
 			return false;
 		}
 
+		// Create blank image (used until images are generated)
+		MapTiled::createMetadata(map); // TODO: Check return.
+
 		// Reset to-gen variables
 		mapTileToGenX=0;
 		mapTileToGenY=0;
@@ -1083,6 +1086,9 @@ namespace MapEditor {
 				return false;
 		}
 
+		// Create blank image (used until images are generated)
+		MapTiled::createMetadata(map); // TODO: Check return.
+
 		// Reset to-gen variables
 		mapTileToGenX=0;
 		mapTileToGenY=0;
@@ -1271,7 +1277,7 @@ namespace MapEditor {
 
 		// Calculate image path
 		char path[1024];
-		MapTiled::getZoomXYPath(map, z, x, y, layer, path);
+		MapTiled::getZoomXYPath(map, getMapTiledZoom(z), x, y, layer, path);
 
 		// Attempt to load image
 		cairo_surface_t *surface=cairo_image_surface_create_from_png(path);
@@ -1295,6 +1301,11 @@ namespace MapEditor {
 		return surface;
 	}
 
+	unsigned MainWindow::getMapTiledZoom(unsigned z) {
+		// Larger maps have extra MapTiled zoom levels at the top (zoomed out) end.
+		return z+(MapTiled::getMaxZoom(map)-MapTiled::maxZoomMin);
+	}
+
 	void MainWindow::operationBegin(void) {
 		// If starting an operation then remove tick and idle timers
 		if (operationCounter==0) {
@@ -94,8 +94,9 @@ namespace MapEditor {
 		class Map *map;
 
 		// Zoom limits based on available MapTiled images
-		static const int zoomExtra=5; // At zoom=MapTiled::maxZoom MapTiled images are 1:1 with the screen, this is how many levels we can scale them to zoom in further.
-		static const int zoomLevelMin=0, zoomLevelMax=MapTiled::maxZoom+zoomExtra;
+		// Note: the view always covers 65536 tiles per side (the area covered by MapTiled zoom 0 for maps with MapTiled::maxZoomMin levels), so only this much of larger maps is shown (see getMapTiledZoom).
+		static const int zoomExtra=5; // At zoom=MapTiled::maxZoomMin MapTiled images are 1:1 with the screen, this is how many levels we can scale them to zoom in further.
+		static const int zoomLevelMin=0, zoomLevelMax=MapTiled::maxZoomMin+zoomExtra;
 
 		int zoomLevel;
 		double userCentreX, userCentreY;
@@ -133,6 +134,7 @@ namespace MapEditor {
 		void updatePositionLabel(void);
 
 		cairo_surface_t *getMapTiledImageSurface(unsigned z, unsigned x, unsigned y, MapTiled::ImageLayer layer);
+		unsigned getMapTiledZoom(unsigned z); // Converts from our zoom levels to MapTiled's (which depend on the size of the map).
 
 		// These are used to pause timer and idle tick functions during intensive operations.
 		// operationBegin can be called while an operation is already in progress - the operation is only considered complete when operationEnd has been called a matching number of times.
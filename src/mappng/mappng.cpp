@@ -68,9 +68,13 @@ int main(int argc, char **argv) {
 	if (!quiet)
 		printf("Loading map at '%s'...\n", mapPath);
 
+	// Note: the map is opened read only so that any number of instances can run at once.
+	Engine::Map::Map::Options options;
+	options.readOnly=true;
+
 	class Map *map;
 	try {
-		map=new class Map(mapPath, false);
+		map=new class Map(mapPath, false, &options);
 	} catch (std::exception& e) {
 		if (!quiet)
 			std::cout << "Could not load map: " << e.what() << '\n';
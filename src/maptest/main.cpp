@@ -0,0 +1,90 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include "../engine/gen/modifytiles.h"
+#include "../engine/map/map.h"
+#include "../engine/util.h"
+
+using namespace Engine;
+
+static const unsigned testRegionsSize=4; // map width/height in regions
+
+static double testGetHeight(unsigned x, unsigned y) {
+	return x*0.5+y;
+}
+
+static void testFunctorSetHeight(unsigned threadId, class Map *map, unsigned x, unsigned y, void *userData) {
+	MapTile *tile=map->getTileAtOffset(x, y, Engine::Map::Map::GetTileFlag::CreateDirty);
+	if (tile!=NULL)
+		tile->setHeight(testGetHeight(x, y));
+}
+
+static unsigned testCheck(class Map *map, uint64_t bitset) {
+	unsigned errors=0;
+	for(unsigned y=0; y<testRegionsSize*MapRegion::tilesSize; ++y)
+		for(unsigned x=0; x<testRegionsSize*MapRegion::tilesSize; ++x) {
+			const MapTile *tile=map->getTileAtOffset(x, y, Engine::Map::Map::GetTileFlag::None);
+			if (tile==NULL || tile->getHeight()!=testGetHeight(x, y) || tile->getBitset()!=bitset)
+				++errors;
+		}
+	return errors;
+}
+
+int main(int argc, char *argv[]) {
+	// Grab arguments.
+	if (argc!=2 && argc!=3) {
+		printf("Usage: %s mappath [threadcount]\n", argv[0]);
+		printf("Creates a new map at the given path and modifies it from several threads with a region cache far smaller than the map, checking the result is then read back intact.\n");
+		printf("Codecs etc. can be chosen via the usual MAP_REGION_* environment variables. Build with 'make tsan' to run under ThreadSanitizer.\n");
+		return EXIT_FAILURE;
+	}
+
+	const char *mapPath=argv[1];
+	unsigned threadCount=(argc>2 ? atoi(argv[2]) : 4);
+	if (threadCount<1)
+		threadCount=1;
+
+	// Only room for one region per thread, so that regions are constantly evicted (and saved) while other threads use their neighbours.
+	Engine::Map::Map::Options options;
+	options.regionCacheBytes=threadCount*MapRegion::getMemoryUsageEstimate();
+
+	// Create map and fill it.
+	class Map *map;
+	try {
+		map=new class Map(mapPath, testRegionsSize*MapRegion::tilesSize, testRegionsSize*MapRegion::tilesSize, &options);
+	} catch (std::exception& e) {
+		std::cout << "Could not create map: " << e.what() << '\n';
+		return EXIT_FAILURE;
+	}
+
+	const unsigned mapSize=testRegionsSize*MapRegion::tilesSize;
+	Gen::modifyTiles(map, 0, 0, mapSize, mapSize, threadCount, &testFunctorSetHeight, NULL, NULL, NULL);
+	Gen::modifyTiles(map, 0, 0, mapSize, mapSize, threadCount, &Gen::modifyTilesFunctorBitsetUnion, (void *)(uintptr_t)5, NULL, NULL);
+	Gen::modifyTiles(map, 0, 0, mapSize, mapSize, threadCount, &Gen::modifyTilesFunctorBitsetIntersection, (void *)(uintptr_t)4, NULL, NULL);
+
+	unsigned errors=testCheck(map, 4);
+	if (!map->save())
+		++errors;
+	delete map;
+
+	// Reload and check again.
+	try {
+		map=new class Map(mapPath, false, &options);
+	} catch (std::exception& e) {
+		std::cout << "Could not load map: " << e.what() << '\n';
+		return EXIT_FAILURE;
+	}
+	errors+=testCheck(map, 4);
+	delete map;
+
+	if (errors>0) {
+		printf("%u errors\n", errors);
+		return EXIT_FAILURE;
+	}
+
+	printf("OK\n");
+	return EXIT_SUCCESS;
+}
@@ -2,12 +2,75 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <new>
 
 #include "../engine/map/map.h"
 #include "../engine/map/maptiled.h"
 
+// Copies leaflet and the slippymap page into the map's directory, as needed to view the generated images.
+bool copySlippymapFiles(const char *baseDir) {
+	// Note: files already there are left alone, and source paths are relative to the bin directory (which tools are ran from).
+	char slippymapPath[1024]; // TODO: better
+
+	sprintf(slippymapPath, "%s/leaflet.css", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/leaflet.css", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap leaflet.css file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/leaflet.js", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/leaflet.js", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap leaflet.js file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/slippymap.html", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/slippymap.html", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap slippymap.html file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/images", baseDir);
+	if (!Util::isDir(slippymapPath) && !Util::makeDir(slippymapPath)) {
+		fprintf(stderr,"error: could not create slippymap images directory to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/images/layers.png", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/layers.png", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap layers.png image file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/images/layers-2x.png", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/layers-2x.png", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap layers-2x.png image file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/images/marker-icon.png", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/marker-icon.png", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap marker-icon.png image file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/images/marker-icon-2x.png", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/marker-icon-2x.png", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap marker-icon-2x.png image file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	sprintf(slippymapPath, "%s/images/marker-shadow.png", baseDir);
+	if (!Util::isFile(slippymapPath) && !std::filesystem::copy_file("../src/slippymap/images/marker-shadow.png", slippymapPath)) {
+		fprintf(stderr,"error: could not copy slippymap marker-shadow.png image file to '%s'\n", slippymapPath);
+		return false;
+	}
+
+	return true;
+}
+
 int main(int argc, char *argv[]) {
 	// Grab arguments.
 	if (argc!=2) {
@@ -20,9 +83,13 @@ int main(int argc, char *argv[]) {
 	// Load map
 	printf("Loading map at '%s'...\n", mapPath);
 
+	// Note: the map is opened read only so that any number of instances can run at once (and other tools can read it meanwhile).
+	Engine::Map::Map::Options options;
+	options.readOnly=true;
+
 	class Map *map;
 	try {
-		map=new class Map(mapPath, false);
+		map=new class Map(mapPath, false, &options);
 	} catch (std::exception& e) {
 		std::cout << "Could not load map: " << e.what() << '\n';
 		return EXIT_FAILURE;
@@ -33,8 +100,9 @@ int main(int argc, char *argv[]) {
 	unsigned mapHeight=map->getHeight();
 	unsigned mapSize=std::max(mapWidth, mapHeight);
 
-	unsigned slippyZoomOffset=MapTiled::maxZoom-1-std::ceil(std::log2(mapSize/MapTiled::imageSize));
-	unsigned slippyMaxNativeZoom=MapTiled::maxZoom-1-slippyZoomOffset;
+	unsigned maxZoom=MapTiled::getMaxZoom(map);
+	unsigned slippyZoomOffset=maxZoom-1-std::ceil(std::log2(mapSize/MapTiled::imageSize));
+	unsigned slippyMaxNativeZoom=maxZoom-1-slippyZoomOffset;
 
 	printf("Map is %u tiles wide and %u tiles high, giving size %u with zoom offset %u.\n", mapWidth, mapHeight, mapSize, slippyZoomOffset);
 
@@ -166,13 +234,37 @@ int main(int argc, char *argv[]) {
 
 	fclose(slippymapJs);
 
-	// Generate all needed images
-	MapTiled::ImageLayerSet imageLayerSet=MapTiled::ImageLayerSetAll;
-	if (!MapTiled::generateImage(map, slippyZoomOffset, 0, 0, imageLayerSet, 0, &utilProgressFunctorString, (void *)"Generating slippymap images... ")) { // ..... improve string
-		printf("\nCould not generate all images\n");
+	// Copy other files needed to view the map
+	printf("Copying slippymap files to '%s'...\n", map->getBaseDir());
+	if (!copySlippymapFiles(map->getBaseDir())) {
 		delete map;
 		return EXIT_FAILURE;
 	}
+
+	// Generate all needed images
+	// Note: we loop over every zoom level explicitly as MapTiled::generateImage does not generate children for layers it can draw directly.
+	MapTiled::ImageLayerSet imageLayerSet=MapTiled::ImageLayerSetAll;
+	const char *progressString="Generating slippymap images... "; // ..... improve string
+	unsigned long long int imagesTotal=0, imagesDone=0;
+	for(unsigned zoom=slippyZoomOffset; zoom<maxZoom; ++zoom)
+		imagesTotal+=(1llu<<(2*(zoom-slippyZoomOffset)));
+
+	Util::TimeMs startTimeMs=Util::getTimeMs();
+	for(unsigned zoom=slippyZoomOffset; zoom<maxZoom; ++zoom) {
+		unsigned maxXY=(1u<<(zoom-slippyZoomOffset));
+		for(unsigned y=0; y<maxXY; ++y)
+			for(unsigned x=0; x<maxXY; ++x) {
+				utilProgressFunctorString(((double)imagesDone)/imagesTotal, Util::getTimeMs()-startTimeMs, (void *)progressString);
+
+				if (!MapTiled::generateImage(map, zoom, x, y, imageLayerSet, 0, NULL, NULL)) {
+					printf("\nCould not generate all images\n");
+					delete map;
+					return EXIT_FAILURE;
+				}
+				++imagesDone;
+			}
+	}
+	utilProgressFunctorString(1.0, Util::getTimeMs()-startTimeMs, (void *)progressString);
 	printf("\n");
 
 	// Tidy up.